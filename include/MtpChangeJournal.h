@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_CHANGE_JOURNAL_H
+#define _MTP_CHANGE_JOURNAL_H
+
+#include <deque>
+
+#include "MtpTypes.h"
+
+namespace android {
+
+class MtpDataPacket;
+
+// Append-only log of the changes made to a storage, numbered with
+// monotonically increasing sequence numbers. Sync clients pass the token of
+// their last MTP_OPERATION_NX_GET_CHANGES call to fetch only what changed.
+class MtpChangeJournal {
+public:
+    enum Kind {
+        kAdded      = 1,
+        kRemoved    = 2,
+        kModified   = 3,
+        // also used for renames, in which case the parent is unchanged
+        kMoved      = 4,
+    };
+
+    // set in the reply when changes since the token are no longer known,
+    // the client has to enumerate the storage again
+    enum {
+        kStatusComplete     = 0,
+        kStatusTruncated    = 1,
+    };
+
+    struct Record {
+        uint64_t            sequence;
+        uint16_t            kind;
+        MtpObjectHandle     handle;
+        MtpObjectHandle     parent;
+        uint128_t           uid;
+    };
+
+private:
+    MtpString               mFilePath;
+    // identifies this journal, changes when the journal had to be recreated
+    uint32_t                mJournalID;
+    // sequence number of the oldest change still recorded
+    uint64_t                mFirstSequence;
+    uint64_t                mNextSequence;
+    std::deque<Record>      mRecords;
+    size_t                  mCapacity;
+    bool                    mDirty;
+
+public:
+                            MtpChangeJournal(const MtpString& root, size_t capacity = 4096);
+    virtual                 ~MtpChangeJournal();
+
+    bool                    load();
+    bool                    save();
+
+    // changes handed out during a session reach the disk only with a
+    // later save(), the marker written here has load() start a new journal
+    // if the session never ended
+    void                    beginSession();
+    // saves and drops the marker again
+    bool                    endSession();
+
+    void                    append(Kind kind, MtpObjectHandle handle,
+                                    MtpObjectHandle parent, const uint128_t& uid);
+
+    inline uint64_t         getToken() const { return mNextSequence; }
+    bool                    isTruncated(uint64_t token) const;
+
+    // writes the reply dataset of MTP_OPERATION_NX_GET_CHANGES
+    void                    writeChanges(uint64_t token, MtpDataPacket& packet) const;
+};
+
+}; // namespace android
+
+#endif // _MTP_CHANGE_JOURNAL_H
@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_COMPRESSOR_H
+#define _MTP_COMPRESSOR_H
+
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "MtpTypes.h"
+
+namespace android {
+
+// Turns the data of a compressed data phase into frames and back on worker
+// threads, so that the request thread only moves bytes between the file and
+// USB. Chunks come back from next() in the order they were submitted.
+//
+// A frame is a UInt32 payload length, or'ed with kFrameRaw when the payload
+// is the data as is, a UInt32 data length and the payload, which is an LZ4
+// block otherwise. A frame with no data ends the stream. Data that does not
+// compress is sent raw, so a frame is never larger than its data plus the
+// header.
+class MtpCompressor {
+public:
+    // data bytes per frame at most
+    static const size_t     kChunkSize = 64 * 1024;
+    static const size_t     kFrameHeaderSize = 8;
+    static const size_t     kMaxFrameSize = kFrameHeaderSize + kChunkSize;
+    static const uint32_t   kFrameRaw = 0x80000000;
+
+    struct Chunk {
+        // kChunkSize bytes
+        uint8_t*            mData;
+        size_t              mLength;
+        // kMaxFrameSize bytes, header included
+        uint8_t*            mFrame;
+        size_t              mFrameLength;
+        // false if the frame did not expand to its data
+        bool                mValid;
+
+    private:
+        friend class MtpCompressor;
+        enum State { FREE, QUEUED, BUSY, DONE };
+        State               mState;
+        // frame to data instead of data to frame
+        bool                mExpand;
+    };
+
+private:
+    std::vector<Chunk>      mChunks;
+    std::vector<std::thread> mThreads;
+    // chunks between mHead and mTail are in flight, oldest first
+    uint64_t                mHead;
+    uint64_t                mTail;
+    bool                    mRunning;
+    MtpMutex                mMutex;
+    std::condition_variable mQueued;
+    std::condition_variable mDone;
+
+public:
+                            MtpCompressor(int threads);
+    virtual                 ~MtpCompressor();
+
+    // chunk to fill before submit(), NULL while every chunk is in flight.
+    // The chunk last returned by next() is reused by this.
+    Chunk*                  acquire();
+    // mLength bytes of mData to a frame, or the frame in mFrame back to data
+    void                    submit(Chunk* chunk, bool expand);
+    // waits for the oldest submitted chunk, NULL if none is in flight
+    Chunk*                  next();
+
+    // parses a frame header, false if it cannot belong to a valid frame
+    static bool             parseHeader(const uint8_t* header, size_t& payloadLength,
+                                    size_t& dataLength, bool& raw);
+
+                            MtpCompressor(const MtpCompressor&) = delete;
+    MtpCompressor&          operator=(const MtpCompressor&) = delete;
+
+private:
+    void                    run();
+    static void             compress(Chunk* chunk);
+    static void             expand(Chunk* chunk);
+};
+
+}; // namespace android
+
+#endif // _MTP_COMPRESSOR_H
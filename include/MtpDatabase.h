@@ -17,6 +17,8 @@
 #ifndef _MTP_DATABASE_H
 #define _MTP_DATABASE_H
 
+#include <memory>
+
 #include "MtpTypes.h"
 #include "MtpServer.h"
 
@@ -57,6 +59,14 @@ public:
                                             MtpObjectFormat format,
                                             bool succeeded) = 0;
 
+    // called instead of a failed endSendObject when committedSize bytes of
+    // the transfer made it to the file. The object stays, partial, for the
+    // host to complete with SendPartialObject; one left alone for too long
+    // is removed.
+    virtual void                    keepPartialObject(const MtpString& path,
+                                            MtpObjectHandle handle,
+                                            uint64_t committedSize) = 0;
+
     virtual MtpObjectHandleList*    getObjectList(MtpStorageID storageID,
                                             MtpObjectFormat format,
                                             MtpObjectHandle parent) = 0;
@@ -108,6 +118,10 @@ public:
     virtual MtpResponseCode         moveFile(MtpObjectHandle handle,
                                             MtpObjectHandle new_parent) = 0;
 
+    // objects the server makes up rather than finds on the storage, which
+    // hosts can read but not change, nor put anything into
+    virtual bool                    isReadOnly(MtpObjectHandle handle) = 0;
+
     virtual MtpObjectHandleList*    getObjectReferences(MtpObjectHandle handle) = 0;
 
     virtual MtpResponseCode         setObjectReferences(MtpObjectHandle handle,
@@ -118,6 +132,35 @@ public:
 
     virtual MtpProperty*            getDevicePropertyDesc(MtpDeviceProperty property) = 0;
 
+    // writes the changes made to a storage since token, see MtpChangeJournal
+    virtual MtpResponseCode         getChanges(MtpStorageID storage, uint64_t token,
+                                            MtpDataPacket& packet) = 0;
+
+    // called while the server is idle to pick up changes made to the
+    // storages behind its back
+    virtual void                    revalidate() = 0;
+
+    // digests of whole objects, only valid while the file keeps the size
+    // and modification time they were computed for
+    virtual bool                    getObjectDigest(MtpObjectHandle handle, uint16_t algorithm,
+                                            uint64_t size, time_t modified,
+                                            uint8_t* outDigest) = 0;
+    virtual void                    setObjectDigest(MtpObjectHandle handle, uint16_t algorithm,
+                                            uint64_t size, time_t modified,
+                                            const uint8_t* digest) = 0;
+
+    // the output of MtpDigest::digestBlocks(), cached the same way
+    virtual std::shared_ptr<const UInt8List> getBlockDigests(MtpObjectHandle handle,
+                                            uint16_t algorithm, uint32_t blockSize,
+                                            uint64_t size, time_t modified) = 0;
+    virtual void                    setBlockDigests(MtpObjectHandle handle,
+                                            uint16_t algorithm, uint32_t blockSize,
+                                            uint64_t size, time_t modified,
+                                            std::shared_ptr<const UInt8List> digests) = 0;
+
+    // objects known and roughly what keeping them takes, for the stats
+    virtual void                    getStatistics(size_t& outObjects, size_t& outMemory) = 0;
+
     virtual void                    sessionStarted(MtpServer* server) = 0;
 
     virtual void                    sessionEnded() = 0;
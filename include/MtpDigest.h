@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_DIGEST_H
+#define _MTP_DIGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <switch.h>
+
+#include "MtpTypes.h"
+
+namespace android {
+
+// Incremental digest of object data, one of the MTP_NX_DIGEST_* algorithms.
+// CRC32, CRC32C and SHA-256 are those of libnx, which use the CPU's CRC32
+// and SHA-256 instructions; the rolling checksum is our own.
+class MtpDigest {
+public:
+    static const int        kMaxSize = 32;
+
+private:
+    uint16_t                mAlgorithm;
+    // CRC so far, or the two sums of the rolling checksum
+    uint32_t                mCrc;
+    Sha256Context           mSha256;
+    uint64_t                mLength;
+
+public:
+                            MtpDigest(uint16_t algorithm);
+
+    static bool             isSupported(uint16_t algorithm);
+    // size in bytes of the digests of algorithm, 0 if unknown
+    static int              getSize(uint16_t algorithm);
+
+    inline uint16_t         getAlgorithm() const { return mAlgorithm; }
+    inline uint64_t         getLength() const { return mLength; }
+
+    void                    reset();
+    void                    update(const void* data, size_t length);
+    // writes getSize() bytes, big endian, to out
+    void                    finish(uint8_t* out);
+
+    // digest of length bytes of path from offset, or to the end of the
+    // file if length is 0
+    static MtpResponseCode  digestFile(const char* path, uint16_t algorithm,
+                                    uint64_t offset, uint64_t length,
+                                    uint8_t* out, uint64_t& outLength);
+    // appends, for each blockSize bytes of path, the rolling checksum
+    // followed by the digest with algorithm
+    static MtpResponseCode  digestBlocks(const char* path, uint16_t algorithm,
+                                    uint32_t blockSize, UInt8List& out,
+                                    uint64_t& outLength);
+
+private:
+    void                    updateRolling(const uint8_t* data, size_t length);
+};
+
+}; // namespace android
+
+#endif // _MTP_DIGEST_H
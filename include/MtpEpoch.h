@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_EPOCH_H
+#define _MTP_EPOCH_H
+
+#include <atomic>
+#include <vector>
+
+#include <stdint.h>
+
+namespace android {
+
+// Epoch based reclamation for data that is read without locks.
+//
+// Readers bracket their accesses with enter()/leave(), which is a couple of
+// atomic operations and never blocks on a writer. A writer that unlinks an
+// object hands it to retire() instead of freeing it; the object is freed once
+// every reader that could still be looking at it has left. Writers must be
+// serialized by the caller.
+class MtpEpoch {
+public:
+    // enough for the request thread, the background workers and nesting
+    static const int        kMaxReaders = 16;
+
+    class ReadGuard {
+    private:
+        MtpEpoch&           mEpoch;
+        int                 mSlot;
+
+    public:
+        inline              ReadGuard(MtpEpoch& epoch) : mEpoch(epoch), mSlot(epoch.enter()) { }
+        inline              ~ReadGuard() { mEpoch.leave(mSlot); }
+
+                            ReadGuard(const ReadGuard&) = delete;
+        ReadGuard&          operator=(const ReadGuard&) = delete;
+    };
+
+private:
+    struct Retired {
+        void*               object;
+        void                (*destroy)(void*);
+        uint64_t            epoch;
+    };
+
+    std::atomic<uint64_t>   mEpoch;
+    // epoch each active reader entered in, 0 if the slot is free
+    std::atomic<uint64_t>   mReaders[kMaxReaders];
+    std::vector<Retired>    mRetired;
+
+public:
+                            MtpEpoch();
+    virtual                 ~MtpEpoch();
+
+    int                     enter();
+    void                    leave(int slot);
+
+    // writer side
+    void                    retire(void* object, void (*destroy)(void*));
+    // frees whatever no reader can reach anymore
+    void                    reclaim();
+    inline size_t           getRetiredCount() const { return mRetired.size(); }
+
+                            MtpEpoch(const MtpEpoch&) = delete;
+    MtpEpoch&               operator=(const MtpEpoch&) = delete;
+};
+
+}; // namespace android
+
+#endif // _MTP_EPOCH_H
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_FILE_CACHE_H
+#define _MTP_FILE_CACHE_H
+
+#include <list>
+
+#include <stdint.h>
+
+#include "MtpReadAhead.h"
+#include "MtpSplitFile.h"
+#include "MtpTypes.h"
+
+namespace android {
+
+// Files kept open for reading between requests, so that a host that
+// fetches an object as many GetPartialObject ranges pays for opening it
+// once. Files are looked up by object handle, and the least recently used
+// one is closed to make room for another.
+//
+// Horizon will not delete, rename or open for writing a file that is
+// open, so whatever does that invalidates the path first. The read-ahead
+// is told before a file is closed.
+class MtpFileCache {
+public:
+    static const size_t     kMaxFiles = 8;
+
+private:
+    struct Entry {
+        MtpObjectHandle     mHandle;
+        MtpString           mPath;
+        MtpSplitFile*       mFile;
+    };
+
+    // most recently used first
+    std::list<Entry>        mFiles;
+    uint64_t                mHits;
+    uint64_t                mMisses;
+    MtpReadAhead            mReadAhead;
+
+public:
+                            MtpFileCache();
+    virtual                 ~MtpFileCache();
+
+    // path open for reading, NULL if it cannot be opened. The file stays
+    // the cache's and is good until the next call.
+    MtpSplitFile*           get(MtpObjectHandle handle, const MtpString& path);
+    // closes path, and whatever is open below it
+    void                    invalidate(const MtpString& path);
+    void                    clear();
+
+    inline MtpReadAhead&    getReadAhead() { return mReadAhead; }
+
+    inline uint64_t         getHits() const { return mHits; }
+    inline uint64_t         getMisses() const { return mMisses; }
+
+                            MtpFileCache(const MtpFileCache&) = delete;
+    MtpFileCache&           operator=(const MtpFileCache&) = delete;
+
+private:
+    void                    close(Entry& entry);
+};
+
+}; // namespace android
+
+#endif // _MTP_FILE_CACHE_H
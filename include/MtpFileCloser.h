@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_FILE_CLOSER_H
+#define _MTP_FILE_CLOSER_H
+
+#include <condition_variable>
+#include <deque>
+#include <thread>
+
+#include "MtpTypes.h"
+
+namespace android {
+
+// Closes files on a thread of its own. Closing flushes a file on the SD
+// card, which costs more than writing a small one in the first place.
+class MtpFileCloser {
+public:
+    // files waiting to be closed before close() blocks
+    static const size_t     kMaxPending = 32;
+
+private:
+    std::deque<int>         mPending;
+    // taken off mPending but not closed yet
+    int                     mClosing;
+    bool                    mRunning;
+    MtpMutex                mMutex;
+    std::condition_variable mQueued;
+    std::condition_variable mClosed;
+    std::thread             mThread;
+
+public:
+                            MtpFileCloser();
+    virtual                 ~MtpFileCloser();
+
+    void                    close(int fd);
+    // waits until every file passed to close() is closed
+    void                    drain();
+
+                            MtpFileCloser(const MtpFileCloser&) = delete;
+    MtpFileCloser&          operator=(const MtpFileCloser&) = delete;
+
+private:
+    void                    run();
+};
+
+}; // namespace android
+
+#endif // _MTP_FILE_CLOSER_H
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_IO_SCHEDULER_H
+#define _MTP_IO_SCHEDULER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+
+#include <stdint.h>
+
+#include "MtpTypes.h"
+
+namespace android {
+
+// Keeps background work off the SD card while the host is being served.
+// Requests are foreground and never wait. A background job asks before
+// each file system operation. It waits while a request is in progress,
+// and for kForegroundGrace after one, since hosts send requests back to
+// back. Background operations are also limited to kBackgroundRate per
+// second by a token bucket, so that a job that gets going does not keep
+// the card busy when the next request arrives.
+class MtpIoScheduler {
+public:
+    enum Class { FOREGROUND, BACKGROUND, CLASS_COUNT };
+
+    static const int        kBackgroundRate = 200;
+    // operations a background job may do at once after a pause
+    static const int        kBackgroundBurst = 16;
+    static constexpr std::chrono::milliseconds kForegroundGrace{250};
+
+    struct Stats {
+        uint64_t            mOperations;
+        // waiting, or in progress for foreground requests
+        int                 mQueued;
+        int                 mMaxQueued;
+        uint64_t            mWaitMicros;
+        uint64_t            mMaxWaitMicros;
+    };
+
+    // a request, for as long as it is in scope
+    class Foreground {
+    private:
+        MtpIoScheduler&     mScheduler;
+    public:
+        inline              Foreground(MtpIoScheduler& scheduler) : mScheduler(scheduler) {
+                                mScheduler.beginForeground();
+                            }
+        inline              ~Foreground() { mScheduler.endForeground(); }
+    };
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    // requests in progress
+    int                     mForeground;
+    Clock::time_point       mForegroundEnd;
+    double                  mTokens;
+    Clock::time_point       mRefilled;
+    Stats                   mStats[CLASS_COUNT];
+    mutable MtpMutex        mMutex;
+    std::condition_variable mChanged;
+
+public:
+                            MtpIoScheduler();
+    virtual                 ~MtpIoScheduler();
+
+    void                    beginForeground();
+    void                    endForeground();
+    // waits until a background operation may go, false if running turned
+    // false in the meantime
+    bool                    acquireBackground(const std::atomic<bool>& running);
+
+    Stats                   getStats(Class c) const;
+
+                            MtpIoScheduler(const MtpIoScheduler&) = delete;
+    MtpIoScheduler&         operator=(const MtpIoScheduler&) = delete;
+
+private:
+    // with mMutex held
+    void                    refill(Clock::time_point now);
+};
+
+}; // namespace android
+
+#endif // _MTP_IO_SCHEDULER_H
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_LZ4_H
+#define _MTP_LZ4_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+namespace android {
+
+// Codec for the LZ4 block format, so that hosts can use the stock liblz4
+// LZ4_decompress_safe()/LZ4_compress_default() on the other end.
+class MtpLz4 {
+public:
+    // compresses length bytes of src into dst, returns the compressed length
+    // or 0 if it does not fit in capacity
+    static size_t           compress(const uint8_t* src, size_t length,
+                                    uint8_t* dst, size_t capacity);
+    // returns the decompressed length, or -1 if src is malformed or does
+    // not fit in capacity
+    static ssize_t          decompress(const uint8_t* src, size_t length,
+                                    uint8_t* dst, size_t capacity);
+};
+
+}; // namespace android
+
+#endif // _MTP_LZ4_H
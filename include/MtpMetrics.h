@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_METRICS_H
+#define _MTP_METRICS_H
+
+#include <string>
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace android {
+
+// Counters of what the server has been doing, for the stats object hosts
+// read from MTP_STATE_DIRECTORY. Whichever thread does the work updates
+// them with relaxed atomics and nothing locks them, so a report is close
+// to, but not quite, a snapshot.
+class MtpMetrics {
+public:
+    // transfer rates are kept per second for this long
+    static const size_t     kRateSeconds = 64;
+    // operation latencies fall in power of two buckets of microseconds
+    static const size_t     kLatencyBuckets = 32;
+    // distinct operation codes counted, later ones are not
+    static const size_t     kMaxOperations = 64;
+    // reports are padded to this, so that the object keeps the size its
+    // ObjectInfo announced
+    static const size_t     kReportSize = 16384;
+
+    static void             addBytesIn(size_t bytes);
+    static void             addBytesOut(size_t bytes);
+    static void             recordOperation(uint16_t operation, uint64_t micros);
+    // events of the session, and those of none or that could not be sent
+    static void             addEventsQueued(size_t count);
+    static void             addEventsSent(size_t count);
+    static void             addEventsDropped(size_t count);
+
+    // appends the counters as members of a JSON object being written
+    static void             appendJson(std::string& out);
+    // appends printf style
+    static void             append(std::string& out, const char* format, ...)
+                                    __attribute__((format(printf, 2, 3)));
+};
+
+}; // namespace android
+
+#endif // _MTP_METRICS_H
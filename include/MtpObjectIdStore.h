@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_OBJECT_ID_STORE_H
+#define _MTP_OBJECT_ID_STORE_H
+
+#include <map>
+#include <set>
+#include <vector>
+
+#include "MtpTypes.h"
+
+namespace android {
+
+// Remembers the object handle and persistent unique identifier given to each
+// path of a storage, so hosts see the same identity for an object across
+// sessions and reboots. Kept in MTP_STATE_DIRECTORY at the storage root.
+class MtpObjectIdStore {
+public:
+    struct Record {
+        MtpObjectHandle     handle;
+        uint128_t           uid;
+    };
+
+private:
+    // storage root, paths are recorded relative to it
+    MtpString               mRoot;
+    MtpString               mFilePath;
+    std::map<MtpString, Record> mRecords;
+    // first handle never given out by a previous session
+    MtpObjectHandle         mNextHandle;
+    bool                    mDirty;
+
+public:
+                            MtpObjectIdStore(const MtpString& root);
+    virtual                 ~MtpObjectIdStore();
+
+    bool                    load();
+    bool                    save();
+
+    // returns NULL if the path has no identity yet
+    const Record*           find(const MtpString& path) const;
+    // returns the record for path, creating a new unique identifier if
+    // needed, or NULL if path is not below the root
+    const Record*           assign(const MtpString& path, MtpObjectHandle handle);
+    // moves the identity of path and everything below it
+    void                    rename(const MtpString& oldPath, const MtpString& newPath);
+    // forgets path and everything below it
+    void                    remove(const MtpString& path);
+    // forgets what directory held but no longer does, names being the
+    // complete listing of it
+    void                    prune(const MtpString& directory, const std::set<MtpString>& names);
+
+    inline const MtpString& getRoot() const { return mRoot; }
+    inline MtpObjectHandle  getNextHandle() const { return mNextHandle; }
+    void                    setNextHandle(MtpObjectHandle handle);
+    inline size_t           size() const { return mRecords.size(); }
+    // appends the handle of every recorded path
+    void                    getHandles(std::vector<MtpObjectHandle>& outHandles) const;
+
+private:
+    bool                    getRelativePath(const MtpString& path, MtpString& outPath) const;
+};
+
+}; // namespace android
+
+#endif // _MTP_OBJECT_ID_STORE_H
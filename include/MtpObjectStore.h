@@ -0,0 +1,204 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_OBJECT_STORE_H
+#define _MTP_OBJECT_STORE_H
+
+#include <atomic>
+#include <stdexcept>
+
+#include "MtpEpoch.h"
+#include "MtpTypes.h"
+
+namespace android {
+
+// Maps object handles to immutable values, readable without locks.
+//
+// Handles are small integers handed out in order, so they index a table of
+// chunks directly. Readers hold a ReadGuard while they use what get()/at()
+// returned. Writers never modify a value in place: put() publishes a new copy
+// and retires the old one through the epoch, so a reader keeps a consistent
+// snapshot of every value it looked at. Writers must be serialized by the
+// caller.
+template <class T>
+class MtpObjectStore {
+public:
+    typedef MtpEpoch::ReadGuard ReadGuard;
+
+    class const_iterator {
+    private:
+        const MtpObjectStore*   mStore;
+        MtpObjectHandle         mHandle;
+        const T*                mValue;
+
+        void seek() {
+            while (mHandle < mStore->mLimit.load()) {
+                // a chunk never allocated holds nothing
+                if (!mStore->mChunks[mHandle >> kChunkBits].load()) {
+                    mHandle = (mHandle | (kChunkSize - 1)) + 1;
+                    continue;
+                }
+                mValue = mStore->get(mHandle);
+                if (mValue)
+                    return;
+                mHandle++;
+            }
+            mHandle = kInvalidObjectHandle;
+            mValue = NULL;
+        }
+
+    public:
+        const_iterator(const MtpObjectStore* store, MtpObjectHandle handle)
+            :   mStore(store), mHandle(handle), mValue(NULL)
+        {
+            if (mHandle != kInvalidObjectHandle)
+                seek();
+        }
+
+        inline MtpObjectHandle  handle() const { return mHandle; }
+        inline const T&         operator*() const { return *mValue; }
+        inline const T*         operator->() const { return mValue; }
+
+        const_iterator& operator++() {
+            mHandle++;
+            seek();
+            return *this;
+        }
+
+        inline bool operator==(const const_iterator& other) const { return mHandle == other.mHandle; }
+        inline bool operator!=(const const_iterator& other) const { return mHandle != other.mHandle; }
+    };
+
+private:
+    static const uint32_t       kChunkBits = 10;
+    static const uint32_t       kChunkSize = 1 << kChunkBits;
+    static const uint32_t       kMaxChunks = 4096;
+
+    typedef std::atomic<const T*> Slot;
+
+    std::atomic<Slot*>          mChunks[kMaxChunks];
+    // one past the highest handle stored, walks stop there
+    std::atomic<MtpObjectHandle> mLimit;
+    std::atomic<size_t>         mSize;
+    mutable MtpEpoch            mEpoch;
+
+    static void destroy(void* value) {
+        delete static_cast<const T*>(value);
+    }
+
+    Slot* getSlot(MtpObjectHandle handle) const {
+        if (handle >= kMaxChunks * kChunkSize)
+            return NULL;
+        Slot* chunk = mChunks[handle >> kChunkBits].load();
+        return chunk ? &chunk[handle & (kChunkSize - 1)] : NULL;
+    }
+
+public:
+    MtpObjectStore()
+        :   mLimit(0),
+            mSize(0)
+    {
+        for (uint32_t i = 0; i < kMaxChunks; i++)
+            mChunks[i].store(NULL);
+    }
+
+    virtual ~MtpObjectStore() {
+        clear();
+        for (uint32_t i = 0; i < kMaxChunks; i++)
+            delete[] mChunks[i].load();
+    }
+
+    inline MtpEpoch&        getEpoch() const { return mEpoch; }
+
+    // reader side, valid while a ReadGuard is held
+
+    const T* get(MtpObjectHandle handle) const {
+        Slot* slot = getSlot(handle);
+        return slot ? slot->load() : NULL;
+    }
+
+    const T& at(MtpObjectHandle handle) const {
+        const T* value = get(handle);
+        if (!value)
+            throw std::out_of_range("no such object handle");
+        return *value;
+    }
+
+    inline size_t           size() const { return mSize.load(); }
+    // bytes of the table, the values themselves not included
+    size_t getTableMemory() const {
+        size_t chunks = 0;
+        for (uint32_t i = 0; i < kMaxChunks; i++)
+            chunks += mChunks[i].load() != NULL;
+        return sizeof(*this) + chunks * kChunkSize * sizeof(Slot);
+    }
+
+    inline const_iterator   begin() const { return const_iterator(this, 0); }
+    inline const_iterator   end() const { return const_iterator(this, kInvalidObjectHandle); }
+    inline const_iterator   upper_bound(MtpObjectHandle handle) const {
+        return const_iterator(this, handle == kInvalidObjectHandle ? handle : handle + 1);
+    }
+
+    // writer side
+
+    bool put(MtpObjectHandle handle, const T& value) {
+        if (handle >= kMaxChunks * kChunkSize)
+            return false;
+
+        std::atomic<Slot*>& chunk = mChunks[handle >> kChunkBits];
+        if (!chunk.load()) {
+            Slot* slots = new Slot[kChunkSize];
+            for (uint32_t i = 0; i < kChunkSize; i++)
+                slots[i].store(NULL);
+            chunk.store(slots);
+        }
+
+        const T* old = chunk.load()[handle & (kChunkSize - 1)].exchange(new T(value));
+        if (old)
+            mEpoch.retire(const_cast<T*>(old), destroy);
+        else
+            mSize++;
+        if (handle >= mLimit.load())
+            mLimit.store(handle + 1);
+        return true;
+    }
+
+    bool erase(MtpObjectHandle handle) {
+        Slot* slot = getSlot(handle);
+        const T* old = slot ? slot->exchange(NULL) : NULL;
+        if (!old)
+            return false;
+
+        mEpoch.retire(const_cast<T*>(old), destroy);
+        mSize--;
+        // readers only ever find empty slots above the new limit
+        MtpObjectHandle limit = mLimit.load();
+        while (limit > 0 && !get(limit - 1))
+            limit--;
+        mLimit.store(limit);
+        return true;
+    }
+
+    void clear() {
+        MtpObjectHandle limit = mLimit.load();
+        for (MtpObjectHandle handle = 0; handle < limit; handle++)
+            erase(handle);
+    }
+};
+
+}; // namespace android
+
+#endif // _MTP_OBJECT_STORE_H
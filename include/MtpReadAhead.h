@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_READ_AHEAD_H
+#define _MTP_READ_AHEAD_H
+
+#include <condition_variable>
+#include <thread>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "MtpTypes.h"
+
+namespace android {
+
+class MtpSplitFile;
+
+// Reads ahead of a host that fetches an object as consecutive
+// GetPartialObject ranges, so that the next request is sent from memory
+// while the card works on the one after. Once two requests in a row
+// start where the one before ended, a window the size of the last
+// request, within kMinWindow and kMaxWindow, is read past it on a thread
+// of its own. A request anywhere else drops what was read ahead.
+class MtpReadAhead {
+public:
+    // windows are read kReadSize at a time, at multiples of it but for the
+    // first read, which is also what the request thread may wait behind
+    static const size_t     kReadSize = 128 * 1024;
+    static const size_t     kMinWindow = 2 * kReadSize;
+    static const size_t     kMaxWindow = 16 * kReadSize;
+
+private:
+    struct Window {
+        enum State { EMPTY, QUEUED, BUSY, READY };
+        State               mState;
+        // kMaxWindow bytes, page aligned, allocated once needed
+        uint8_t*            mData;
+        uint64_t            mOffset;
+        size_t              mLength;
+        // what was read of mLength, short at the end of the file
+        size_t              mFilled;
+    };
+
+    Window                  mWindows[2];
+    // the object read ahead in
+    MtpSplitFile*           mFile;
+    // where the next request starts if it follows the last one
+    uint64_t                mNext;
+    // requests in a row that did
+    int                     mSequential;
+    // the window being read is dropped
+    bool                    mCancelled;
+    bool                    mRunning;
+    // bytes of requests sent from memory, and read for them on the spot
+    uint64_t                mHits;
+    uint64_t                mMisses;
+    MtpMutex                mMutex;
+    // split files are not safe to read from two threads at once
+    MtpMutex                mFileMutex;
+    std::condition_variable mQueued;
+    std::condition_variable mDone;
+    std::thread             mThread;
+
+public:
+                            MtpReadAhead();
+    virtual                 ~MtpReadAhead();
+
+    // a request for length bytes at offset of file is about to be sent
+    void                    access(MtpSplitFile* file, uint64_t offset, uint64_t length);
+    // pread() of file, from memory where it was read ahead
+    ssize_t                 pread(MtpSplitFile* file, void* buffer, size_t length, uint64_t offset);
+    // file is about to be closed, waits until it is not read anymore
+    void                    release(MtpSplitFile* file);
+
+    inline uint64_t         getHits() const { return mHits; }
+    inline uint64_t         getMisses() const { return mMisses; }
+
+                            MtpReadAhead(const MtpReadAhead&) = delete;
+    MtpReadAhead&           operator=(const MtpReadAhead&) = delete;
+
+private:
+    void                    run();
+    // with mMutex held
+    void                    discard(std::unique_lock<std::mutex>& lock);
+};
+
+}; // namespace android
+
+#endif // _MTP_READ_AHEAD_H
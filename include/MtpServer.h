@@ -24,13 +24,26 @@
 #include "mtp.h"
 #include "MtpUtils.h"
 #include "USBMtpInterface.h"
+#include "MtpWriteBuffer.h"
+
+#include <atomic>
+#include <ctime>
+#include <deque>
+#include <memory>
 
 #include <unistd.h>
 
 namespace android {
 
+class MtpCompressor;
 class MtpDatabase;
+class MtpDigest;
+class MtpFileCache;
+class MtpFileCloser;
+class MtpIoScheduler;
 class MtpStorage;
+class MtpTrash;
+struct mtp_file_range;
 
 class MtpServer {
 
@@ -41,7 +54,7 @@ private:
     MtpDatabase*        mDatabase;
 
     // keep state whether the server should be running
-    bool                mRunning;
+    std::atomic<bool>   mRunning;
 
     // appear as a PTP device
     bool                mPtp;
@@ -55,22 +68,59 @@ private:
     // current session ID
     MtpSessionID        mSessionID;
     // true if we have an open session and mSessionID is valid
-    bool                mSessionOpen;
+    std::atomic<bool>   mSessionOpen;
+    // when the database was last checked against the file system
+    std::time_t         mLastRevalidate;
 
     MtpRequestPacket    mRequest;
     MtpDataPacket       mData;
     MtpResponsePacket   mResponse;
     MtpEventPacket      mEvent;
 
-    MtpStorageList      mStorages;
+    // replaced as a whole when storages come and go, so requests can use
+    // the list without holding mStorageMutex
+    std::shared_ptr<const MtpStorageList> mStorages;
+    MtpMutex            mStorageMutex;
+
+    struct Event {
+        MtpEventCode        mCode;
+        uint32_t            mParameters[3];
+    };
+    // events may be posted from any thread, the request thread sends them
+    std::deque<Event>   mEvents;
+    MtpMutex            mEventMutex;
 
     // handle for new object, set by SendObjectInfo and used by SendObject
     MtpObjectHandle     mSendObjectHandle;
     MtpObjectFormat     mSendObjectFormat;
     MtpString           mSendObjectFilePath;
-    size_t              mSendObjectFileSize;
+    uint64_t            mSendObjectFileSize;
+    // file created and preallocated by SendObjectInfo, -1 if none
+    int                 mSendObjectFD;
+    // free space taken for it
+    uint64_t            mSendObjectAllocated;
+    // digest uploads on the fly for MTP_PROPERTY_NX_CONTENT_*
+    bool                mUploadDigests;
 
-    MtpMutex               mMutex;
+    // MTP_NX_COMPRESSION_* of object data phases, chosen by the host for
+    // the session
+    uint16_t            mCompression;
+    std::unique_ptr<MtpCompressor> mCompressor;
+
+    // keeps background jobs off the card while requests are served
+    std::unique_ptr<MtpIoScheduler> mScheduler;
+    // deleted objects go here, so the host does not wait for the unlinks
+    std::unique_ptr<MtpTrash> mTrash;
+    // closes the files of small uploads while the next ones come in
+    std::unique_ptr<MtpFileCloser> mCloser;
+    // files GetObject and GetPartialObject read, kept open between requests
+    std::unique_ptr<MtpFileCache> mFileCache;
+    // MTP_STATS_FILE_NAME as last generated, which the pieces of it that
+    // GetPartialObject asks for past the first are read from
+    MtpString           mStats;
+
+    // serializes request execution
+    MtpMutex            mMutex;
 
     // represents an MTP object that is being edited using the android extensions
     // for direct editing (BeginEditObject, SendPartialObject, TruncateObject and EndEditObject)
@@ -81,17 +131,28 @@ private:
         uint64_t            mSize;
         MtpObjectFormat     mFormat;
         int                 mFD;
+        // SendPartialObject data on its way to mFD, which has to be
+        // flushed before anything else uses the file
+        MtpWriteBuffer      mBuffer;
+        // mWriteSequence at the last write to mBuffer
+        uint64_t            mLastWrite;
+        // mBuffer could not write out what it held when it had to make
+        // room or the host went quiet, everything after fails
+        bool                mFailed;
 
         ObjectEdit(MtpObjectHandle handle, const MtpString& path, uint64_t size,
-            MtpObjectFormat format, int fd)
-                : mHandle(handle), mPath(path), mSize(size), mFormat(format), mFD(fd) {
+            MtpObjectFormat format, int fd, uint64_t clusterSize)
+                : mHandle(handle), mPath(path), mSize(size), mFormat(format), mFD(fd),
+                  mBuffer(fd, clusterSize), mLastWrite(0), mFailed(false) {
             }
 
         virtual ~ObjectEdit() {
+            mBuffer.flush();
             close(mFD);
         }
     };
     Vector<ObjectEdit*>  mObjectEditList;
+    uint64_t            mWriteSequence;
 
 public:
                         MtpServer(USBMtpInterface* usb, MtpDatabase* database, bool ptp,
@@ -99,7 +160,10 @@ public:
     virtual             ~MtpServer();
 
     MtpStorage*         getStorage(MtpStorageID id);
-    inline bool         hasStorage() { return mStorages.size() > 0; }
+    // the storage path is on, NULL if none
+    MtpStorage*         getStorageForPath(const MtpString& path);
+    inline std::shared_ptr<const MtpStorageList> getStorages() const { return std::atomic_load(&mStorages); }
+    inline bool         hasStorage() { return getStorages()->size() > 0; }
     bool                hasStorage(MtpStorageID id);
     void                addStorage(MtpStorage* storage);
     void                removeStorage(MtpStorage* storage);
@@ -107,6 +171,8 @@ public:
     void                run();
     void                stop();
 
+    inline void         setUploadDigests(bool enable) { mUploadDigests = enable; }
+
     void                sendObjectAdded(MtpObjectHandle handle);
     void                sendObjectRemoved(MtpObjectHandle handle);
     void                sendObjectInfoChanged(MtpObjectHandle handle);
@@ -120,12 +186,31 @@ private:
                                   uint32_t param1,
                                   uint32_t param2,
                                   uint32_t param3);
+    void                flushEvents();
+    void                invalidateFreeSpace();
+    void                fileResized(const MtpString& path, uint64_t oldSize, uint64_t newSize);
 
     void                addEditObject(MtpObjectHandle handle, MtpString& path,
                                 uint64_t size, MtpObjectFormat format, int fd);
     ObjectEdit*         getEditObject(MtpObjectHandle handle);
     void                removeEditObject(MtpObjectHandle handle);
-    void                commitEdit(ObjectEdit* edit);
+    bool                commitEdit(ObjectEdit* edit);
+    MtpWriteBuffer&     getWriteBuffer(ObjectEdit* edit);
+    // of the storage path is on, 0 if none
+    uint64_t            getClusterSize(const MtpString& path);
+    void                flushEdits();
+    void                cancelSendObject();
+    void                closeSendObjectFile();
+    void                resetSession();
+    void                closeCachedFiles();
+    void                logIoStats();
+    // the contents of MTP_STATS_FILE_NAME, kReportSize of MtpMetrics
+    void                writeStats(MtpString& out);
+    bool                openForReading(MtpObjectHandle handle, const MtpString& path,
+                                       uint64_t offset, uint64_t length,
+                                       struct mtp_file_range* mfr);
+    MtpResponseCode     deleteObject(MtpObjectHandle handle);
+    MtpResponseCode     receiveSmallObject();
 
     bool                handleRequest();
 
@@ -159,6 +244,11 @@ private:
     MtpResponseCode     doTruncateObject();
     MtpResponseCode     doBeginEditObject();
     MtpResponseCode     doEndEditObject();
+    MtpResponseCode     doGetChanges();
+    MtpResponseCode     doGetObjectDigest();
+    MtpResponseCode     doGetBlockDigests();
+    MtpResponseCode     doSetCompression();
+    MtpResponseCode     doDumpTrace();
 };
 
 }; // namespace android
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_SPLIT_FILE_H
+#define _MTP_SPLIT_FILE_H
+
+#include <string>
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+namespace android {
+
+// A file as Horizon stores those that FAT32 cannot hold: a directory with
+// the archive bit set, holding the data in parts named 00, 01 and so on.
+// Every part but the last is kPartSize bytes long. A plain file opens as
+// well, as a file of a single part, so that readers need not care.
+class MtpSplitFile {
+public:
+    static const uint64_t   kPartSize = 0xFFFF0000;
+
+private:
+    std::string             mPath;
+    int                     mFlags;
+    bool                    mSplit;
+    // the part open in mFD
+    int                     mPart;
+    int                     mFD;
+    // of read() and write()
+    uint64_t                mOffset;
+
+public:
+                            MtpSplitFile();
+    virtual                 ~MtpSplitFile();
+
+    // flags as for open(), parts are created as needed with O_CREAT
+    bool                    open(const char* path, int flags);
+    void                    close();
+    ssize_t                 read(void* buffer, size_t length);
+    ssize_t                 write(const void* buffer, size_t length);
+    // at offset, without moving the position read() and write() use
+    ssize_t                 pread(void* buffer, size_t length, uint64_t offset);
+    ssize_t                 pwrite(const void* buffer, size_t length, uint64_t offset);
+    bool                    seek(uint64_t offset);
+    int                     fsync();
+    // of the whole file
+    int                     fstat(struct stat* st);
+    inline bool             isSplit() const { return mSplit; }
+
+    // stat() that sees a split file as the file it stands for
+    static int              stat(const char* path, struct stat* st);
+    // an empty split file in place of whatever path was
+    static bool             create(const char* path);
+    // unlink() for plain and split files alike
+    static int              remove(const char* path);
+
+                            MtpSplitFile(const MtpSplitFile&) = delete;
+    MtpSplitFile&           operator=(const MtpSplitFile&) = delete;
+
+private:
+    bool                    openPart(int part);
+    static std::string      getPartPath(const std::string& path, int part);
+    // number of parts, 0 if path is not a split file
+    static int              countParts(const char* path);
+};
+
+}; // namespace android
+
+#endif // _MTP_SPLIT_FILE_H
@@ -17,6 +17,9 @@
 #ifndef _MTP_STORAGE_H
 #define _MTP_STORAGE_H
 
+#include <atomic>
+#include <ctime>
+
 #include "MtpTypes.h"
 #include "mtp.h"
 
@@ -35,6 +38,14 @@ private:
     // amount of free space to leave unallocated
     uint64_t                mReserveSpace;
     bool                    mRemovable;
+    // statvfs() may have to read the whole allocation bitmap, so free space
+    // is kept up to date with the changes we make and only checked against
+    // the file system now and then. -1 until the first check.
+    std::atomic<int64_t>    mFreeSpace;
+    // f_bsize of the file system, which is the cluster size of FAT32 and
+    // exFAT
+    uint64_t                mClusterSize;
+    std::atomic<std::time_t> mReconciled;
 
 public:
                             MtpStorage(MtpStorageID id, const char* filePath,
@@ -48,6 +59,15 @@ public:
     int                     getAccessCapability() const;
     uint64_t                getMaxCapacity();
     uint64_t                getFreeSpace();
+    // takes free space from the file system again if the last time was
+    // longer than interval seconds ago
+    void                    reconcileFreeSpace(std::time_t interval);
+    // changes we did not make, free space is taken from the file system
+    // the next time it is needed
+    inline void             invalidateFreeSpace() { mReconciled = 0; }
+    // one of our files went from oldSize to newSize bytes
+    void                    fileResized(uint64_t oldSize, uint64_t newSize);
+    inline uint64_t         getClusterSize() const { return mClusterSize; }
     const char*             getDescription() const;
     inline const char*      getPath() const { return mFilePath.c_str(); }
     inline bool             isRemovable() const { return mRemovable; }
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_TRACE_H
+#define _MTP_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace android {
+
+// Spans of time spent in requests, USB transfers, file I/O and the
+// database, kept in a ring of the last kMaxEvents of them. Recording one
+// takes two clock reads and no lock, so tracing is always on. dump()
+// writes the ring out in the Chrome trace event format, for
+// chrome://tracing or Perfetto.
+class MtpTrace {
+public:
+    static const size_t     kMaxEvents = 16384;
+    static constexpr const char* kDefaultPath = "sdmc:/mtp-trace.json";
+
+    // a span from construction to the end of the scope. category and name
+    // must be string literals, or outlive the trace otherwise.
+    class Span {
+    private:
+        const char*         mCategory;
+        const char*         mName;
+        uint64_t            mArg;
+        uint64_t            mStart;
+
+    public:
+        inline              Span(const char* category, const char* name, uint64_t arg = 0)
+                                : mCategory(category), mName(name), mArg(arg), mStart(now()) {}
+        inline              ~Span() { record(mCategory, mName, mStart, now(), mArg); }
+        // what the span ends up being about, if not known at the start
+        inline void         setArg(uint64_t arg) { mArg = arg; }
+
+                            Span(const Span&) = delete;
+        Span&               operator=(const Span&) = delete;
+    };
+
+    // microseconds since an arbitrary point
+    static uint64_t         now();
+    static void             record(const char* category, const char* name,
+                                   uint64_t start, uint64_t end, uint64_t arg);
+    // false if path could not be written
+    static bool             dump(const char* path);
+};
+
+}; // namespace android
+
+#endif // _MTP_TRACE_H
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_TRASH_H
+#define _MTP_TRASH_H
+
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+#include "MtpTypes.h"
+
+namespace android {
+
+class MtpIoScheduler;
+
+// Deletes objects by renaming them into a trash directory in
+// MTP_STATE_DIRECTORY of their storage, which a low priority thread empties
+// afterwards as background work of the scheduler. Whatever a previous run
+// left in there is purged too.
+class MtpTrash {
+private:
+    MtpIoScheduler*         mScheduler;
+    // storage roots, with a trailing slash
+    std::vector<MtpString>  mRoots;
+    // roots whose trash may have something in it
+    std::vector<MtpString>  mDirty;
+    // roots whose trash had something deleted since takePurged()
+    std::vector<MtpString>  mPurged;
+    uint32_t                mSequence;
+    std::atomic<bool>       mRunning;
+    MtpMutex                mMutex;
+    std::condition_variable mChanged;
+    std::thread             mThread;
+
+public:
+                            MtpTrash(MtpIoScheduler* scheduler);
+    virtual                 ~MtpTrash();
+
+    void                    addRoot(const MtpString& root);
+    void                    removeRoot(const MtpString& root);
+
+    // path is gone from its place once this returns. Paths outside of the
+    // roots, or that cannot be moved, are deleted right away, and false
+    // returned. Space of the others only comes free as the trash is purged.
+    bool                    remove(const MtpString& path);
+    // whether the trash of root had anything deleted since the last call
+    bool                    takePurged(const MtpString& root);
+
+                            MtpTrash(const MtpTrash&) = delete;
+    MtpTrash&               operator=(const MtpTrash&) = delete;
+
+private:
+    void                    run();
+    // false if stopped before everything was deleted. Background purges
+    // wait for the scheduler before each step.
+    bool                    purge(const MtpString& path, bool background);
+    bool                    schedule(bool background);
+    static MtpString        getTrashPath(const MtpString& root);
+};
+
+}; // namespace android
+
+#endif // _MTP_TRASH_H
@@ -19,6 +19,12 @@
 
 #include <stdint.h>
 
+// per-storage directory holding server state (object ids, ...). Hosts
+// see a read-only folder of that name with only MTP_STATS_FILE_NAME in it.
+#define MTP_STATE_DIRECTORY     ".mtp-server"
+// server metrics in JSON, generated whenever a host reads it
+#define MTP_STATS_FILE_NAME     "stats.json"
+
 namespace android {
 
 bool parseDateTime(const char* dateTime, time_t& outSeconds);
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_WRITE_BUFFER_H
+#define _MTP_WRITE_BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+namespace android {
+
+class MtpSplitFile;
+
+// Write-back buffer of a file being received. Hosts that write through
+// SendPartialObject tend to send many small adjacent ranges, and the
+// container header leaves the data of a SendObject off by its size, so
+// writes that overlap or follow what is buffered are merged into it, and
+// the file gets few large writes that end on a cluster boundary instead.
+//
+// The buffer holds a single range of the file. A write elsewhere flushes
+// it first, so that the file always sees the writes in the order they
+// were made. The memory is taken with the first write and given back by
+// release().
+class MtpWriteBuffer {
+public:
+    static const size_t     kCapacity = 256 * 1024;
+
+private:
+    int                     mFD;
+    // written to in place of mFD when set
+    MtpSplitFile*           mFile;
+    uint64_t                mClusterSize;
+    // kCapacity bytes, NULL until written to
+    uint8_t*                mData;
+    // range of the file in mData
+    uint64_t                mOffset;
+    size_t                  mLength;
+
+public:
+                            MtpWriteBuffer(int fd, uint64_t clusterSize);
+                            MtpWriteBuffer(MtpSplitFile* file, uint64_t clusterSize);
+    virtual                 ~MtpWriteBuffer();
+
+    // returns length, or -1 with errno set if buffered data could not be
+    // written out to make room
+    ssize_t                 pwrite(const void* data, size_t length, uint64_t offset);
+    // writes out everything buffered, false with errno set if the file
+    // did not take it. The buffered data is dropped either way.
+    bool                    flush();
+    // flushes and frees the memory
+    bool                    release();
+
+    inline bool             hasMemory() const { return mData != NULL; }
+    inline size_t           getLength() const { return mLength; }
+
+                            MtpWriteBuffer(const MtpWriteBuffer&) = delete;
+    MtpWriteBuffer&         operator=(const MtpWriteBuffer&) = delete;
+
+private:
+    // writes out the buffered clusters up to the last boundary and keeps
+    // the rest, or everything if that ends short of a boundary
+    bool                    flushClusters();
+    bool                    writeOut(const uint8_t* data, size_t length, uint64_t offset);
+};
+
+}; // namespace android
+
+#endif // _MTP_WRITE_BUFFER_H
@@ -18,10 +18,12 @@
 #ifndef STUB_MTP_DATABASE_H_
 #define STUB_MTP_DATABASE_H_
 
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
 #include <map>
+#include <set>
 #include <vector>
 #include <string>
 #include <tuple>
@@ -31,16 +33,26 @@
 #include <sys/stat.h>
 
 #include "mtp.h"
+#include "MtpChangeJournal.h"
 #include "MtpDatabase.h"
 #include "MtpDataPacket.h"
 #include "MtpStringBuffer.h"
 #include "MtpObjectInfo.h"
+#include "MtpObjectIdStore.h"
+#include "MtpObjectStore.h"
 #include "MtpProperty.h"
+#include "MtpSplitFile.h"
+#include "MtpTrace.h"
 #include "MtpDebug.h"
+#include "MtpDigest.h"
+#include "MtpMetrics.h"
+#include "MtpUtils.h"
 
 #include "log.h"
 
 #define ALL_PROPERTIES 0xffffffff
+// seconds a partial upload waits for the host to come back
+#define PARTIAL_OBJECT_TIMEOUT (24 * 60 * 60)
 
 using namespace std::filesystem;
 
@@ -48,21 +60,69 @@ namespace android
 {
 class SwitchMtpDatabase : public android::MtpDatabase {
 private:
+    struct Digest
+    {
+        uint16_t algorithm;
+        uint64_t size;
+        std::time_t modified;
+        uint8_t value[MtpDigest::kMaxSize];
+    };
+
+    struct BlockDigests
+    {
+        uint16_t algorithm = 0;
+        uint32_t block_size = 0;
+        uint64_t size = 0;
+        std::time_t modified = 0;
+        // shared, entries are copied on every change
+        std::shared_ptr<const UInt8List> value;
+    };
+
     struct DbEntry
     {
         MtpStorageID storage_id;
         MtpObjectFormat object_format;
         MtpObjectHandle parent;
-        size_t object_size;
+        uint64_t object_size;
         std::string display_name;
         std::string path;
         std::time_t last_modified;
+        uint128_t uid;
         bool scanned = false;
+        // directory mtime when the listing was last read
+        std::time_t scanned_mtime = 0;
+        // reserved by beginSendObject, not yet completed
+        bool pending = false;
+        // upload that broke off, object_size is what made it to the file
+        bool partial = false;
+        // size announced by SendObjectInfo
+        uint64_t upload_size = 0;
+        // when the partial upload last made progress
+        std::time_t partial_touched = 0;
+        std::vector<Digest> digests;
+        BlockDigests block_digests;
+        // made up by the server rather than found on disk, read-only
+        bool generated = false;
     };
 
+    typedef MtpObjectStore<DbEntry> ObjectStore;
+
     MtpServer* local_server;
     uint32_t counter;
-    std::map<MtpObjectHandle, DbEntry> db;
+    // handles below counter that no entry nor recorded path holds, lowest
+    // last, handed out again before counter grows
+    std::vector<MtpObjectHandle> free_handles;
+    // entries are read under an ObjectStore::ReadGuard only; everything
+    // that changes them, or the state below, holds write_lock as well
+    ObjectStore db;
+    MtpMutex write_lock;
+    std::map<MtpStorageID, MtpObjectIdStore*> id_stores;
+    std::map<MtpStorageID, MtpChangeJournal*> journals;
+    std::map<MtpStorageID, MtpObjectHandle> root_handles;
+    // where the idle sweep picks up next time
+    MtpObjectHandle sweep_cursor;
+    // objects that may still be partial uploads
+    std::set<MtpObjectHandle> partials;
     std::map<std::string, MtpObjectFormat> formats = {
         {".gif", MTP_FORMAT_GIF},
         {".png", MTP_FORMAT_PNG},
@@ -91,16 +151,250 @@ private:
 
         return it->second;
     }
+
+    MtpObjectIdStore* get_id_store(MtpStorageID storage)
+    {
+        std::map<MtpStorageID, MtpObjectIdStore*>::iterator it = id_stores.find(storage);
+        return it == id_stores.end() ? nullptr : it->second;
+    }
+
+    // reuses the handle and persistent uid recorded for this path in a
+    // previous session, or hands out new ones
+    MtpObjectHandle allocate_handle(DbEntry& entry)
+    {
+        MtpObjectIdStore* store = get_id_store(entry.storage_id);
+        MtpObjectHandle handle = kInvalidObjectHandle;
+
+        if (store) {
+            const MtpObjectIdStore::Record* record = store->find(entry.path);
+            if (record && record->handle != 0 && !db.get(record->handle))
+                handle = record->handle;
+        }
+        while (handle == kInvalidObjectHandle && !free_handles.empty()) {
+            MtpObjectHandle reused = free_handles.back();
+            free_handles.pop_back();
+            if (!db.get(reused))
+                handle = reused;
+        }
+        if (handle == kInvalidObjectHandle)
+            handle = counter++;
+
+        const MtpObjectIdStore::Record* record = store ? store->assign(entry.path, handle) : nullptr;
+        if (record) {
+            memcpy(entry.uid, record->uid, sizeof(entry.uid));
+        } else {
+            memset(entry.uid, 0, sizeof(entry.uid));
+            entry.uid[0] = handle;
+        }
+        return handle;
+    }
+
+    // finds the handles nothing holds any more, so handles stay dense rather
+    // than growing with every object ever seen. Only done while no host can
+    // still know a handle that went away: outside of a session.
+    void collect_free_handles()
+    {
+        std::vector<bool> used(counter, false);
+        for(ObjectStore::const_iterator it = db.begin(); it != db.end(); ++it) {
+            if (it.handle() < counter)
+                used[it.handle()] = true;
+        }
+        std::vector<MtpObjectHandle> recorded;
+        for(std::map<MtpStorageID, MtpObjectIdStore*>::iterator it = id_stores.begin(); it != id_stores.end(); ++it)
+            it->second->getHandles(recorded);
+        for (size_t i = 0; i < recorded.size(); i++) {
+            if (recorded[i] < counter)
+                used[recorded[i]] = true;
+        }
+
+        while (counter > 1 && !used[counter - 1])
+            counter--;
+        free_handles.clear();
+        for (MtpObjectHandle handle = counter - 1; handle > 0; handle--) {
+            if (!used[handle])
+                free_handles.push_back(handle);
+        }
+        VLOG(1) << "next handle " << counter << ", " << free_handles.size() << " free below it";
+    }
+
+    // allocate_handle() and a new database entry, kInvalidObjectHandle once
+    // the table holds as many handles as it can
+    MtpObjectHandle insert_entry(DbEntry& entry)
+    {
+        MtpObjectHandle handle = allocate_handle(entry);
+        if (!db.put(handle, entry)) {
+            LOG(ERROR) << "no handle left for \"" << entry.path << "\"";
+            return kInvalidObjectHandle;
+        }
+        return handle;
+    }
+
+    // moves an entry to a new path, keeping its handle and persistent uid
+    void relocate_entry(MtpObjectHandle handle, const std::string& newpath)
+    {
+        DbEntry entry = db.at(handle);
+        std::string oldpath = entry.path;
+        std::string prefix = oldpath + "/";
+
+        entry.path = newpath;
+        entry.display_name = std::filesystem::path(newpath).filename().string();
+        db.put(handle, entry);
+
+        for(ObjectStore::const_iterator it = db.begin(); it != db.end(); ++it) {
+            if (it->path.compare(0, prefix.size(), prefix) == 0) {
+                DbEntry child = *it;
+                child.path = newpath + "/" + child.path.substr(prefix.size());
+                db.put(it.handle(), child);
+            }
+        }
+
+        MtpObjectIdStore* store = get_id_store(entry.storage_id);
+        if (store)
+            store->rename(oldpath, newpath);
+    }
+
+    void forget_entry(const DbEntry& entry)
+    {
+        MtpObjectIdStore* store = get_id_store(entry.storage_id);
+        if (store)
+            store->remove(entry.path);
+    }
+
+    // drops an entry and everything below it from the database
+    void remove_subtree(MtpObjectHandle handle)
+    {
+        const DbEntry* entry = db.get(handle);
+        if (!entry)
+            return;
+
+        MtpStorageID storage = entry->storage_id;
+        std::string prefix = entry->path + "/";
+        db.erase(handle);
+
+        for(ObjectStore::const_iterator it = db.begin(); it != db.end(); ++it) {
+            if (it->storage_id == storage && it->path.compare(0, prefix.size(), prefix) == 0)
+                db.erase(it.handle());
+        }
+    }
+
+    void mark_scanned(MtpObjectHandle handle, std::time_t mtime)
+    {
+        const DbEntry* current = db.get(handle);
+        if (current) {
+            DbEntry entry = *current;
+            entry.scanned = true;
+            entry.scanned_mtime = mtime;
+            db.put(handle, entry);
+        }
+    }
+
+    const Digest* find_digest(const DbEntry& entry, uint16_t algorithm, uint64_t size, std::time_t modified)
+    {
+        for (std::vector<Digest>::const_iterator it = entry.digests.begin(); it != entry.digests.end(); ++it) {
+            if (it->algorithm == algorithm && it->size == size && it->modified == modified)
+                return &*it;
+        }
+        return nullptr;
+    }
+
+    // the digest is only good while the file is what it was computed over
+    void put_content_digest(const DbEntry& entry, uint16_t algorithm, MtpDataPacket& packet)
+    {
+        struct stat result;
+        const Digest* digest = nullptr;
+
+        if (MtpSplitFile::stat(entry.path.c_str(), &result) == 0)
+            digest = find_digest(entry, algorithm, result.st_size, result.st_mtime);
+
+        if (digest)
+            packet.putAUInt8(digest->value, MtpDigest::getSize(algorithm));
+        else
+            packet.putEmptyArray();
+    }
+
+    // the length of a partial upload changes with every SendPartialObject
+    void put_resume_offset(const DbEntry& entry, MtpDataPacket& packet)
+    {
+        struct stat result;
+
+        if (!entry.partial)
+            packet.putUInt64(UINT64_MAX);
+        else if (stat(entry.path.c_str(), &result) == 0)
+            packet.putUInt64(result.st_size);
+        else
+            packet.putUInt64(entry.object_size);
+    }
+
+    // removes partial uploads the host did not come back for
+    void collect_partials()
+    {
+        std::time_t now = std::time(nullptr);
+
+        for (std::set<MtpObjectHandle>::iterator it = partials.begin(); it != partials.end(); ) {
+            MtpObjectHandle handle = *it;
+            const DbEntry* entry = db.get(handle);
+            if (!entry || !entry->partial) {
+                it = partials.erase(it);
+                continue;
+            }
+            if (now - entry->partial_touched < PARTIAL_OBJECT_TIMEOUT) {
+                ++it;
+                continue;
+            }
+
+            VLOG(1) << "removing abandoned upload \"" << entry->path << "\"";
+            unlink(entry->path.c_str());
+            journal_change(MtpChangeJournal::kRemoved, handle, *entry);
+            forget_entry(*entry);
+            db.erase(handle);
+            if (local_server)
+                local_server->sendObjectRemoved(handle);
+            it = partials.erase(it);
+        }
+    }
+
+    // FAT keeps mtimes to two seconds, so size and mtime alone do not
+    // catch every rewrite we know about
+    void forget_digests(DbEntry& entry)
+    {
+        entry.digests.clear();
+        entry.block_digests = BlockDigests();
+    }
+
+    void journal_change(MtpChangeJournal::Kind kind, MtpObjectHandle handle, const DbEntry& entry)
+    {
+        std::map<MtpStorageID, MtpChangeJournal*>::iterator it = journals.find(entry.storage_id);
+        if (it != journals.end())
+            it->second->append(kind, handle, entry.parent, entry.uid);
+    }
+
+    void save_state()
+    {
+        for(std::map<MtpStorageID, MtpObjectIdStore*>::iterator it = id_stores.begin(); it != id_stores.end(); ++it) {
+            it->second->setNextHandle(counter);
+            it->second->save();
+        }
+        for(std::map<MtpStorageID, MtpChangeJournal*>::iterator it = journals.begin(); it != journals.end(); ++it)
+            it->second->save();
+    }
     
-    void add_file_entry(path p, MtpObjectHandle parent, MtpStorageID storage)
+    MtpObjectHandle add_file_entry(path p, MtpObjectHandle parent, MtpStorageID storage)
     {
-        MtpObjectHandle handle = counter;
+        MtpObjectHandle handle = kInvalidObjectHandle;
         DbEntry entry;
 
-        counter++;
+        // server state lives next to the user's files but is not one of them
+        if (p.filename() == MTP_STATE_DIRECTORY)
+            return kInvalidObjectHandle;
 
         try {
-            if (is_directory(p)) {
+            // a file split in parts is a directory on disk
+            struct stat result;
+            bool directory = is_directory(p);
+            bool split = directory && MtpSplitFile::stat(p.string().c_str(), &result) == 0
+                    && S_ISREG(result.st_mode);
+
+            if (directory && !split) {
                 entry.storage_id = storage;
                 entry.parent = parent;
                 entry.display_name = std::string(p.filename().string());
@@ -108,10 +402,9 @@ private:
                 entry.object_format = MTP_FORMAT_ASSOCIATION;
                 entry.object_size = 0;
 
-                struct stat result;
                 stat(p.string().c_str(), &result);
                 entry.last_modified = result.st_mtime;
-                db.insert( std::pair<MtpObjectHandle, DbEntry>(handle, entry) );
+                handle = insert_entry(entry);
 
             } else {
                 try {
@@ -120,14 +413,17 @@ private:
                     entry.display_name = std::string(p.filename().string());
                     entry.path = p.string();
                     entry.object_format = guess_object_format(p.extension().string());
-                    entry.object_size = file_size(p);
-                    struct stat result;
-                    stat(p.string().c_str(), &result);
+                    if (split) {
+                        entry.object_size = result.st_size;
+                    } else {
+                        entry.object_size = file_size(p);
+                        stat(p.string().c_str(), &result);
+                    }
                     entry.last_modified = result.st_mtime;
 
                     VLOG(1) << "Adding \"" << p.string() << "\"";
 
-                    db.insert( std::pair<MtpObjectHandle, DbEntry>(handle, entry) );
+                    handle = insert_entry(entry);
                 } catch (const filesystem_error& ex) {
                     LOG(WARNING) << "There was an error reading file properties";
                 }
@@ -135,10 +431,41 @@ private:
         } catch (const filesystem_error& ex) {
             LOG(ERROR) << ex.what();
         }
+
+        return handle;
+    }
+
+    // the folder of server state shows up with the stats in it, and none
+    // of what is really in there
+    void add_stats_entries(const path& root, MtpObjectHandle parent, MtpStorageID storage)
+    {
+        DbEntry folder;
+        folder.storage_id = storage;
+        folder.parent = parent;
+        folder.display_name = MTP_STATE_DIRECTORY;
+        folder.path = (root / MTP_STATE_DIRECTORY).string();
+        folder.object_format = MTP_FORMAT_ASSOCIATION;
+        folder.object_size = 0;
+        folder.last_modified = std::time(nullptr);
+        folder.scanned = true;
+        folder.generated = true;
+        MtpObjectHandle handle = insert_entry(folder);
+        if (handle == kInvalidObjectHandle)
+            return;
+
+        DbEntry stats = folder;
+        stats.parent = handle;
+        stats.display_name = MTP_STATS_FILE_NAME;
+        stats.path = folder.path + "/" MTP_STATS_FILE_NAME;
+        stats.object_format = MTP_FORMAT_TEXT;
+        stats.object_size = MtpMetrics::kReportSize;
+        stats.scanned = false;
+        handle = insert_entry(stats);
     }
 
     void parse_directory(path p, MtpObjectHandle parent, MtpStorageID storage)
     {
+        MtpTrace::Span span("database", "parse_directory");
         DbEntry entry;
         std::vector<path> v;
 
@@ -146,29 +473,138 @@ private:
         if(!is_directory(p))
         {
             add_file_entry(p, parent, storage);
-            if (db.find(parent) != db.end())
-                db.at(parent).scanned = true;
+            mark_scanned(parent, 0);
             return;
         }
 
+        // taken before reading so that changes made meanwhile are seen later
+        struct stat result;
+        std::time_t mtime = stat(p.string().c_str(), &result) == 0 ? result.st_mtime : 0;
+
         directory_iterator i(p);
 
         copy(i, directory_iterator(), std::back_inserter(v));
 
+        std::set<std::string> names;
         for (std::vector<path>::const_iterator it(v.begin()), it_end(v.end()); it != it_end; ++it)
         {
             add_file_entry(*it, parent, storage);
+            names.insert(it->filename().string());
         }
 
-        if (db.find(parent) != db.end())
-            db.at(parent).scanned = true;
+        // what was deleted while we were not running leaves its identity
+        MtpObjectIdStore* store = get_id_store(storage);
+        if (store)
+            store->prune(p.string(), names);
+        mark_scanned(parent, mtime);
+    }
+
+    // diffs the listing of an already scanned directory against the
+    // database, so that changes made behind our back by other homebrew
+    // show up without rescanning everything. Unless forced, only
+    // directories whose mtime moved are read again.
+    void revalidate_directory(MtpObjectHandle dir, bool force)
+    {
+        MtpTrace::Span span("database", "revalidate_directory");
+        const DbEntry* dir_entry = db.get(dir);
+        if (!dir_entry || !dir_entry->scanned || dir_entry->generated
+                || dir_entry->object_format != MTP_FORMAT_ASSOCIATION)
+            return;
+
+        struct stat result;
+        if (stat(dir_entry->path.c_str(), &result) != 0)
+            return;     // gone, the sweep over its parent takes care of it
+        if (!force && result.st_mtime == dir_entry->scanned_mtime)
+            return;
+
+        // the children of a hidden storage root are listed under 0
+        MtpObjectHandle parent = dir_entry->parent == MTP_PARENT_ROOT ? 0 : dir;
+        MtpStorageID storage = dir_entry->storage_id;
+        std::string dirpath = dir_entry->path;
+        mark_scanned(dir, result.st_mtime);
+
+        std::vector<path> found;
+        try {
+            copy(directory_iterator(dirpath), directory_iterator(), std::back_inserter(found));
+        } catch (const filesystem_error& ex) {
+            LOG(ERROR) << ex.what();
+            return;
+        }
+
+        std::map<std::string, MtpObjectHandle> known;
+        for(ObjectStore::const_iterator it = db.begin(); it != db.end(); ++it) {
+            if (it->storage_id == storage && it->parent == parent)
+                known[it->display_name] = it.handle();
+        }
+
+        for (std::vector<path>::const_iterator it(found.begin()), it_end(found.end()); it != it_end; ++it)
+        {
+            std::map<std::string, MtpObjectHandle>::iterator k = known.find(it->filename().string());
+            if (k == known.end()) {
+                MtpObjectHandle handle = add_file_entry(*it, parent, storage);
+                if (handle == kInvalidObjectHandle)
+                    continue;
+
+                VLOG(1) << "found new object \"" << it->string() << "\"";
+                journal_change(MtpChangeJournal::kAdded, handle, db.at(handle));
+                if (local_server)
+                    local_server->sendObjectAdded(handle);
+                continue;
+            }
+
+            MtpObjectHandle handle = k->second;
+            DbEntry entry = db.at(handle);
+            known.erase(k);
+
+            // uploads in flight are the host's business
+            if (entry.pending || entry.object_format == MTP_FORMAT_ASSOCIATION)
+                continue;
+
+            if (MtpSplitFile::stat(it->string().c_str(), &result) != 0)
+                continue;
+            if (entry.object_size == (uint64_t) result.st_size && entry.last_modified == result.st_mtime)
+                continue;
+
+            VLOG(1) << "object \"" << entry.path << "\" changed";
+            entry.object_size = result.st_size;
+            entry.last_modified = result.st_mtime;
+            forget_digests(entry);
+            db.put(handle, entry);
+            journal_change(MtpChangeJournal::kModified, handle, entry);
+            if (local_server)
+                local_server->sendObjectInfoChanged(handle);
+        }
+
+        std::set<std::string> names;
+        for (std::vector<path>::const_iterator it(found.begin()), it_end(found.end()); it != it_end; ++it)
+            names.insert(it->filename().string());
+
+        for (std::map<std::string, MtpObjectHandle>::iterator k = known.begin(); k != known.end(); ++k)
+        {
+            const DbEntry& entry = db.at(k->second);
+            if (entry.pending || entry.generated) {
+                names.insert(entry.display_name);
+                continue;
+            }
+
+            VLOG(1) << "object \"" << entry.path << "\" disappeared";
+            journal_change(MtpChangeJournal::kRemoved, k->second, entry);
+            forget_entry(entry);
+            remove_subtree(k->second);
+            if (local_server)
+                local_server->sendObjectRemoved(k->second);
+        }
+
+        MtpObjectIdStore* store = get_id_store(storage);
+        if (store)
+            store->prune(dirpath, names);
     }
 
     void readFiles(const std::string& sourcedir, const std::string& display, MtpStorageID storage, bool hidden)
     {
         path p (sourcedir);
         DbEntry entry;
-        MtpObjectHandle handle = counter++;
+        MtpObjectHandle handle;
         std::string display_name = std::string(p.filename().string());
 
         if (!display.empty())
@@ -177,6 +613,24 @@ private:
         try {
             if (exists(p)) {
                 if (is_directory(p)) {
+                    if (!get_id_store(storage)) {
+                        MtpObjectIdStore* store = new MtpObjectIdStore(sourcedir);
+                        store->load();
+                        id_stores[storage] = store;
+                        counter = std::max(counter, store->getNextHandle());
+                        // the handles just loaded may be among the free ones
+                        if (local_server)
+                            free_handles.clear();
+                        else
+                            collect_free_handles();
+
+                        MtpChangeJournal* journal = new MtpChangeJournal(sourcedir);
+                        journal->load();
+                        if (local_server)
+                            journal->beginSession();
+                        journals[storage] = journal;
+                    }
+
                     entry.storage_id = storage;
                     entry.parent = hidden ? MTP_PARENT_ROOT : 0;
                     entry.display_name = display_name;
@@ -187,9 +641,15 @@ private:
                     stat(p.string().c_str(), &result);
                     entry.last_modified = result.st_mtime;
 
-                    db.insert( std::pair<MtpObjectHandle, DbEntry>(handle, entry) );
+                    handle = insert_entry(entry);
+                    if (handle == kInvalidObjectHandle)
+                        return;
 
+                    root_handles[storage] = handle;
                     parse_directory (p, hidden ? 0 : handle, storage);
+                    add_stats_entries(p, hidden ? 0 : handle, storage);
+                    if (hidden)
+                        mark_scanned(handle, entry.last_modified);
                 } else
                     LOG(WARNING) << p << " is not a directory.";
             } else {
@@ -214,17 +674,25 @@ private:
 public:
 
     SwitchMtpDatabase() :
-      counter(1)
+      counter(1),
+      sweep_cursor(0)
     {
         local_server = nullptr;
-        db = std::map<MtpObjectHandle, DbEntry>();
     }
 
     virtual ~SwitchMtpDatabase() {
+        MtpAutolock lock(write_lock);
+        save_state();
+        for(std::map<MtpStorageID, MtpObjectIdStore*>::iterator it = id_stores.begin(); it != id_stores.end(); ++it)
+            delete it->second;
+        for(std::map<MtpStorageID, MtpChangeJournal*>::iterator it = journals.begin(); it != journals.end(); ++it) {
+            it->second->endSession();
+            delete it->second;
+        }
     }
 
     virtual bool isHandleValid(MtpObjectHandle handle) {
-        return handle > 0 && handle < counter;
+        return db.get(handle) != nullptr;
     }
 
     virtual void addStoragePath(const MtpString& path,
@@ -232,17 +700,36 @@ public:
                                 MtpStorageID storage,
                                 bool hidden)
     {
+        MtpAutolock lock(write_lock);
+        ObjectStore::ReadGuard guard(db.getEpoch());
         readFiles(path, displayName, storage, hidden);
     }
 
     virtual void removeStorage(MtpStorageID storage)
     {
+        MtpAutolock lock(write_lock);
+        ObjectStore::ReadGuard guard(db.getEpoch());
+
         // remove all database entries corresponding to said storage.
-        for(std::map<MtpObjectHandle, DbEntry>::iterator it = db.begin(); it != db.end();) {
-            if (it->second.storage_id == storage)
-                it = db.erase(it);
-            else
-                it++;
+        for(ObjectStore::const_iterator it = db.begin(); it != db.end(); ++it) {
+            if (it->storage_id == storage)
+                db.erase(it.handle());
+        }
+        root_handles.erase(storage);
+
+        MtpObjectIdStore* store = get_id_store(storage);
+        if (store) {
+            store->setNextHandle(counter);
+            store->save();
+            delete store;
+            id_stores.erase(storage);
+        }
+
+        std::map<MtpStorageID, MtpChangeJournal*>::iterator journal = journals.find(storage);
+        if (journal != journals.end()) {
+            journal->second->endSession();
+            delete journal->second;
+            journals.erase(journal);
         }
     }
 
@@ -255,8 +742,9 @@ public:
         uint64_t size,
         time_t modified)
     {
+        MtpTrace::Span span("database", "beginSendObject");
         DbEntry entry;
-        MtpObjectHandle handle = counter;
+        MtpObjectHandle handle;
 
         if (storage == MTP_STORAGE_FIXED_RAM && parent == 0)
             return kInvalidObjectHandle;
@@ -271,10 +759,11 @@ public:
         entry.object_format = format;
         entry.object_size = size;
         entry.last_modified = modified;
+        entry.pending = true;
+        entry.upload_size = size;
 
-        db.insert( std::pair<MtpObjectHandle, DbEntry>(handle, entry) );
-
-        counter++;
+        MtpAutolock lock(write_lock);
+        handle = insert_entry(entry);
 
         return handle; 
     }
@@ -288,19 +777,48 @@ public:
         MtpObjectFormat format,
         bool succeeded)
     {
+        MtpTrace::Span span("database", "endSendObject");
         VLOG(1) << __PRETTY_FUNCTION__ << ": " << path;
 
+        MtpAutolock lock(write_lock);
+        ObjectStore::ReadGuard guard(db.getEpoch());
+
         try
         {
             if (!succeeded) {
+                forget_entry(db.at(handle));
                 db.erase(handle);
             } else {
-                std::filesystem::path p (path);
+                DbEntry entry = db.at(handle);
 
-                if (format != MTP_FORMAT_ASSOCIATION) {
+                // a fresh upload that completed has the size it announced,
+                // and its file may not even be closed yet
+                if (format != MTP_FORMAT_ASSOCIATION
+                        && !(entry.pending && entry.upload_size != 0xFFFFFFFF)) {
                     /* Resync file size, just in case this is actually an Edit. */
-                    db.at(handle).object_size = file_size(p);
+                    struct stat result;
+                    if (MtpSplitFile::stat(path.c_str(), &result) == 0)
+                        entry.object_size = result.st_size;
                 }
+
+                // digests of a fresh upload were just taken, those of an
+                // edited file are stale
+                if (!entry.pending)
+                    forget_digests(entry);
+
+                // a resumed upload may have been cut short again; the size
+                // is unknown when it was announced as 0xFFFFFFFF
+                if (entry.partial) {
+                    if (entry.upload_size == 0xFFFFFFFF || entry.object_size >= entry.upload_size)
+                        entry.partial = false;
+                    else
+                        entry.partial_touched = std::time(nullptr);
+                }
+
+                journal_change(entry.pending ? MtpChangeJournal::kAdded : MtpChangeJournal::kModified,
+                               handle, entry);
+                entry.pending = false;
+                db.put(handle, entry);
             }
         } catch(...)
         {
@@ -309,29 +827,76 @@ public:
         }
     }
 
+    virtual void keepPartialObject(
+        const MtpString& path,
+        MtpObjectHandle handle,
+        uint64_t committedSize)
+    {
+        MtpTrace::Span span("database", "keepPartialObject");
+        VLOG(1) << __PRETTY_FUNCTION__ << ": " << path << " committed " << committedSize;
+
+        MtpAutolock lock(write_lock);
+        ObjectStore::ReadGuard guard(db.getEpoch());
+
+        const DbEntry* current = db.get(handle);
+        if (!current)
+            return;
+
+        DbEntry entry = *current;
+        entry.object_size = committedSize;
+        entry.partial = true;
+        entry.partial_touched = std::time(nullptr);
+        // the digests taken on the way only cover a complete upload
+        forget_digests(entry);
+        journal_change(entry.pending ? MtpChangeJournal::kAdded : MtpChangeJournal::kModified,
+                       handle, entry);
+        entry.pending = false;
+        db.put(handle, entry);
+        partials.insert(handle);
+    }
+
     virtual MtpObjectHandleList* getObjectList(
         MtpStorageID storageID,
         MtpObjectFormat format,
         MtpObjectHandle parent)
     {
+        MtpTrace::Span span("database", "getObjectList");
         VLOG(1) << __PRETTY_FUNCTION__ << ": " << storageID << ", " << format << ", " << parent;
         MtpObjectHandleList* list = nullptr;
+        ObjectStore::ReadGuard guard(db.getEpoch());
 
         if (parent == MTP_PARENT_ROOT)
             parent = 0;
-        
+
+        const DbEntry* dir = db.get(parent);
+
         // Scan unscanned directories
-        else if (isHandleValid(parent) && !db.at(parent).scanned)
-            parse_directory (db.at(parent).path, parent, storageID);
+        if (dir && !dir->scanned) {
+            MtpAutolock lock(write_lock);
+            dir = db.get(parent);
+            if (dir && !dir->scanned)
+                parse_directory (dir->path, parent, storageID);
+        } else {
+            // a listing that is a little stale beats waiting for a sweep
+            std::unique_lock<MtpMutex> lock(write_lock, std::try_to_lock);
+            if (lock.owns_lock()) {
+                if (parent == 0) {
+                    std::map<MtpStorageID, MtpObjectHandle>::iterator root = root_handles.find(storageID);
+                    if (root != root_handles.end())
+                        revalidate_directory(root->second, false);
+                } else
+                    revalidate_directory(parent, false);
+            }
+        }
 
         try
         {
             std::vector<MtpObjectHandle> keys;
 
-            for(std::map<MtpObjectHandle, DbEntry>::iterator it = db.begin(); it != db.end(); ++it) {
-                if (it->second.storage_id == storageID && it->second.parent == parent)
-                    if (format == 0 || it->second.object_format == format)
-                        keys.push_back(it->first);
+            for(ObjectStore::const_iterator it = db.begin(); it != db.end(); ++it) {
+                if (it->storage_id == storageID && it->parent == parent)
+                    if (format == 0 || it->object_format == format)
+                        keys.push_back(it.handle());
             }
 
             list = new MtpObjectHandleList(keys);
@@ -348,6 +913,7 @@ public:
         MtpObjectFormat format,
         MtpObjectHandle parent)
     {
+        MtpTrace::Span span("database", "getNumObjects");
         VLOG(1) << __PRETTY_FUNCTION__ << ": " << storageID << ", " << format << ", " << parent;
 
         int result = 0;
@@ -441,7 +1007,9 @@ public:
             MTP_PROPERTY_DATE_MODIFIED,
             MTP_PROPERTY_HIDDEN,
             MTP_PROPERTY_NON_CONSUMABLE,
-
+            MTP_PROPERTY_NX_CONTENT_CRC32C,
+            MTP_PROPERTY_NX_CONTENT_SHA256,
+            MTP_PROPERTY_NX_RESUME_OFFSET,
         };
          
         return new MtpObjectPropertyList{list};
@@ -462,6 +1030,7 @@ public:
         MtpObjectProperty property,
         MtpDataPacket& packet)
     {        
+        MtpTrace::Span span("database", "getObjectPropertyValue");
         char date[20];
 
         VLOG(1) << __PRETTY_FUNCTION__
@@ -471,16 +1040,18 @@ public:
         if (handle == MTP_PARENT_ROOT || handle == 0)
             return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
 
+        ObjectStore::ReadGuard guard(db.getEpoch());
+
         try {
             switch(property)
             {
                 case MTP_PROPERTY_STORAGE_ID: packet.putUInt32(db.at(handle).storage_id); break;            
                 case MTP_PROPERTY_PARENT_OBJECT: packet.putUInt32(db.at(handle).parent); break;            
                 case MTP_PROPERTY_OBJECT_FORMAT: packet.putUInt16(db.at(handle).object_format); break;
-                case MTP_PROPERTY_OBJECT_SIZE: packet.putUInt32(db.at(handle).object_size); break;
+                case MTP_PROPERTY_OBJECT_SIZE: packet.putUInt64(db.at(handle).object_size); break;
                 case MTP_PROPERTY_DISPLAY_NAME: packet.putString(db.at(handle).display_name.c_str()); break;
                 case MTP_PROPERTY_OBJECT_FILE_NAME: packet.putString(db.at(handle).display_name.c_str()); break;
-                case MTP_PROPERTY_PERSISTENT_UID: packet.putUInt128(handle); break;
+                case MTP_PROPERTY_PERSISTENT_UID: packet.putUInt128(db.at(handle).uid); break;
                 case MTP_PROPERTY_ASSOCIATION_TYPE:
                     if (db.at(handle).object_format == MTP_FORMAT_ASSOCIATION)
                         packet.putUInt16(MTP_ASSOCIATION_TYPE_GENERIC_FOLDER);
@@ -489,7 +1060,8 @@ public:
                     break;
                 case MTP_PROPERTY_ASSOCIATION_DESC: packet.putUInt32(0); break;
                 case MTP_PROPERTY_PROTECTION_STATUS:
-                    packet.putUInt16(0x0000); // no files are read-only for now.
+                    // only what the server generates is read-only
+                    packet.putUInt16(db.at(handle).generated ? 0x0001 : 0x0000);
                     break;
                 case MTP_PROPERTY_DATE_CREATED:
                     formatDateTime(0, date, sizeof(date));
@@ -500,6 +1072,15 @@ public:
                     packet.putString(date);
                     break;
                 case MTP_PROPERTY_HIDDEN: packet.putUInt16(0); break;
+                case MTP_PROPERTY_NX_CONTENT_CRC32C:
+                    put_content_digest(db.at(handle), MTP_NX_DIGEST_CRC32C, packet);
+                    break;
+                case MTP_PROPERTY_NX_CONTENT_SHA256:
+                    put_content_digest(db.at(handle), MTP_NX_DIGEST_SHA256, packet);
+                    break;
+                case MTP_PROPERTY_NX_RESUME_OFFSET:
+                    put_resume_offset(db.at(handle), packet);
+                    break;
                 case MTP_PROPERTY_NON_CONSUMABLE: break;
                     if (db.at(handle).object_format == MTP_FORMAT_ASSOCIATION)
                         packet.putUInt16(0); // folders are non-consumable
@@ -525,6 +1106,7 @@ public:
         MtpObjectProperty property,
         MtpDataPacket& packet)
     {
+        MtpTrace::Span span("database", "setObjectPropertyValue");
         DbEntry entry;
         MtpStringBuffer buffer;
         std::string oldname;
@@ -539,6 +1121,13 @@ public:
         if (handle == MTP_PARENT_ROOT || handle == 0)
             return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
 
+        MtpAutolock lock(write_lock);
+        ObjectStore::ReadGuard guard(db.getEpoch());
+
+        const DbEntry* current = db.get(handle);
+        if (current && current->generated)
+            return MTP_RESPONSE_OBJECT_WRITE_PROTECTED;
+
         switch(property)
         {
             case MTP_PROPERTY_OBJECT_FILE_NAME:
@@ -553,8 +1142,8 @@ public:
 
                     rename(oldpath, newpath);
 
-                    db.at(handle).display_name = newname;
-                    db.at(handle).path = newpath.string();
+                    relocate_entry(handle, newpath.string());
+                    journal_change(MtpChangeJournal::kMoved, handle, db.at(handle));
                 } catch (filesystem_error& fe) {
                     LOG(ERROR) << fe.what();
                     return MTP_RESPONSE_DEVICE_BUSY;
@@ -623,6 +1212,7 @@ public:
         int depth,
         MtpDataPacket& packet)
     {
+        MtpTrace::Span span("database", "getObjectPropertyList");
         std::vector<MtpObjectHandle> handles;
 
         VLOG(2) << __PRETTY_FUNCTION__;
@@ -639,18 +1229,25 @@ public:
         if (depth > 1)
             return MTP_RESPONSE_SPECIFICATION_BY_DEPTH_UNSUPPORTED;
 
+        ObjectStore::ReadGuard guard(db.getEpoch());
+        std::vector<const DbEntry*> entries;
+
         if (depth == 0) {
             /* For a depth search, a handle of 0 is valid (objects at the root)
              * but it isn't when querying for the properties of a single object.
              */
-            if (db.find(handle) == db.end())
+            const DbEntry* entry = db.get(handle);
+            if (!entry)
                 return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
 
             handles.push_back(handle);
+            entries.push_back(entry);
         } else {
-            for(std::map<MtpObjectHandle, DbEntry>::iterator it = db.begin(); it != db.end(); ++it) {
-                if (it->second.parent == handle)
-                    handles.push_back(it->first);
+            for(ObjectStore::const_iterator it = db.begin(); it != db.end(); ++it) {
+                if (it->parent == handle) {
+                    handles.push_back(it.handle());
+                    entries.push_back(&*it);
+                }
             }
         }
 
@@ -671,16 +1268,16 @@ public:
         else
              packet.putUInt32(1 * handles.size());
 
-        for(std::vector<MtpObjectHandle>::iterator it = handles.begin(); it != handles.end(); ++it) {
-            MtpObjectHandle i = *it;
-            DbEntry entry = db.at(i);
+        for(size_t n = 0; n < handles.size(); n++) {
+            MtpObjectHandle i = handles[n];
+            const DbEntry& entry = *entries[n];
 
             // Persistent Unique Identifier.
             if (property == ALL_PROPERTIES || property == MTP_PROPERTY_PERSISTENT_UID) {
                 packet.putUInt32(i);
                 packet.putUInt16(MTP_PROPERTY_PERSISTENT_UID);
                 packet.putUInt16(MTP_TYPE_UINT128);
-                packet.putUInt128(i);
+                packet.putUInt128(entry.uid);
             }
 
             // Storage ID
@@ -711,8 +1308,8 @@ public:
             if (property == ALL_PROPERTIES || property == MTP_PROPERTY_OBJECT_SIZE) {
                 packet.putUInt32(i);
                 packet.putUInt16(MTP_PROPERTY_OBJECT_SIZE);
-                packet.putUInt16(MTP_TYPE_UINT32);
-                packet.putUInt32(entry.object_size);
+                packet.putUInt16(MTP_TYPE_UINT64);
+                packet.putUInt64(entry.object_size);
             }
 
             // Object File Name
@@ -731,6 +1328,23 @@ public:
                 packet.putString(entry.display_name.c_str());
             }
 
+            // Content digests, too costly to be part of all properties
+            if (property == MTP_PROPERTY_NX_CONTENT_CRC32C || property == MTP_PROPERTY_NX_CONTENT_SHA256) {
+                packet.putUInt32(i);
+                packet.putUInt16(property);
+                packet.putUInt16(MTP_TYPE_AUINT8);
+                put_content_digest(entry, property == MTP_PROPERTY_NX_CONTENT_CRC32C
+                                   ? MTP_NX_DIGEST_CRC32C : MTP_NX_DIGEST_SHA256, packet);
+            }
+
+            // Resume offset, asked for by hosts that know what to do with it
+            if (property == MTP_PROPERTY_NX_RESUME_OFFSET) {
+                packet.putUInt32(i);
+                packet.putUInt16(property);
+                packet.putUInt16(MTP_TYPE_UINT64);
+                put_resume_offset(entry, packet);
+            }
+
             // Association Type
             if (property == ALL_PROPERTIES || property == MTP_PROPERTY_ASSOCIATION_TYPE) {
                 packet.putUInt32(i);
@@ -755,8 +1369,7 @@ public:
                 packet.putUInt32(i);
                 packet.putUInt16(MTP_PROPERTY_PROTECTION_STATUS);
                 packet.putUInt16(MTP_TYPE_UINT16);
-                packet.putUInt16(0x0000); //FIXME: all files are read-write for now
-                // packet.putUInt16(0x8001);
+                packet.putUInt16(entry.generated ? 0x0001 : 0x0000);
             }
 
             // Date Created
@@ -808,29 +1421,35 @@ public:
         MtpObjectHandle handle,
         MtpObjectInfo& info)
     {
+        MtpTrace::Span span("database", "getObjectInfo");
         VLOG(2) << __PRETTY_FUNCTION__;
 
         if (handle == 0 || handle == MTP_PARENT_ROOT)
             return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
 
+        ObjectStore::ReadGuard guard(db.getEpoch());
+
         try {
+            const DbEntry& entry = db.at(handle);
+
             info.mHandle = handle;
-            info.mStorageID = db.at(handle).storage_id;
-            info.mFormat = db.at(handle).object_format;
-            info.mProtectionStatus = 0x0;
-            info.mCompressedSize = db.at(handle).object_size;
+            info.mStorageID = entry.storage_id;
+            info.mFormat = entry.object_format;
+            info.mProtectionStatus = entry.generated ? 0x0001 : 0x0000;
+            // ObjectInfo only has 32 bits, hosts take the property for more
+            info.mCompressedSize = entry.object_size > 0xFFFFFFFF ? 0xFFFFFFFF : entry.object_size;
             info.mImagePixWidth = 0;
             info.mImagePixHeight = 0;
             info.mImagePixDepth = 0;
-            info.mParent = db.at(handle).parent;
+            info.mParent = entry.parent;
             info.mAssociationType
                 = info.mFormat == MTP_FORMAT_ASSOCIATION
                     ? MTP_ASSOCIATION_TYPE_GENERIC_FOLDER : 0;
             info.mAssociationDesc = 0;
             info.mSequenceNumber = 0;
-            info.mName = ::strdup(db.at(handle).display_name.c_str());
+            info.mName = ::strdup(entry.display_name.c_str());
             info.mDateCreated = 0;
-            info.mDateModified = db.at(handle).last_modified;
+            info.mDateModified = entry.last_modified;
             info.mKeywords = ::strdup("ubuntu,touch");
 
             if (VLOG_IS_ON(2))
@@ -859,13 +1478,16 @@ public:
         int64_t& outFileLength,
         MtpObjectFormat& outFormat)
     {
+        MtpTrace::Span span("database", "getObjectFilePath");
         VLOG(1) << __PRETTY_FUNCTION__ << " handle: " << handle;
 
         if (handle == 0 || handle == MTP_PARENT_ROOT)
             return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
 
+        ObjectStore::ReadGuard guard(db.getEpoch());
+
         try {
-            DbEntry entry = db.at(handle);
+            const DbEntry& entry = db.at(handle);
 
             VLOG(2) << __PRETTY_FUNCTION__
                     << "handle: " << handle
@@ -886,33 +1508,33 @@ public:
 
     virtual MtpResponseCode deleteFile(MtpObjectHandle handle)
     {
-        size_t orig_size = db.size();
-        size_t new_size;
-
+        MtpTrace::Span span("database", "deleteFile");
         VLOG(2) << __PRETTY_FUNCTION__ << " handle: " << handle;
 
         if (handle == 0 || handle == MTP_PARENT_ROOT)
             return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
 
-        try {
-            new_size = db.erase(handle);
-
-            if (orig_size > new_size) {
-                /* Recursively remove children object from the DB as well.
-                 * we can safely ignore failures here, since the objects
-                 * would not be reachable anyway.
-                 */
-                for(std::map<MtpObjectHandle, DbEntry>::iterator it = db.begin(); it != db.end();) {
-                    if (it->second.parent == handle)
-                        it = db.erase(it);
-                    else
-                        it++;
-                }
+        MtpAutolock lock(write_lock);
+        ObjectStore::ReadGuard guard(db.getEpoch());
 
-                return MTP_RESPONSE_OK;
-            }
-            else
+        try {
+            const DbEntry* entry = db.get(handle);
+            if (!entry)
                 return MTP_RESPONSE_GENERAL_ERROR;
+            if (entry->generated)
+                return MTP_RESPONSE_OBJECT_WRITE_PROTECTED;
+
+            // removing a folder implicitly removes everything below it
+            journal_change(MtpChangeJournal::kRemoved, handle, *entry);
+            forget_entry(*entry);
+
+            /* Recursively remove children object from the DB as well.
+             * we can safely ignore failures here, since the objects
+             * would not be reachable anyway.
+             */
+            remove_subtree(handle);
+
+            return MTP_RESPONSE_OK;
         }
         catch (...) {
             return MTP_RESPONSE_GENERAL_ERROR;
@@ -921,23 +1543,76 @@ public:
 
     virtual MtpResponseCode moveFile(MtpObjectHandle handle, MtpObjectHandle new_parent)
     {
+        MtpTrace::Span span("database", "moveFile");
         VLOG(1) << __PRETTY_FUNCTION__ << " handle: " << handle
                 << " new parent: " << new_parent;
 
         if (handle == 0 || handle == MTP_PARENT_ROOT)
             return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
 
+        MtpAutolock lock(write_lock);
+        ObjectStore::ReadGuard guard(db.getEpoch());
+
+        DbEntry entry;
+        path parent_path;
+
         try {
-            // change parent
-            db.at(handle).parent = new_parent;
+            entry = db.at(handle);
+
+            if (entry.generated)
+                return MTP_RESPONSE_OBJECT_WRITE_PROTECTED;
+
+            if (new_parent == 0) {
+                MtpObjectIdStore* store = get_id_store(entry.storage_id);
+                if (!store)
+                    return MTP_RESPONSE_INVALID_PARENT_OBJECT;
+                parent_path = store->getRoot();
+            } else {
+                const DbEntry& parent = db.at(new_parent);
+                if (parent.object_format != MTP_FORMAT_ASSOCIATION)
+                    return MTP_RESPONSE_INVALID_PARENT_OBJECT;
+                if (parent.storage_id != entry.storage_id)
+                    return MTP_RESPONSE_SPECIFICATION_OF_DESTINATION_UNSUPPORTED;
+                if (parent.generated)
+                    return MTP_RESPONSE_ACCESS_DENIED;
+                // a folder can't go into itself or anything below it
+                for (MtpObjectHandle ancestor = new_parent; ancestor != 0;
+                        ancestor = db.at(ancestor).parent) {
+                    if (ancestor == handle)
+                        return MTP_RESPONSE_INVALID_PARENT_OBJECT;
+                }
+                parent_path = parent.path;
+            }
         }
         catch (...) {
             return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
         }
 
+        std::string newpath = (parent_path / entry.display_name).string();
+
+        // only touch the database once the file has actually moved
+        if (::rename(entry.path.c_str(), newpath.c_str()) != 0) {
+            LOG(ERROR) << "moving " << entry.path << " to " << newpath
+                       << " failed: " << strerror(errno);
+            return MTP_RESPONSE_GENERAL_ERROR;
+        }
+
+        // change parent
+        entry.parent = new_parent;
+        db.put(handle, entry);
+        relocate_entry(handle, newpath);
+        journal_change(MtpChangeJournal::kMoved, handle, db.at(handle));
+
         return MTP_RESPONSE_OK;
     }
 
+    virtual bool isReadOnly(MtpObjectHandle handle)
+    {
+        ObjectStore::ReadGuard guard(db.getEpoch());
+        const DbEntry* entry = db.get(handle);
+        return entry && entry->generated;
+    }
+
     /*
     virtual MtpResponseCode copyFile(MtpObjectHandle handle, MtpObjectHandle new_parent)
     {
@@ -957,9 +1632,15 @@ public:
         if (handle == 0 || handle == MTP_PARENT_ROOT)
             return nullptr;
 
-        return getObjectList(db.at(handle).storage_id,
-                             db.at(handle).object_format,
-                             handle);
+        MtpStorageID storage;
+        MtpObjectFormat format;
+        {
+            ObjectStore::ReadGuard guard(db.getEpoch());
+            storage = db.at(handle).storage_id;
+            format = db.at(handle).object_format;
+        }
+
+        return getObjectList(storage, format, handle);
     }
 
     virtual MtpResponseCode setObjectReferences(
@@ -985,7 +1666,7 @@ public:
             case MTP_PROPERTY_STORAGE_ID: result = new MtpProperty(property, MTP_TYPE_UINT32, false); break;
             case MTP_PROPERTY_PARENT_OBJECT: result = new MtpProperty(property, MTP_TYPE_UINT32, true); break;
             case MTP_PROPERTY_OBJECT_FORMAT: result = new MtpProperty(property, MTP_TYPE_UINT16, false); break;
-            case MTP_PROPERTY_OBJECT_SIZE: result = new MtpProperty(property, MTP_TYPE_UINT32, false); break;
+            case MTP_PROPERTY_OBJECT_SIZE: result = new MtpProperty(property, MTP_TYPE_UINT64, false); break;
             case MTP_PROPERTY_WIDTH: result = new MtpProperty(property, MTP_TYPE_UINT32, false); break;
             case MTP_PROPERTY_HEIGHT: result = new MtpProperty(property, MTP_TYPE_UINT32, false); break;
             case MTP_PROPERTY_IMAGE_BIT_DEPTH: result = new MtpProperty(property, MTP_TYPE_UINT32, false); break;
@@ -999,6 +1680,9 @@ public:
             case MTP_PROPERTY_DATE_MODIFIED: result = new MtpProperty(property, MTP_TYPE_STR, false); break;
             case MTP_PROPERTY_HIDDEN: result = new MtpProperty(property, MTP_TYPE_UINT16, false); break;
             case MTP_PROPERTY_NON_CONSUMABLE: result = new MtpProperty(property, MTP_TYPE_UINT16, false); break;
+            case MTP_PROPERTY_NX_CONTENT_CRC32C: result = new MtpProperty(property, MTP_TYPE_AUINT8, false); break;
+            case MTP_PROPERTY_NX_CONTENT_SHA256: result = new MtpProperty(property, MTP_TYPE_AUINT8, false); break;
+            case MTP_PROPERTY_NX_RESUME_OFFSET: result = new MtpProperty(property, MTP_TYPE_UINT64, false); break;
             default: break;                
         }
         
@@ -1021,16 +1705,176 @@ public:
         return result;
     }
     
+    virtual MtpResponseCode getChanges(MtpStorageID storage, uint64_t token, MtpDataPacket& packet)
+    {
+        MtpTrace::Span span("database", "getChanges");
+        VLOG(1) << __PRETTY_FUNCTION__ << " storage: " << storage << " token: " << token;
+
+        MtpAutolock lock(write_lock);
+        std::map<MtpStorageID, MtpChangeJournal*>::iterator it = journals.find(storage);
+        if (it == journals.end())
+            return MTP_RESPONSE_INVALID_STORAGE_ID;
+
+        it->second->writeChanges(token, packet);
+        return MTP_RESPONSE_OK;
+    }
+
+    virtual void revalidate()
+    {
+        MtpTrace::Span span("database", "revalidate");
+        // FAT does not reliably bump a directory's mtime when its contents
+        // change, so the sweep re-reads a few listings per tick regardless
+        const int budget = 8;
+        std::vector<MtpObjectHandle> dirs;
+
+        MtpAutolock lock(write_lock);
+        ObjectStore::ReadGuard guard(db.getEpoch());
+
+        ObjectStore::const_iterator it = db.upper_bound(sweep_cursor);
+        for (int wrapped = 0; (int) dirs.size() < budget && wrapped < 2; ) {
+            if (it == db.end()) {
+                it = db.begin();
+                wrapped++;
+                continue;
+            }
+            if (it->scanned && std::find(dirs.begin(), dirs.end(), it.handle()) == dirs.end())
+                dirs.push_back(it.handle());
+            ++it;
+        }
+
+        for (std::vector<MtpObjectHandle>::iterator d = dirs.begin(); d != dirs.end(); ++d) {
+            sweep_cursor = *d;
+            revalidate_directory(*d, true);
+        }
+
+        collect_partials();
+        // identities handed out since are gone if we never get to the end
+        // of the session
+        save_state();
+    }
+
+    virtual bool getObjectDigest(MtpObjectHandle handle, uint16_t algorithm,
+                                 uint64_t size, time_t modified, uint8_t* outDigest)
+    {
+        MtpTrace::Span span("database", "getObjectDigest");
+        ObjectStore::ReadGuard guard(db.getEpoch());
+
+        const DbEntry* entry = db.get(handle);
+        if (!entry)
+            return false;
+
+        const Digest* digest = find_digest(*entry, algorithm, size, modified);
+        if (!digest)
+            return false;
+
+        memcpy(outDigest, digest->value, MtpDigest::getSize(algorithm));
+        return true;
+    }
+
+    virtual void setObjectDigest(MtpObjectHandle handle, uint16_t algorithm,
+                                 uint64_t size, time_t modified, const uint8_t* digest)
+    {
+        MtpTrace::Span span("database", "setObjectDigest");
+        MtpAutolock lock(write_lock);
+        ObjectStore::ReadGuard guard(db.getEpoch());
+
+        const DbEntry* current = db.get(handle);
+        if (!current)
+            return;
+
+        DbEntry entry = *current;
+        Digest value;
+        value.algorithm = algorithm;
+        value.size = size;
+        value.modified = modified;
+        memcpy(value.value, digest, MtpDigest::getSize(algorithm));
+
+        // one per algorithm, older contents are of no interest
+        std::vector<Digest>::iterator it = entry.digests.begin();
+        while (it != entry.digests.end() && it->algorithm != algorithm)
+            ++it;
+        if (it == entry.digests.end())
+            entry.digests.push_back(value);
+        else
+            *it = value;
+        db.put(handle, entry);
+    }
+
+    virtual std::shared_ptr<const UInt8List> getBlockDigests(MtpObjectHandle handle,
+                                 uint16_t algorithm, uint32_t blockSize,
+                                 uint64_t size, time_t modified)
+    {
+        MtpTrace::Span span("database", "getBlockDigests");
+        ObjectStore::ReadGuard guard(db.getEpoch());
+
+        const DbEntry* entry = db.get(handle);
+        if (!entry)
+            return nullptr;
+
+        const BlockDigests& cached = entry->block_digests;
+        if (cached.algorithm != algorithm || cached.block_size != blockSize
+                || cached.size != size || cached.modified != modified)
+            return nullptr;
+        return cached.value;
+    }
+
+    virtual void setBlockDigests(MtpObjectHandle handle,
+                                 uint16_t algorithm, uint32_t blockSize,
+                                 uint64_t size, time_t modified,
+                                 std::shared_ptr<const UInt8List> digests)
+    {
+        MtpTrace::Span span("database", "setBlockDigests");
+        MtpAutolock lock(write_lock);
+        ObjectStore::ReadGuard guard(db.getEpoch());
+
+        const DbEntry* current = db.get(handle);
+        if (!current)
+            return;
+
+        // only the last block size asked for is kept
+        DbEntry entry = *current;
+        entry.block_digests.algorithm = algorithm;
+        entry.block_digests.block_size = blockSize;
+        entry.block_digests.size = size;
+        entry.block_digests.modified = modified;
+        entry.block_digests.value = digests;
+        db.put(handle, entry);
+    }
+
+    virtual void getStatistics(size_t& outObjects, size_t& outMemory)
+    {
+        ObjectStore::ReadGuard guard(db.getEpoch());
+        size_t memory = db.getTableMemory();
+
+        for(ObjectStore::const_iterator it = db.begin(); it != db.end(); ++it) {
+            memory += sizeof(DbEntry) + it->display_name.capacity() + it->path.capacity()
+                    + it->digests.capacity() * sizeof(Digest);
+            if (it->block_digests.value)
+                memory += it->block_digests.value->size();
+        }
+        outObjects = db.size();
+        outMemory = memory;
+    }
+
     virtual void sessionStarted(MtpServer* server)
     {
         VLOG(1) << __PRETTY_FUNCTION__;
+        MtpAutolock lock(write_lock);
+        ObjectStore::ReadGuard guard(db.getEpoch());
         local_server = server;
+        collect_free_handles();
+        for(std::map<MtpStorageID, MtpChangeJournal*>::iterator it = journals.begin(); it != journals.end(); ++it)
+            it->second->beginSession();
     }
 
     virtual void sessionEnded()
     {
         VLOG(1) << __PRETTY_FUNCTION__;
         VLOG(1) << "objects in db at session end: " << db.size();
+        MtpAutolock lock(write_lock);
+        save_state();
+        for(std::map<MtpStorageID, MtpChangeJournal*>::iterator it = journals.begin(); it != journals.end(); ++it)
+            it->second->endSession();
         local_server = nullptr;
     }
 };
@@ -17,6 +17,9 @@
 #ifndef __USB_MTP_INTERFACE_H
 #define __USB_MTP_INTERFACE_H
 
+#include <atomic>
+#include <thread>
+
 #include "usb.h"
 
 class USBMtpInterface {
@@ -24,6 +27,10 @@ private:
 
     int interface_index;
 
+    std::thread control_thread;
+    std::atomic<bool> control_running;
+    std::atomic<bool> reset_pending;
+
     struct usb_interface_descriptor mtp_interface_descriptor = {
         .bLength = USB_DT_INTERFACE_SIZE,
         .bDescriptorType = USB_DT_INTERFACE,
@@ -65,6 +72,19 @@ public:
     ssize_t read(char *ptr, size_t len);
     ssize_t write(const char *ptr, size_t len);
     ssize_t sendEvent(const char *ptr, size_t len);
+
+    // Serves the MTP class requests on the control endpoint, from after
+    // usbInitialize() until stopControl().
+    void    startControl();
+    void    stopControl();
+    // true once after the host sent a Device Reset request
+    bool    takeReset();
+
+private:
+    void    controlLoop();
+    void    handleControl(const UsbControlRequest& request);
+    void    cancelTransfers();
+    ssize_t checkCancelled(ssize_t ret);
 };
 
 #endif /* __USB_MTP_INTERFACE_H */
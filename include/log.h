@@ -18,6 +18,11 @@
 #define __LOGGING_H
 
 #include <iostream>
+#include <string>
+
+#include <stddef.h>
+#include <stdint.h>
+
 #include "nxlink.h"
 
 #define VERBOSE 0
@@ -26,12 +31,92 @@
 #define ERROR 3
 #define FATAL 4
 
+// levels built in, LOG() below LOG_MIN_LEVEL and VLOG() above
+// VLOG_MAX_LEVEL compile to nothing
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL VERBOSE
+#endif
+#ifndef VLOG_MAX_LEVEL
+#define VLOG_MAX_LEVEL 3
+#endif
+
 extern int verbose_level;
 extern char log_level_color[5][16];
 
-#define LOG(level) std::cout << "\n" << (nxlink ? log_level_color[level] : "")
+// A message as it is streamed into. The values are kept as they are, and
+// the message is queued at the end of the statement without taking a
+// lock. A thread of its own formats it and writes it out, so that the
+// caller does not wait for the serial interface or the console.
+class LogMessage {
+public:
+    static const size_t     kMaxSize = 480;
+
+    enum Tag {
+        TAG_SIGNED,
+        TAG_UNSIGNED,
+        TAG_DOUBLE,
+        TAG_POINTER,
+        TAG_CHAR,
+        TAG_STRING,
+        TAG_HEX,
+        TAG_DEC,
+    };
+
+private:
+    // level, then a tag and its value for each value streamed in
+    uint8_t                 mData[kMaxSize];
+    size_t                  mLength;
+
+public:
+    explicit                LogMessage(int level);
+                            ~LogMessage();
+
+    LogMessage&             operator<<(const char* value);
+    LogMessage&             operator<<(const std::string& value);
+    LogMessage&             operator<<(char value);
+    LogMessage&             operator<<(signed char value) { return *this << (char)value; }
+    LogMessage&             operator<<(unsigned char value) { return *this << (char)value; }
+    LogMessage&             operator<<(bool value) { return putUnsigned(value); }
+    LogMessage&             operator<<(short value) { return putSigned(value); }
+    LogMessage&             operator<<(unsigned short value) { return putUnsigned(value); }
+    LogMessage&             operator<<(int value) { return putSigned(value); }
+    LogMessage&             operator<<(unsigned int value) { return putUnsigned(value); }
+    LogMessage&             operator<<(long value) { return putSigned(value); }
+    LogMessage&             operator<<(unsigned long value) { return putUnsigned(value); }
+    LogMessage&             operator<<(long long value) { return putSigned(value); }
+    LogMessage&             operator<<(unsigned long long value) { return putUnsigned(value); }
+    LogMessage&             operator<<(double value);
+    LogMessage&             operator<<(const void* value);
+    // std::hex and std::dec, for this message only
+    LogMessage&             operator<<(std::ios_base& (*manipulator)(std::ios_base&));
+
+                            LogMessage(const LogMessage&) = delete;
+    LogMessage&             operator=(const LogMessage&) = delete;
+
+private:
+    LogMessage&             putSigned(int64_t value);
+    LogMessage&             putUnsigned(uint64_t value);
+    LogMessage&             put(Tag tag, const void* value, size_t length);
+};
+
+// starts writing messages out, to path if not NULL or else to stdout,
+// which is the serial interface with nxlink and the console otherwise.
+// Messages from before are written as they come.
+void logStart(const char* path);
+// writes out what is queued and stops
+void logStop();
+
+#define VLOG_IS_ON(verboselevel) ((verboselevel) <= VLOG_MAX_LEVEL && (verboselevel) <= verbose_level)
+
+// turns the message into the void of the other branch of ?:, with a
+// precedence below << and above ?:
+class LogVoidify {
+public:
+    void                    operator&(const LogMessage&) {}
+};
 
-#define VLOG_IS_ON(verboselevel) (verboselevel <= verbose_level)
-#define VLOG(verboselevel) if(VLOG_IS_ON(verboselevel)) std::cout << "\n" << (nxlink ? log_level_color[VERBOSE]: "" )
+// an expression, so neither takes an else that follows as its own
+#define LOG(level) !((level) >= LOG_MIN_LEVEL) ? (void)0 : LogVoidify() & LogMessage(level)
+#define VLOG(verboselevel) !VLOG_IS_ON(verboselevel) ? (void)0 : LogVoidify() & LogMessage(VERBOSE)
 
 #endif /* __LOGGING_H */
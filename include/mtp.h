@@ -306,6 +306,16 @@
 #define MTP_PROPERTY_TIME_TO_LIVE                           0xDD71
 #define MTP_PROPERTY_MEDIA_GUID                             0xDD72
 
+// mtp-server-nx vendor object properties
+
+// Digests of the contents as of the last upload, an empty array if unknown
+#define MTP_PROPERTY_NX_CONTENT_CRC32C                      0xD801
+#define MTP_PROPERTY_NX_CONTENT_SHA256                      0xD802
+// Where an interrupted upload continues with SendPartialObject, which is
+// the number of bytes that made it to the device. 0xFFFFFFFFFFFFFFFF for
+// objects that are complete.
+#define MTP_PROPERTY_NX_RESUME_OFFSET                       0xD803
+
 // MTP Device Property Codes
 #define MTP_DEVICE_PROPERTY_UNDEFINED                       0x5000
 #define MTP_DEVICE_PROPERTY_BATTERY_LEVEL                   0x5001
@@ -404,6 +414,37 @@
 // Called to commit changes made by SendPartialObject and TruncateObject
 #define MTP_OPERATION_END_EDIT_OBJECT                       0x95C5
 
+// mtp-server-nx vendor extensions
+
+// Returns the changes made to a storage since a token from a previous call
+#define MTP_OPERATION_NX_GET_CHANGES                        0x9A01
+// Returns a digest of an object or a byte range of it, computed on the device
+#define MTP_OPERATION_NX_GET_OBJECT_DIGEST                  0x9A02
+// Returns rolling and strong digests of each block of an object, so that a
+// client can send only the blocks that differ with SendPartialObject
+#define MTP_OPERATION_NX_GET_BLOCK_DIGESTS                  0x9A03
+// Selects the encoding of the data phases of GetObject, GetPartialObject and
+// SendObject for the rest of the session. Returns the most data a frame can
+// carry. Compressed data phases are a sequence of frames, see MtpCompressor,
+// of unknown length: the container length is 0xFFFFFFFF and the sender pads
+// after the last frame so that the data phase ends with a short packet.
+#define MTP_OPERATION_NX_SET_COMPRESSION                    0x9A04
+// Writes the trace of recent requests, transfers, file I/O and database
+// calls to sdmc:/mtp-trace.json, see MtpTrace
+#define MTP_OPERATION_NX_DUMP_TRACE                         0x9A05
+
+// Digest algorithms of the operations above
+#define MTP_NX_DIGEST_CRC32                                 0x0001
+#define MTP_NX_DIGEST_CRC32C                                0x0002
+#define MTP_NX_DIGEST_SHA256                                0x0003
+// the rsync weak checksum, two 16 bit sums
+#define MTP_NX_DIGEST_ROLLING                               0x0004
+
+// Encodings of MTP_OPERATION_NX_SET_COMPRESSION
+#define MTP_NX_COMPRESSION_NONE                             0x0000
+// LZ4 block format
+#define MTP_NX_COMPRESSION_LZ4                              0x0001
+
 // MTP Response Codes
 #define MTP_RESPONSE_UNDEFINED                                  0x2000
 #define MTP_RESPONSE_OK                                         0x2001
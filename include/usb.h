@@ -34,10 +34,38 @@ typedef enum {
     UsbDirection_Write = 1,
 } UsbDirection;
 
+// setup packet of a request sent to an interface on the control endpoint
+typedef struct {
+    u8 bmRequestType;
+    u8 bRequest;
+    u16 wValue;
+    u16 wIndex;
+    u16 wLength;
+} UsbControlRequest;
+
 Result usbInitialize(struct usb_device_descriptor *device_descriptor, u32 num_interfaces, const UsbInterfaceDesc *infos);
 void usbExit(void);
 size_t usbTransfer(u32 interface, u32 endpoint, UsbDirection dir, void* buffer, size_t size, u64 timeout);
 
+// Makes the transfer in progress on the endpoint fail right away, and every
+// transfer after it until usbClearCancel().
+void usbCancel(u32 interface, u32 endpoint);
+void usbClearCancel(u32 interface, u32 endpoint);
+bool usbIsCancelled(u32 interface, u32 endpoint);
+
+// wMaxPacketSize of the bulk endpoints at the speed the host connected with
+u32 usbGetMaxPacketSize(void);
+
+// Pieces of bulk transfers copied through the page-aligned buffer of an
+// endpoint because the caller's buffer was not aligned, with their bytes,
+// and pieces transferred from the caller's buffer directly.
+void usbGetBounceStats(u64 *bounced, u64 *bouncedBytes, u64 *direct);
+
+Result usbWaitControlRequest(u32 interface, UsbControlRequest *request, u64 timeout);
+// Data stage of the last request, or its status stage when size is 0.
+Result usbControlTransfer(u32 interface, UsbDirection dir, void* buffer, size_t size);
+Result usbStallControl(u32 interface);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -0,0 +1,228 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "MtpChangeJournal"
+
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <switch.h>
+
+#include "MtpChangeJournal.h"
+#include "MtpDataPacket.h"
+#include "MtpUtils.h"
+
+#include "log.h"
+
+#define JOURNAL_FILE_NAME       "changes.log"
+#define JOURNAL_MARKER_SUFFIX   ".open"
+#define JOURNAL_MAGIC           "mtp-server-nx changes 1"
+
+namespace android {
+
+MtpChangeJournal::MtpChangeJournal(const MtpString& root, size_t capacity)
+    :   mJournalID(0),
+        mFirstSequence(1),
+        mNextSequence(1),
+        mCapacity(capacity),
+        mDirty(false)
+{
+    mFilePath = root;
+    if (mFilePath.empty() || mFilePath[mFilePath.size() - 1] != '/')
+        mFilePath += "/";
+    mFilePath += MTP_STATE_DIRECTORY "/" JOURNAL_FILE_NAME;
+
+    randomGet(&mJournalID, sizeof(mJournalID));
+}
+
+MtpChangeJournal::~MtpChangeJournal() {
+}
+
+bool MtpChangeJournal::load() {
+    FILE* file = fopen(mFilePath.c_str(), "r");
+    if (!file) {
+        VLOG(1) << "no change journal at " << mFilePath;
+        // a new journal, anything a client remembers is stale
+        mDirty = true;
+        return false;
+    }
+
+    char line[128];
+    unsigned int journalID;
+    uint64_t first, next;
+    if (!fgets(line, sizeof(line), file) || strncmp(line, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC)) != 0
+            || !fgets(line, sizeof(line), file)
+            || sscanf(line, "journal %08x first %" SCNu64 " next %" SCNu64, &journalID, &first, &next) != 3) {
+        LOG(WARNING) << "ignoring unknown change journal " << mFilePath;
+        fclose(file);
+        mDirty = true;
+        return false;
+    }
+    mJournalID = journalID;
+    mFirstSequence = first;
+    mNextSequence = next;
+
+    mRecords.clear();
+    while (fgets(line, sizeof(line), file)) {
+        Record record;
+        unsigned int kind;
+        if (sscanf(line, "%" SCNu64 " %u %u %u %08x%08x%08x%08x", &record.sequence, &kind,
+                &record.handle, &record.parent,
+                &record.uid[0], &record.uid[1], &record.uid[2], &record.uid[3]) != 8)
+            continue;
+        record.kind = kind;
+        mRecords.push_back(record);
+    }
+    fclose(file);
+
+    // only a complete tail of the journal is of any use
+    while (!mRecords.empty() && mRecords.front().sequence < mFirstSequence)
+        mRecords.pop_front();
+    if (!mRecords.empty())
+        mFirstSequence = mRecords.front().sequence;
+    uint64_t last = mRecords.empty() ? mFirstSequence : mRecords.back().sequence + 1;
+    if (last != mNextSequence) {
+        LOG(WARNING) << "change journal " << mFilePath << " is incomplete";
+        mRecords.clear();
+        mFirstSequence = mNextSequence;
+        mDirty = true;
+    }
+
+    // the numbers after mNextSequence may have gone to a client already,
+    // under a new ID they can not be mistaken for the ones to come
+    struct stat st;
+    if (stat((mFilePath + JOURNAL_MARKER_SUFFIX).c_str(), &st) == 0) {
+        LOG(WARNING) << "change journal " << mFilePath << " was not closed, starting a new one";
+        randomGet(&mJournalID, sizeof(mJournalID));
+        mRecords.clear();
+        mFirstSequence = mNextSequence;
+        mDirty = true;
+    }
+
+    VLOG(1) << "loaded " << mRecords.size() << " changes from " << mFilePath;
+    return true;
+}
+
+bool MtpChangeJournal::save() {
+    if (!mDirty)
+        return true;
+
+    MtpString dir = mFilePath.substr(0, mFilePath.rfind('/'));
+    mkdir(dir.c_str(), 0777);
+
+    MtpString tmpPath = mFilePath + ".tmp";
+    FILE* file = fopen(tmpPath.c_str(), "w");
+    if (!file) {
+        LOG(ERROR) << "could not write change journal " << tmpPath;
+        return false;
+    }
+
+    fprintf(file, "%s\njournal %08x first %" PRIu64 " next %" PRIu64 "\n", JOURNAL_MAGIC,
+            mJournalID, mFirstSequence, mNextSequence);
+    for (std::deque<Record>::const_iterator it = mRecords.begin(); it != mRecords.end(); ++it) {
+        fprintf(file, "%" PRIu64 " %u %u %u %08x%08x%08x%08x\n", it->sequence, it->kind,
+                it->handle, it->parent, it->uid[0], it->uid[1], it->uid[2], it->uid[3]);
+    }
+
+    bool ok = (fflush(file) == 0);
+    ok = (fclose(file) == 0) && ok;
+    // rename() does not replace an existing file on the SD card
+    if (ok) {
+        unlink(mFilePath.c_str());
+        ok = (rename(tmpPath.c_str(), mFilePath.c_str()) == 0);
+    }
+    if (!ok) {
+        LOG(ERROR) << "could not save change journal " << mFilePath;
+        unlink(tmpPath.c_str());
+        return false;
+    }
+
+    mDirty = false;
+    return true;
+}
+
+void MtpChangeJournal::beginSession() {
+    MtpString dir = mFilePath.substr(0, mFilePath.rfind('/'));
+    mkdir(dir.c_str(), 0777);
+
+    MtpString markerPath = mFilePath + JOURNAL_MARKER_SUFFIX;
+    FILE* file = fopen(markerPath.c_str(), "w");
+    if (!file) {
+        LOG(ERROR) << "could not write change journal marker " << markerPath;
+        return;
+    }
+    fclose(file);
+}
+
+bool MtpChangeJournal::endSession() {
+    if (!save())
+        return false;
+    unlink((mFilePath + JOURNAL_MARKER_SUFFIX).c_str());
+    return true;
+}
+
+void MtpChangeJournal::append(Kind kind, MtpObjectHandle handle,
+        MtpObjectHandle parent, const uint128_t& uid) {
+    Record record;
+    record.sequence = mNextSequence++;
+    record.kind = kind;
+    record.handle = handle;
+    record.parent = parent;
+    memcpy(record.uid, uid, sizeof(record.uid));
+    mRecords.push_back(record);
+
+    while (mRecords.size() > mCapacity) {
+        mRecords.pop_front();
+        mFirstSequence = mRecords.front().sequence;
+    }
+    mDirty = true;
+
+    VLOG(2) << "change " << record.sequence << ": kind " << kind << " handle " << handle
+            << " parent " << parent;
+}
+
+bool MtpChangeJournal::isTruncated(uint64_t token) const {
+    return token < mFirstSequence || token > mNextSequence;
+}
+
+void MtpChangeJournal::writeChanges(uint64_t token, MtpDataPacket& packet) const {
+    packet.putUInt32(mJournalID);
+    packet.putUInt64(mNextSequence);
+
+    if (isTruncated(token)) {
+        packet.putUInt16(kStatusTruncated);
+        packet.putUInt32(0);
+        return;
+    }
+
+    packet.putUInt16(kStatusComplete);
+    size_t first = mRecords.size() - (mNextSequence - token);
+    packet.putUInt32(mRecords.size() - first);
+    for (size_t i = first; i < mRecords.size(); i++) {
+        const Record& record = mRecords[i];
+        packet.putUInt64(record.sequence);
+        packet.putUInt16(record.kind);
+        packet.putUInt32(record.handle);
+        packet.putUInt32(record.parent);
+        packet.putUInt128(record.uid);
+    }
+}
+
+}  // namespace android
@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "MtpCompressor"
+
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+#include "MtpCompressor.h"
+#include "MtpLz4.h"
+
+#include "log.h"
+
+// chunks in flight per worker thread, one being worked on and one waiting
+#define CHUNKS_PER_THREAD       2
+
+namespace android {
+
+static inline void putUInt32(uint8_t* p, uint32_t value) {
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = value >> 24;
+}
+
+static inline uint32_t getUInt32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+MtpCompressor::MtpCompressor(int threads)
+    :   mChunks(threads * CHUNKS_PER_THREAD),
+        mHead(0),
+        mTail(0),
+        mRunning(true)
+{
+    for (size_t i = 0; i < mChunks.size(); i++) {
+        Chunk& chunk = mChunks[i];
+        chunk.mData = (uint8_t*)malloc(kChunkSize);
+        chunk.mLength = 0;
+        chunk.mFrame = (uint8_t*)malloc(kMaxFrameSize);
+        chunk.mFrameLength = 0;
+        chunk.mValid = false;
+        chunk.mState = Chunk::FREE;
+        chunk.mExpand = false;
+    }
+    for (int i = 0; i < threads; i++)
+        mThreads.push_back(std::thread(&MtpCompressor::run, this));
+}
+
+MtpCompressor::~MtpCompressor() {
+    {
+        MtpAutolock autoLock(mMutex);
+        mRunning = false;
+    }
+    mQueued.notify_all();
+    for (size_t i = 0; i < mThreads.size(); i++)
+        mThreads[i].join();
+    for (size_t i = 0; i < mChunks.size(); i++) {
+        free(mChunks[i].mData);
+        free(mChunks[i].mFrame);
+    }
+}
+
+MtpCompressor::Chunk* MtpCompressor::acquire() {
+    MtpAutolock autoLock(mMutex);
+    if (mTail - mHead == mChunks.size())
+        return NULL;
+    return &mChunks[mTail % mChunks.size()];
+}
+
+void MtpCompressor::submit(Chunk* chunk, bool expand) {
+    {
+        MtpAutolock autoLock(mMutex);
+        chunk->mExpand = expand;
+        chunk->mValid = true;
+        chunk->mState = Chunk::QUEUED;
+        mTail++;
+    }
+    mQueued.notify_one();
+}
+
+MtpCompressor::Chunk* MtpCompressor::next() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (mHead == mTail)
+        return NULL;
+    Chunk* chunk = &mChunks[mHead % mChunks.size()];
+    mDone.wait(lock, [chunk] { return chunk->mState == Chunk::DONE; });
+    chunk->mState = Chunk::FREE;
+    mHead++;
+    return chunk;
+}
+
+bool MtpCompressor::parseHeader(const uint8_t* header, size_t& payloadLength,
+                                size_t& dataLength, bool& raw) {
+    uint32_t payload = getUInt32(header);
+    raw = (payload & kFrameRaw) != 0;
+    payloadLength = payload & ~kFrameRaw;
+    dataLength = getUInt32(header + 4);
+    if (dataLength > kChunkSize || payloadLength > kChunkSize)
+        return false;
+    return raw ? payloadLength == dataLength : payloadLength > 0 || dataLength == 0;
+}
+
+void MtpCompressor::run() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (mRunning) {
+        // oldest first, next() is waiting for it
+        Chunk* chunk = NULL;
+        for (uint64_t i = mHead; i < mTail && !chunk; i++) {
+            if (mChunks[i % mChunks.size()].mState == Chunk::QUEUED)
+                chunk = &mChunks[i % mChunks.size()];
+        }
+        if (!chunk) {
+            mQueued.wait(lock);
+            continue;
+        }
+
+        chunk->mState = Chunk::BUSY;
+        lock.unlock();
+        if (chunk->mExpand)
+            expand(chunk);
+        else
+            compress(chunk);
+        lock.lock();
+        chunk->mState = Chunk::DONE;
+        mDone.notify_all();
+    }
+}
+
+void MtpCompressor::compress(Chunk* chunk) {
+    uint8_t* payload = chunk->mFrame + kFrameHeaderSize;
+    // not worth the host's time below a 1/16 gain
+    size_t length = MtpLz4::compress(chunk->mData, chunk->mLength, payload,
+                                     chunk->mLength - chunk->mLength / 16);
+    if (length > 0) {
+        putUInt32(chunk->mFrame, length);
+    } else {
+        memcpy(payload, chunk->mData, chunk->mLength);
+        length = chunk->mLength;
+        putUInt32(chunk->mFrame, length | kFrameRaw);
+    }
+    putUInt32(chunk->mFrame + 4, chunk->mLength);
+    chunk->mFrameLength = kFrameHeaderSize + length;
+}
+
+void MtpCompressor::expand(Chunk* chunk) {
+    size_t payloadLength, dataLength;
+    bool raw;
+    chunk->mValid = parseHeader(chunk->mFrame, payloadLength, dataLength, raw);
+    if (!chunk->mValid)
+        return;
+
+    const uint8_t* payload = chunk->mFrame + kFrameHeaderSize;
+    if (raw) {
+        memcpy(chunk->mData, payload, dataLength);
+    } else {
+        ssize_t length = MtpLz4::decompress(payload, payloadLength, chunk->mData, kChunkSize);
+        chunk->mValid = (length >= 0 && (size_t)length == dataLength);
+    }
+    chunk->mLength = dataLength;
+}
+
+}  // namespace android
@@ -23,6 +23,7 @@
 
 #include "MtpDataPacket.h"
 #include "MtpStringBuffer.h"
+#include "MtpTrace.h"
 
 #include "log.h"
 
@@ -347,6 +348,7 @@ void MtpDataPacket::putString(const uint16_t* string) {
 }
 
 int MtpDataPacket::read(USBMtpInterface* usb) {
+    MtpTrace::Span span("phase", "data");
     int ret = usb->read((char*)mBuffer, MTP_BUFFER_SIZE);
     if (ret < MTP_CONTAINER_HEADER_SIZE)
         return -1;
@@ -356,6 +358,8 @@ int MtpDataPacket::read(USBMtpInterface* usb) {
 }
 
 int MtpDataPacket::read(USBMtpInterface* usb, uint32_t length) {
+    MtpTrace::Span span("phase", "data");
+    allocate(length);
     int ret = usb->read((char*)mBuffer, length);
     if (ret < MTP_CONTAINER_HEADER_SIZE)
         return -1;
@@ -365,6 +369,7 @@ int MtpDataPacket::read(USBMtpInterface* usb, uint32_t length) {
 }
 
 int MtpDataPacket::write(USBMtpInterface* usb) {
+    MtpTrace::Span span("phase", "data");
     MtpPacket::putUInt32(MTP_CONTAINER_LENGTH_OFFSET, mPacketSize);
     MtpPacket::putUInt16(MTP_CONTAINER_TYPE_OFFSET, MTP_CONTAINER_TYPE_DATA);
     int ret = usb->write((const char*)mBuffer, mPacketSize);
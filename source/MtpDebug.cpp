@@ -69,6 +69,12 @@ static const CodeEntry sOperationCodes[] = {
     { "MTP_OPERATION_TRUNCATE_OBJECT",              0x95C3 },
     { "MTP_OPERATION_BEGIN_EDIT_OBJECT",            0x95C4 },
     { "MTP_OPERATION_END_EDIT_OBJECT",              0x95C5 },
+    // mtp-server-nx extensions
+    { "MTP_OPERATION_NX_GET_CHANGES",               0x9A01 },
+    { "MTP_OPERATION_NX_GET_OBJECT_DIGEST",         0x9A02 },
+    { "MTP_OPERATION_NX_GET_BLOCK_DIGESTS",         0x9A03 },
+    { "MTP_OPERATION_NX_SET_COMPRESSION",           0x9A04 },
+    { "MTP_OPERATION_NX_DUMP_TRACE",                0x9A05 },
     { 0,                                            0      },
 };
 
@@ -318,6 +324,10 @@ static const CodeEntry sObjectPropCodes[] = {
     { "MTP_PROPERTY_LAST_BUILD_DATE",                        0xDD70 },
     { "MTP_PROPERTY_TIME_TO_LIVE",                           0xDD71 },
     { "MTP_PROPERTY_MEDIA_GUID",                             0xDD72 },
+    // mtp-server-nx extensions
+    { "MTP_PROPERTY_NX_CONTENT_CRC32C",                      0xD801 },
+    { "MTP_PROPERTY_NX_CONTENT_SHA256",                      0xD802 },
+    { "MTP_PROPERTY_NX_RESUME_OFFSET",                       0xD803 },
     { 0,                                                     0      },
 };
 
@@ -0,0 +1,221 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "MtpDigest"
+
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "MtpDigest.h"
+#include "MtpSplitFile.h"
+#include "mtp.h"
+
+#include "log.h"
+
+// read size of digestFile()
+#define DIGEST_BUFFER_SIZE      (256 * 1024)
+
+namespace android {
+
+MtpDigest::MtpDigest(uint16_t algorithm)
+    :   mAlgorithm(algorithm)
+{
+    reset();
+}
+
+bool MtpDigest::isSupported(uint16_t algorithm) {
+    return getSize(algorithm) != 0;
+}
+
+int MtpDigest::getSize(uint16_t algorithm) {
+    switch (algorithm) {
+        case MTP_NX_DIGEST_CRC32:
+        case MTP_NX_DIGEST_CRC32C:
+        case MTP_NX_DIGEST_ROLLING:
+            return 4;
+        case MTP_NX_DIGEST_SHA256:
+            return 32;
+        default:
+            return 0;
+    }
+}
+
+void MtpDigest::reset() {
+    mCrc = 0;
+    if (mAlgorithm == MTP_NX_DIGEST_SHA256)
+        sha256ContextCreate(&mSha256);
+    mLength = 0;
+}
+
+void MtpDigest::update(const void* data, size_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    mLength += length;
+
+    switch (mAlgorithm) {
+        case MTP_NX_DIGEST_CRC32:
+            mCrc = crc32CalculateWithSeed(mCrc, bytes, length);
+            break;
+        case MTP_NX_DIGEST_CRC32C:
+            mCrc = crc32cCalculateWithSeed(mCrc, bytes, length);
+            break;
+        case MTP_NX_DIGEST_ROLLING:
+            updateRolling(bytes, length);
+            break;
+        case MTP_NX_DIGEST_SHA256:
+            sha256ContextUpdate(&mSha256, bytes, length);
+            break;
+    }
+}
+
+void MtpDigest::finish(uint8_t* out) {
+    if (mAlgorithm == MTP_NX_DIGEST_SHA256) {
+        sha256ContextGetHash(&mSha256, out);
+        return;
+    }
+
+    out[0] = mCrc >> 24;
+    out[1] = mCrc >> 16;
+    out[2] = mCrc >> 8;
+    out[3] = mCrc;
+}
+
+void MtpDigest::updateRolling(const uint8_t* data, size_t length) {
+    // s1 is the sum of the bytes, s2 the sum of the running s1, both mod 2^16
+    uint32_t s1 = mCrc & 0xFFFF;
+    uint32_t s2 = mCrc >> 16;
+    while (length-- > 0) {
+        s1 += *data++;
+        s2 += s1;
+    }
+    mCrc = ((s2 & 0xFFFF) << 16) | (s1 & 0xFFFF);
+}
+
+MtpResponseCode MtpDigest::digestFile(const char* path, uint16_t algorithm,
+        uint64_t offset, uint64_t length, uint8_t* out, uint64_t& outLength) {
+    if (!isSupported(algorithm))
+        return MTP_RESPONSE_INVALID_PARAMETER;
+
+    // split files included
+    MtpSplitFile file;
+    if (!file.open(path, O_RDONLY)) {
+        LOG(ERROR) << "could not open " << path;
+        return MTP_RESPONSE_GENERAL_ERROR;
+    }
+
+    MtpResponseCode result = MTP_RESPONSE_OK;
+    uint8_t* buffer = (uint8_t*)malloc(DIGEST_BUFFER_SIZE);
+    MtpDigest digest(algorithm);
+
+    if (!buffer) {
+        result = MTP_RESPONSE_GENERAL_ERROR;
+    } else if (!file.seek(offset)) {
+        result = MTP_RESPONSE_INVALID_PARAMETER;
+    } else {
+        uint64_t remaining = length ? length : UINT64_MAX;
+        while (remaining > 0) {
+            size_t count = remaining < DIGEST_BUFFER_SIZE ? remaining : DIGEST_BUFFER_SIZE;
+            ssize_t ret = file.read(buffer, count);
+            if (ret < 0) {
+                LOG(ERROR) << "could not read " << path;
+                result = MTP_RESPONSE_GENERAL_ERROR;
+                break;
+            }
+            if (ret == 0)
+                break;
+            digest.update(buffer, ret);
+            remaining -= ret;
+        }
+    }
+
+    free(buffer);
+
+    if (result == MTP_RESPONSE_OK) {
+        outLength = digest.getLength();
+        digest.finish(out);
+        VLOG(2) << "digest of " << outLength << " bytes of " << path;
+    }
+    return result;
+}
+
+MtpResponseCode MtpDigest::digestBlocks(const char* path, uint16_t algorithm,
+        uint32_t blockSize, UInt8List& out, uint64_t& outLength) {
+    if (!isSupported(algorithm) || blockSize == 0)
+        return MTP_RESPONSE_INVALID_PARAMETER;
+
+    // split files included
+    MtpSplitFile file;
+    if (!file.open(path, O_RDONLY)) {
+        LOG(ERROR) << "could not open " << path;
+        return MTP_RESPONSE_GENERAL_ERROR;
+    }
+
+    MtpResponseCode result = MTP_RESPONSE_OK;
+    uint8_t* buffer = (uint8_t*)malloc(DIGEST_BUFFER_SIZE);
+    MtpDigest rolling(MTP_NX_DIGEST_ROLLING);
+    MtpDigest strong(algorithm);
+    uint8_t digest[kMaxSize];
+    int strongSize = getSize(algorithm);
+    uint32_t blockLength = 0;
+
+    outLength = 0;
+    if (!buffer)
+        result = MTP_RESPONSE_GENERAL_ERROR;
+
+    while (result == MTP_RESPONSE_OK) {
+        ssize_t ret = file.read(buffer, DIGEST_BUFFER_SIZE);
+        if (ret < 0) {
+            LOG(ERROR) << "could not read " << path;
+            result = MTP_RESPONSE_GENERAL_ERROR;
+            break;
+        }
+
+        // a short last block still gets its entry
+        bool last = (ret == 0);
+        const uint8_t* data = buffer;
+        while (ret > 0 || (last && blockLength > 0)) {
+            uint32_t count = std::min((uint64_t)ret, (uint64_t)(blockSize - blockLength));
+            rolling.update(data, count);
+            strong.update(data, count);
+            data += count;
+            ret -= count;
+            blockLength += count;
+            outLength += count;
+
+            if (blockLength == blockSize || (last && blockLength > 0)) {
+                rolling.finish(digest);
+                out.insert(out.end(), digest, digest + 4);
+                strong.finish(digest);
+                out.insert(out.end(), digest, digest + strongSize);
+                rolling.reset();
+                strong.reset();
+                blockLength = 0;
+            }
+        }
+        if (last)
+            break;
+    }
+
+    free(buffer);
+
+    VLOG(2) << "block digests of " << outLength << " bytes of " << path;
+    return result;
+}
+
+}  // namespace android
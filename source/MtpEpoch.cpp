@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "MtpEpoch"
+
+#include <thread>
+
+#include "MtpEpoch.h"
+
+#include "log.h"
+
+// retired objects piling up before the writer tries to free them
+#define RECLAIM_THRESHOLD       64
+
+namespace android {
+
+MtpEpoch::MtpEpoch()
+    :   mEpoch(1)
+{
+    for (int i = 0; i < kMaxReaders; i++)
+        mReaders[i].store(0);
+}
+
+MtpEpoch::~MtpEpoch() {
+    // nobody can be reading anymore
+    for (size_t i = 0; i < mRetired.size(); i++)
+        mRetired[i].destroy(mRetired[i].object);
+}
+
+int MtpEpoch::enter() {
+    for (;;) {
+        // the epoch is published before the reader looks at any shared
+        // pointer, so a writer either sees the slot or the reader sees
+        // the writer's new pointer
+        uint64_t epoch = mEpoch.load();
+        for (int i = 0; i < kMaxReaders; i++) {
+            uint64_t expected = 0;
+            if (mReaders[i].compare_exchange_strong(expected, epoch))
+                return i;
+        }
+        VLOG(2) << "all reader slots busy";
+        std::this_thread::yield();
+    }
+}
+
+void MtpEpoch::leave(int slot) {
+    mReaders[slot].store(0);
+}
+
+void MtpEpoch::retire(void* object, void (*destroy)(void*)) {
+    Retired retired;
+    retired.object = object;
+    retired.destroy = destroy;
+    // readers entering from now on cannot find the object anymore
+    retired.epoch = mEpoch.fetch_add(1);
+    mRetired.push_back(retired);
+
+    if (mRetired.size() >= RECLAIM_THRESHOLD)
+        reclaim();
+}
+
+void MtpEpoch::reclaim() {
+    uint64_t oldest = UINT64_MAX;
+    for (int i = 0; i < kMaxReaders; i++) {
+        uint64_t epoch = mReaders[i].load();
+        if (epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < mRetired.size(); i++) {
+        if (mRetired[i].epoch < oldest)
+            mRetired[i].destroy(mRetired[i].object);
+        else
+            mRetired[kept++] = mRetired[i];
+    }
+    mRetired.resize(kept);
+}
+
+}  // namespace android
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "MtpFileCache"
+
+#include <fcntl.h>
+
+#include "MtpFileCache.h"
+
+#include "log.h"
+
+namespace android {
+
+MtpFileCache::MtpFileCache()
+    :   mHits(0),
+        mMisses(0)
+{
+}
+
+MtpFileCache::~MtpFileCache() {
+    clear();
+}
+
+MtpSplitFile* MtpFileCache::get(MtpObjectHandle handle, const MtpString& path) {
+    for (std::list<Entry>::iterator it = mFiles.begin(); it != mFiles.end(); ++it) {
+        if (it->mHandle != handle)
+            continue;
+        // moved behind our back, or the handle went to another file
+        if (it->mPath != path) {
+            close(*it);
+            mFiles.erase(it);
+            break;
+        }
+        mHits++;
+        mFiles.splice(mFiles.begin(), mFiles, it);
+        return it->mFile;
+    }
+
+    mMisses++;
+    MtpSplitFile* file = new MtpSplitFile();
+    if (!file->open(path.c_str(), O_RDONLY)) {
+        delete file;
+        return NULL;
+    }
+    if (mFiles.size() == kMaxFiles) {
+        close(mFiles.back());
+        mFiles.pop_back();
+    }
+
+    Entry entry;
+    entry.mHandle = handle;
+    entry.mPath = path;
+    entry.mFile = file;
+    mFiles.push_front(entry);
+    return file;
+}
+
+void MtpFileCache::invalidate(const MtpString& path) {
+    for (std::list<Entry>::iterator it = mFiles.begin(); it != mFiles.end(); ) {
+        const MtpString& other = it->mPath;
+        if (other.compare(0, path.size(), path) == 0
+                && (other.size() == path.size() || other[path.size()] == '/'
+                    || (!path.empty() && path.back() == '/'))) {
+            VLOG(2) << "closing " << other;
+            close(*it);
+            it = mFiles.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void MtpFileCache::clear() {
+    for (std::list<Entry>::iterator it = mFiles.begin(); it != mFiles.end(); ++it)
+        close(*it);
+    mFiles.clear();
+}
+
+void MtpFileCache::close(Entry& entry) {
+    mReadAhead.release(entry.mFile);
+    delete entry.mFile;
+}
+
+}  // namespace android
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "MtpFileCloser"
+
+#include <mutex>
+
+#include <unistd.h>
+
+#include "MtpFileCloser.h"
+
+#include "log.h"
+
+namespace android {
+
+MtpFileCloser::MtpFileCloser()
+    :   mClosing(0),
+        mRunning(true)
+{
+    mThread = std::thread(&MtpFileCloser::run, this);
+}
+
+MtpFileCloser::~MtpFileCloser() {
+    {
+        MtpAutolock autoLock(mMutex);
+        mRunning = false;
+    }
+    mQueued.notify_all();
+    mThread.join();
+    // whatever is left once the thread is gone
+    for (size_t i = 0; i < mPending.size(); i++)
+        ::close(mPending[i]);
+}
+
+void MtpFileCloser::close(int fd) {
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mClosed.wait(lock, [this] { return mPending.size() < kMaxPending; });
+        mPending.push_back(fd);
+    }
+    mQueued.notify_one();
+}
+
+void MtpFileCloser::drain() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mClosed.wait(lock, [this] { return mPending.empty() && mClosing == 0; });
+}
+
+void MtpFileCloser::run() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (mRunning) {
+        if (mPending.empty()) {
+            mQueued.wait(lock);
+            continue;
+        }
+        int fd = mPending.front();
+        mPending.pop_front();
+        mClosing++;
+        lock.unlock();
+
+        if (::close(fd) != 0)
+            LOG(ERROR) << "closing fd " << fd << " failed";
+
+        lock.lock();
+        mClosing--;
+        mClosed.notify_all();
+    }
+}
+
+}  // namespace android
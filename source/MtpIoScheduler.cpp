@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "MtpIoScheduler"
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+
+#include "MtpIoScheduler.h"
+
+#include "log.h"
+
+namespace android {
+
+// how often a waiting background job checks whether it was stopped
+static const std::chrono::milliseconds kStopPoll(100);
+
+MtpIoScheduler::MtpIoScheduler()
+    :   mForeground(0),
+        mTokens(kBackgroundBurst),
+        mRefilled(Clock::now())
+{
+    memset(mStats, 0, sizeof(mStats));
+}
+
+MtpIoScheduler::~MtpIoScheduler() {
+}
+
+void MtpIoScheduler::beginForeground() {
+    MtpAutolock autoLock(mMutex);
+    mForeground++;
+    Stats& stats = mStats[FOREGROUND];
+    stats.mOperations++;
+    stats.mQueued = mForeground;
+    stats.mMaxQueued = std::max(stats.mMaxQueued, stats.mQueued);
+}
+
+void MtpIoScheduler::endForeground() {
+    {
+        MtpAutolock autoLock(mMutex);
+        mForeground--;
+        mForegroundEnd = Clock::now();
+        mStats[FOREGROUND].mQueued = mForeground;
+    }
+    mChanged.notify_all();
+}
+
+bool MtpIoScheduler::acquireBackground(const std::atomic<bool>& running) {
+    std::unique_lock<std::mutex> lock(mMutex);
+    Stats& stats = mStats[BACKGROUND];
+    Clock::time_point start = Clock::now();
+    stats.mQueued++;
+    stats.mMaxQueued = std::max(stats.mMaxQueued, stats.mQueued);
+
+    bool acquired = false;
+    while (running) {
+        Clock::time_point now = Clock::now();
+        refill(now);
+        Clock::time_point until;
+        if (mForeground > 0)
+            until = now + kStopPoll;
+        else if (now < mForegroundEnd + kForegroundGrace)
+            until = mForegroundEnd + kForegroundGrace;
+        else if (mTokens < 1)
+            until = now + std::chrono::microseconds(
+                    (int64_t)((1 - mTokens) * 1000000 / kBackgroundRate) + 1);
+        else {
+            mTokens -= 1;
+            acquired = true;
+            break;
+        }
+        mChanged.wait_until(lock, std::min(until, now + kStopPoll));
+    }
+
+    uint64_t wait = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+    stats.mQueued--;
+    if (acquired)
+        stats.mOperations++;
+    stats.mWaitMicros += wait;
+    stats.mMaxWaitMicros = std::max(stats.mMaxWaitMicros, wait);
+    return acquired;
+}
+
+MtpIoScheduler::Stats MtpIoScheduler::getStats(Class c) const {
+    MtpAutolock autoLock(mMutex);
+    return mStats[c];
+}
+
+void MtpIoScheduler::refill(Clock::time_point now) {
+    double elapsed = std::chrono::duration<double>(now - mRefilled).count();
+    mTokens = std::min<double>(kBackgroundBurst, mTokens + elapsed * kBackgroundRate);
+    mRefilled = now;
+}
+
+}  // namespace android
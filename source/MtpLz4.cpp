@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "MtpLz4"
+
+#include <cstring>
+
+#include "MtpLz4.h"
+
+// constraints of the block format
+#define MIN_MATCH               4
+// the last bytes of a block are always literals
+#define LAST_LITERALS           5
+// and the last match starts at least this far from the end
+#define MATCH_LIMIT             12
+#define MAX_OFFSET              65535
+#define RUN_MASK                15
+
+#define HASH_BITS               12
+// misses before the search starts skipping ahead, which keeps
+// incompressible data cheap
+#define SKIP_TRIGGER            6
+
+namespace android {
+
+static inline uint32_t read32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t hash(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - HASH_BITS);
+}
+
+// writes the extension bytes of a literal or match length
+static inline uint8_t* putLength(uint8_t* op, size_t length) {
+    for (; length >= 255; length -= 255)
+        *op++ = 255;
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+size_t MtpLz4::compress(const uint8_t* src, size_t length,
+                        uint8_t* dst, size_t capacity) {
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* const end = src + length;
+    uint8_t* op = dst;
+    uint8_t* const opEnd = dst + capacity;
+
+    if (length > MATCH_LIMIT) {
+        // offsets from src of the last position seen with each hash
+        uint32_t table[1 << HASH_BITS];
+        memset(table, 0, sizeof(table));
+
+        const uint8_t* const searchLimit = end - MATCH_LIMIT;
+        const uint8_t* const matchLimit = end - LAST_LITERALS;
+        ip++;
+
+        for (;;) {
+            const uint8_t* match;
+            unsigned attempts = 1 << SKIP_TRIGGER;
+            for (;;) {
+                if (ip > searchLimit)
+                    goto last;
+                uint32_t h = hash(read32(ip));
+                match = src + table[h];
+                table[h] = ip - src;
+                if (match < ip && ip - match <= MAX_OFFSET && read32(match) == read32(ip))
+                    break;
+                ip += attempts++ >> SKIP_TRIGGER;
+            }
+            while (ip > anchor && match > src && ip[-1] == match[-1]) {
+                ip--;
+                match--;
+            }
+
+            size_t literals = ip - anchor;
+            // token, literal length, literals and offset
+            if ((size_t)(opEnd - op) < 1 + literals / 255 + 1 + literals + 2)
+                return 0;
+            uint8_t* token = op++;
+            if (literals >= RUN_MASK) {
+                *token = RUN_MASK << 4;
+                op = putLength(op, literals - RUN_MASK);
+            } else {
+                *token = literals << 4;
+            }
+            memcpy(op, anchor, literals);
+            op += literals;
+
+            size_t offset = ip - match;
+            *op++ = offset & 0xFF;
+            *op++ = offset >> 8;
+
+            ip += MIN_MATCH;
+            match += MIN_MATCH;
+            const uint8_t* start = ip;
+            while (ip < matchLimit && *ip == *match) {
+                ip++;
+                match++;
+            }
+            size_t matched = ip - start;
+            if (matched >= RUN_MASK) {
+                if ((size_t)(opEnd - op) < matched / 255 + 1)
+                    return 0;
+                *token |= RUN_MASK;
+                op = putLength(op, matched - RUN_MASK);
+            } else {
+                *token |= matched;
+            }
+            anchor = ip;
+
+            if (ip > searchLimit)
+                break;
+            table[hash(read32(ip - 2))] = ip - 2 - src;
+        }
+    }
+
+last:
+    size_t literals = end - anchor;
+    if ((size_t)(opEnd - op) < 1 + literals / 255 + 1 + literals)
+        return 0;
+    if (literals >= RUN_MASK) {
+        *op++ = RUN_MASK << 4;
+        op = putLength(op, literals - RUN_MASK);
+    } else {
+        *op++ = literals << 4;
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+    return op - dst;
+}
+
+ssize_t MtpLz4::decompress(const uint8_t* src, size_t length,
+                           uint8_t* dst, size_t capacity) {
+    const uint8_t* ip = src;
+    const uint8_t* const end = src + length;
+    uint8_t* op = dst;
+    uint8_t* const opEnd = dst + capacity;
+
+    for (;;) {
+        if (ip >= end)
+            return -1;
+        unsigned token = *ip++;
+
+        size_t literals = token >> 4;
+        if (literals == RUN_MASK) {
+            uint8_t next;
+            do {
+                if (ip >= end)
+                    return -1;
+                next = *ip++;
+                literals += next;
+            } while (next == 255);
+        }
+        if ((size_t)(end - ip) < literals || (size_t)(opEnd - op) < literals)
+            return -1;
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+
+        // the last sequence has no match
+        if (ip == end)
+            break;
+
+        if (end - ip < 2)
+            return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst))
+            return -1;
+
+        size_t matched = token & RUN_MASK;
+        if (matched == RUN_MASK) {
+            uint8_t next;
+            do {
+                if (ip >= end)
+                    return -1;
+                next = *ip++;
+                matched += next;
+            } while (next == 255);
+        }
+        matched += MIN_MATCH;
+        if ((size_t)(opEnd - op) < matched)
+            return -1;
+
+        const uint8_t* match = op - offset;
+        if (offset >= matched) {
+            memcpy(op, match, matched);
+            op += matched;
+        } else {
+            // overlapping copy repeats the last offset bytes
+            for (size_t i = 0; i < matched; i++)
+                *op++ = *match++;
+        }
+    }
+    return op - dst;
+}
+
+}  // namespace android
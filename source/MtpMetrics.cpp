@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "MtpMetrics"
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+
+#include "MtpDebug.h"
+#include "MtpMetrics.h"
+#include "MtpTrace.h"
+
+#include "log.h"
+
+namespace android {
+
+// bytes moved during one second. A bucket is claimed for a new second by
+// whoever gets there first, bytes added meanwhile by others may be lost.
+struct RateBucket {
+    std::atomic<uint64_t>       mSecond;
+    std::atomic<uint64_t>       mBytesIn;
+    std::atomic<uint64_t>       mBytesOut;
+};
+
+// mCode is 0 until a slot is taken, no operation has that code
+struct OperationStats {
+    std::atomic<uint16_t>       mCode;
+    std::atomic<uint64_t>       mCount;
+    std::atomic<uint64_t>       mTotalMicros;
+    std::atomic<uint64_t>       mMaxMicros;
+    // bucket i counts latencies below 2^i microseconds that are not in i - 1
+    std::atomic<uint64_t>       mLatency[MtpMetrics::kLatencyBuckets];
+};
+
+static const std::memory_order  relaxed = std::memory_order_relaxed;
+
+static const uint64_t           sStart = MtpTrace::now();
+static std::atomic<uint64_t>    sBytesIn(0);
+static std::atomic<uint64_t>    sBytesOut(0);
+static RateBucket               sRates[MtpMetrics::kRateSeconds];
+static OperationStats           sOperations[MtpMetrics::kMaxOperations];
+static std::atomic<uint64_t>    sEventsQueued(0);
+static std::atomic<uint64_t>    sEventsSent(0);
+static std::atomic<uint64_t>    sEventsDropped(0);
+
+static RateBucket& getRateBucket() {
+    uint64_t second = MtpTrace::now() / 1000000;
+    RateBucket& bucket = sRates[second % MtpMetrics::kRateSeconds];
+    uint64_t seen = bucket.mSecond.load(relaxed);
+    if (seen != second && bucket.mSecond.compare_exchange_strong(seen, second, relaxed)) {
+        bucket.mBytesIn.store(0, relaxed);
+        bucket.mBytesOut.store(0, relaxed);
+    }
+    return bucket;
+}
+
+// megabytes per second over the last complete seconds
+static double getRate(uint64_t seconds, bool in) {
+    uint64_t now = MtpTrace::now() / 1000000;
+    uint64_t bytes = 0;
+    for (uint64_t second = now - seconds; second < now; second++) {
+        const RateBucket& bucket = sRates[second % MtpMetrics::kRateSeconds];
+        if (bucket.mSecond.load(relaxed) == second)
+            bytes += (in ? bucket.mBytesIn : bucket.mBytesOut).load(relaxed);
+    }
+    return bytes / 1e6 / seconds;
+}
+
+// upper bound of the bucket the fraction of latencies falls in, or the
+// longest one seen if that is less
+static uint64_t getPercentile(const OperationStats& stats, uint64_t count, double fraction) {
+    uint64_t target = count * fraction;
+    uint64_t seen = 0;
+    uint64_t max = stats.mMaxMicros.load(relaxed);
+    for (size_t i = 0; i < MtpMetrics::kLatencyBuckets; i++) {
+        seen += stats.mLatency[i].load(relaxed);
+        if (seen > target)
+            return std::min((uint64_t)1 << i, max);
+    }
+    return max;
+}
+
+void MtpMetrics::addBytesIn(size_t bytes) {
+    sBytesIn.fetch_add(bytes, relaxed);
+    getRateBucket().mBytesIn.fetch_add(bytes, relaxed);
+}
+
+void MtpMetrics::addBytesOut(size_t bytes) {
+    sBytesOut.fetch_add(bytes, relaxed);
+    getRateBucket().mBytesOut.fetch_add(bytes, relaxed);
+}
+
+void MtpMetrics::recordOperation(uint16_t operation, uint64_t micros) {
+    if (operation == 0)
+        return;
+
+    OperationStats* stats = NULL;
+    for (size_t i = 0; i < kMaxOperations && !stats; i++) {
+        OperationStats& slot = sOperations[(operation + i) % kMaxOperations];
+        uint16_t code = slot.mCode.load(relaxed);
+        if (code == 0 && slot.mCode.compare_exchange_strong(code, operation, relaxed))
+            code = operation;
+        if (code == operation)
+            stats = &slot;
+    }
+    if (!stats)
+        return;
+
+    size_t bucket = 0;
+    while (bucket < kLatencyBuckets - 1 && micros >> bucket)
+        bucket++;
+    stats->mLatency[bucket].fetch_add(1, relaxed);
+    stats->mTotalMicros.fetch_add(micros, relaxed);
+    uint64_t max = stats->mMaxMicros.load(relaxed);
+    while (micros > max && !stats->mMaxMicros.compare_exchange_weak(max, micros, relaxed))
+        ;
+    stats->mCount.fetch_add(1, relaxed);
+}
+
+void MtpMetrics::addEventsQueued(size_t count) {
+    sEventsQueued.fetch_add(count, relaxed);
+}
+
+void MtpMetrics::addEventsSent(size_t count) {
+    sEventsSent.fetch_add(count, relaxed);
+}
+
+void MtpMetrics::addEventsDropped(size_t count) {
+    sEventsDropped.fetch_add(count, relaxed);
+}
+
+void MtpMetrics::appendJson(std::string& out) {
+    append(out, "\"uptime_s\":%" PRIu64 ",", (MtpTrace::now() - sStart) / 1000000);
+    append(out, "\"bytes_in\":%" PRIu64 ",\"bytes_out\":%" PRIu64 ",",
+           sBytesIn.load(relaxed), sBytesOut.load(relaxed));
+    append(out, "\"mb_per_s_in\":{\"1s\":%.2f,\"10s\":%.2f,\"60s\":%.2f},",
+           getRate(1, true), getRate(10, true), getRate(60, true));
+    append(out, "\"mb_per_s_out\":{\"1s\":%.2f,\"10s\":%.2f,\"60s\":%.2f},",
+           getRate(1, false), getRate(10, false), getRate(60, false));
+    append(out, "\"events\":{\"queued\":%" PRIu64 ",\"sent\":%" PRIu64 ",\"dropped\":%" PRIu64 "},",
+           sEventsQueued.load(relaxed), sEventsSent.load(relaxed), sEventsDropped.load(relaxed));
+
+    out += "\"operations\":{";
+    bool first = true;
+    for (size_t i = 0; i < kMaxOperations; i++) {
+        const OperationStats& stats = sOperations[i];
+        uint16_t code = stats.mCode.load(relaxed);
+        uint64_t count = stats.mCount.load(relaxed);
+        if (code == 0 || count == 0)
+            continue;
+        // vendor codes of other extensions are not in the table
+        const char* name = MtpDebug::getOperationCodeName(code);
+        if (strcmp(name, "UNKNOWN") != 0)
+            append(out, "%s\"%s\":", first ? "" : ",", name);
+        else
+            append(out, "%s\"0x%04X\":", first ? "" : ",", code);
+        append(out, "{\"count\":%" PRIu64 ",\"mean_us\":%" PRIu64 ",\"p50_us\":%" PRIu64
+               ",\"p90_us\":%" PRIu64 ",\"p99_us\":%" PRIu64 ",\"max_us\":%" PRIu64 "}",
+               count, stats.mTotalMicros.load(relaxed) / count,
+               getPercentile(stats, count, 0.5), getPercentile(stats, count, 0.9),
+               getPercentile(stats, count, 0.99), stats.mMaxMicros.load(relaxed));
+        first = false;
+    }
+    out += "}";
+}
+
+void MtpMetrics::append(std::string& out, const char* format, ...) {
+    char buffer[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    if (length > 0)
+        out.append(buffer, std::min((size_t)length, sizeof(buffer) - 1));
+}
+
+}  // namespace android
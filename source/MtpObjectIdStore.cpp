@@ -0,0 +1,260 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "MtpObjectIdStore"
+
+#include <cstdio>
+#include <cstring>
+#include <climits>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <switch.h>
+
+#include "MtpObjectIdStore.h"
+#include "MtpUtils.h"
+
+#include "log.h"
+
+#define ID_STORE_FILE_NAME      "objects.idx"
+#define ID_STORE_MAGIC          "mtp-server-nx object ids 1"
+
+namespace android {
+
+MtpObjectIdStore::MtpObjectIdStore(const MtpString& root)
+    :   mRoot(root),
+        mNextHandle(1),
+        mDirty(false)
+{
+    if (mRoot.empty() || mRoot[mRoot.size() - 1] != '/')
+        mRoot += "/";
+    mFilePath = mRoot + MTP_STATE_DIRECTORY "/" ID_STORE_FILE_NAME;
+}
+
+MtpObjectIdStore::~MtpObjectIdStore() {
+}
+
+bool MtpObjectIdStore::load() {
+    FILE* file = fopen(mFilePath.c_str(), "r");
+    if (!file) {
+        VLOG(1) << "no object id store at " << mFilePath;
+        return false;
+    }
+
+    char line[PATH_MAX + 64];
+    if (!fgets(line, sizeof(line), file) || strncmp(line, ID_STORE_MAGIC, strlen(ID_STORE_MAGIC)) != 0) {
+        LOG(WARNING) << "ignoring unknown object id store " << mFilePath;
+        fclose(file);
+        return false;
+    }
+
+    unsigned int next;
+    if (fgets(line, sizeof(line), file) && sscanf(line, "next %u", &next) == 1)
+        mNextHandle = next;
+
+    while (fgets(line, sizeof(line), file)) {
+        Record record;
+        int pathOffset = 0;
+        if (sscanf(line, "%u %08x%08x%08x%08x %n", &record.handle,
+                &record.uid[0], &record.uid[1], &record.uid[2], &record.uid[3],
+                &pathOffset) != 5 || pathOffset == 0)
+            continue;
+
+        char* path = line + pathOffset;
+        size_t length = strlen(path);
+        if (length > 0 && path[length - 1] == '\n')
+            path[--length] = 0;
+
+        mRecords[MtpString(path, length)] = record;
+        if (record.handle >= mNextHandle)
+            mNextHandle = record.handle + 1;
+    }
+    fclose(file);
+
+    mDirty = false;
+    VLOG(1) << "loaded " << mRecords.size() << " object ids from " << mFilePath;
+    return true;
+}
+
+bool MtpObjectIdStore::save() {
+    if (!mDirty)
+        return true;
+
+    MtpString dir = mRoot + MTP_STATE_DIRECTORY;
+    mkdir(dir.c_str(), 0777);
+
+    MtpString tmpPath = mFilePath + ".tmp";
+    FILE* file = fopen(tmpPath.c_str(), "w");
+    if (!file) {
+        LOG(ERROR) << "could not write object id store " << tmpPath;
+        return false;
+    }
+
+    fprintf(file, "%s\nnext %u\n", ID_STORE_MAGIC, mNextHandle);
+    for (std::map<MtpString, Record>::const_iterator it = mRecords.begin(); it != mRecords.end(); ++it) {
+        const Record& record = it->second;
+        fprintf(file, "%u %08x%08x%08x%08x %s\n", record.handle,
+                record.uid[0], record.uid[1], record.uid[2], record.uid[3],
+                it->first.c_str());
+    }
+
+    bool ok = (fflush(file) == 0);
+    ok = (fclose(file) == 0) && ok;
+    // rename() does not replace an existing file on the SD card
+    if (ok) {
+        unlink(mFilePath.c_str());
+        ok = (::rename(tmpPath.c_str(), mFilePath.c_str()) == 0);
+    }
+    if (!ok) {
+        LOG(ERROR) << "could not save object id store " << mFilePath;
+        unlink(tmpPath.c_str());
+        return false;
+    }
+
+    mDirty = false;
+    VLOG(1) << "saved " << mRecords.size() << " object ids to " << mFilePath;
+    return true;
+}
+
+const MtpObjectIdStore::Record* MtpObjectIdStore::find(const MtpString& path) const {
+    MtpString relative;
+    if (!getRelativePath(path, relative))
+        return NULL;
+
+    std::map<MtpString, Record>::const_iterator it = mRecords.find(relative);
+    if (it == mRecords.end())
+        return NULL;
+    return &it->second;
+}
+
+const MtpObjectIdStore::Record* MtpObjectIdStore::assign(const MtpString& path, MtpObjectHandle handle) {
+    MtpString relative;
+    if (!getRelativePath(path, relative))
+        return NULL;
+
+    Record& record = mRecords[relative];
+    if (record.handle == 0) {
+        // version 4 style random identifier
+        randomGet(record.uid, sizeof(record.uid));
+        record.uid[1] = (record.uid[1] & 0xFFFF0FFF) | 0x00004000;
+        record.uid[2] = (record.uid[2] & 0x3FFFFFFF) | 0x80000000;
+        mDirty = true;
+    }
+    if (record.handle != handle) {
+        record.handle = handle;
+        mDirty = true;
+    }
+    if (handle >= mNextHandle)
+        mNextHandle = handle + 1;
+    return &record;
+}
+
+void MtpObjectIdStore::rename(const MtpString& oldPath, const MtpString& newPath) {
+    MtpString oldRelative, newRelative;
+    if (!getRelativePath(oldPath, oldRelative) || !getRelativePath(newPath, newRelative))
+        return;
+    if (oldRelative == newRelative)
+        return;
+
+    std::map<MtpString, Record> moved;
+    std::map<MtpString, Record>::iterator it = mRecords.find(oldRelative);
+    if (it != mRecords.end()) {
+        moved[newRelative] = it->second;
+        mRecords.erase(it);
+    }
+
+    MtpString prefix = oldRelative + "/";
+    it = mRecords.lower_bound(prefix);
+    while (it != mRecords.end() && it->first.compare(0, prefix.size(), prefix) == 0) {
+        moved[newRelative + "/" + it->first.substr(prefix.size())] = it->second;
+        it = mRecords.erase(it);
+    }
+
+    for (it = moved.begin(); it != moved.end(); ++it)
+        mRecords[it->first] = it->second;
+    mDirty = true;
+}
+
+void MtpObjectIdStore::remove(const MtpString& path) {
+    MtpString relative;
+    if (!getRelativePath(path, relative))
+        return;
+
+    mDirty |= (mRecords.erase(relative) > 0);
+
+    MtpString prefix = relative + "/";
+    std::map<MtpString, Record>::iterator it = mRecords.lower_bound(prefix);
+    while (it != mRecords.end() && it->first.compare(0, prefix.size(), prefix) == 0) {
+        it = mRecords.erase(it);
+        mDirty = true;
+    }
+}
+
+void MtpObjectIdStore::prune(const MtpString& directory, const std::set<MtpString>& names) {
+    MtpString relative;
+    if (!getRelativePath(directory, relative))
+        return;
+
+    MtpString prefix = relative.empty() ? relative : relative + "/";
+    std::map<MtpString, Record>::iterator it = mRecords.lower_bound(prefix);
+    while (it != mRecords.end() && it->first.compare(0, prefix.size(), prefix) == 0) {
+        size_t slash = it->first.find('/', prefix.size());
+        MtpString name = it->first.substr(prefix.size(), slash - prefix.size());
+        if (name.empty()) {
+            // the directory itself
+            ++it;
+        } else if (names.count(name) == 0) {
+            it = mRecords.erase(it);
+            mDirty = true;
+        } else if (slash != MtpString::npos) {
+            // what is below a child is for the listing of that child, and
+            // sorts before anything starting with name + '0'
+            it = mRecords.lower_bound(prefix + name + "0");
+        } else {
+            ++it;
+        }
+    }
+}
+
+void MtpObjectIdStore::setNextHandle(MtpObjectHandle handle) {
+    if (handle != mNextHandle) {
+        mNextHandle = handle;
+        mDirty = true;
+    }
+}
+
+void MtpObjectIdStore::getHandles(std::vector<MtpObjectHandle>& outHandles) const {
+    for (std::map<MtpString, Record>::const_iterator it = mRecords.begin(); it != mRecords.end(); ++it)
+        outHandles.push_back(it->second.handle);
+}
+
+bool MtpObjectIdStore::getRelativePath(const MtpString& path, MtpString& outPath) const {
+    // the root itself is recorded as the empty path
+    if (path.size() + 1 == mRoot.size() && mRoot.compare(0, path.size(), path) == 0) {
+        outPath.clear();
+        return true;
+    }
+    if (path.compare(0, mRoot.size(), mRoot) != 0)
+        return false;
+
+    outPath = path.substr(mRoot.size());
+    while (!outPath.empty() && outPath[outPath.size() - 1] == '/')
+        outPath.erase(outPath.size() - 1);
+    return true;
+}
+
+}  // namespace android
@@ -64,6 +64,9 @@ void MtpPacket::allocate(int length) {
 
 void MtpPacket::dump() {
 #define DUMP_BYTES_PER_ROW  16
+    if (!VLOG_IS_ON(3))
+        return;
+
     char buffer[500];
     char* bufptr = buffer;
 
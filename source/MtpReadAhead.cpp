@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "MtpReadAhead"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+#include <malloc.h>
+
+#include "MtpReadAhead.h"
+#include "MtpSplitFile.h"
+
+#include "log.h"
+
+namespace android {
+
+MtpReadAhead::MtpReadAhead()
+    :   mFile(NULL),
+        mNext(0),
+        mSequential(0),
+        mCancelled(false),
+        mRunning(true),
+        mHits(0),
+        mMisses(0)
+{
+    for (int i = 0; i < 2; i++) {
+        mWindows[i].mState = Window::EMPTY;
+        mWindows[i].mData = NULL;
+        mWindows[i].mOffset = 0;
+        mWindows[i].mLength = 0;
+        mWindows[i].mFilled = 0;
+    }
+    mThread = std::thread(&MtpReadAhead::run, this);
+}
+
+MtpReadAhead::~MtpReadAhead() {
+    {
+        MtpAutolock autoLock(mMutex);
+        mRunning = false;
+        mCancelled = true;
+    }
+    mQueued.notify_all();
+    mThread.join();
+    for (int i = 0; i < 2; i++)
+        free(mWindows[i].mData);
+}
+
+void MtpReadAhead::access(MtpSplitFile* file, uint64_t offset, uint64_t length) {
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (file != mFile || offset != mNext) {
+        discard(lock);
+        mFile = file;
+        mSequential = 0;
+    } else {
+        mSequential++;
+    }
+    mNext = offset + length;
+    if (mSequential == 0 || length == 0)
+        return;
+
+    // how far ahead of this request the windows already reach
+    uint64_t start = mNext;
+    for (int i = 0; i < 2; i++) {
+        const Window& window = mWindows[i];
+        if (window.mState != Window::EMPTY && window.mOffset <= start
+                && start < window.mOffset + window.mLength) {
+            // the file ends in there
+            if (window.mState == Window::READY && window.mFilled < window.mLength)
+                return;
+            start = window.mOffset + window.mLength;
+            i = -1;
+        }
+    }
+    size_t size = (length + kReadSize - 1) / kReadSize * kReadSize;
+    size = std::min(std::max(size, kMinWindow), kMaxWindow);
+    if (start - mNext >= size)
+        return;
+
+    // a window that holds nothing of this request or what follows it
+    Window* spare = NULL;
+    for (int i = 0; i < 2 && !spare; i++) {
+        Window& window = mWindows[i];
+        if (window.mState == Window::EMPTY
+                || (window.mState == Window::READY
+                    && (window.mOffset + window.mFilled <= offset || window.mOffset >= start)))
+            spare = &window;
+    }
+    if (!spare)
+        return;
+    if (!spare->mData) {
+        spare->mData = (uint8_t*)memalign(0x1000, kMaxWindow);
+        if (!spare->mData)
+            return;
+    }
+
+    VLOG(2) << "reading ahead " << size << " bytes at " << start;
+    spare->mState = Window::QUEUED;
+    spare->mOffset = start;
+    spare->mLength = size;
+    spare->mFilled = 0;
+    lock.unlock();
+    mQueued.notify_one();
+}
+
+ssize_t MtpReadAhead::pread(MtpSplitFile* file, void* buffer, size_t length, uint64_t offset) {
+    size_t copied = 0;
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        for (int i = 0; i < 2 && file == mFile && copied < length; i++) {
+            Window& window = mWindows[i];
+            uint64_t at = offset + copied;
+            if (window.mState == Window::EMPTY || at < window.mOffset
+                    || at >= window.mOffset + window.mLength)
+                continue;
+            mDone.wait(lock, [&window] { return window.mState == Window::READY; });
+            if (at >= window.mOffset + window.mFilled)
+                break;
+            size_t count = std::min<uint64_t>(length - copied, window.mOffset + window.mFilled - at);
+            memcpy((uint8_t*)buffer + copied, window.mData + (at - window.mOffset), count);
+            copied += count;
+            // the rest may be in the other window
+            i = -1;
+        }
+    }
+    mHits += copied;
+    if (copied == length)
+        return copied;
+
+    ssize_t ret;
+    {
+        MtpAutolock fileLock(mFileMutex);
+        ret = file->pread((uint8_t*)buffer + copied, length - copied, offset + copied);
+    }
+    if (ret < 0)
+        return copied > 0 ? (ssize_t)copied : -1;
+    mMisses += ret;
+    return copied + ret;
+}
+
+void MtpReadAhead::release(MtpSplitFile* file) {
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (file != mFile)
+        return;
+    discard(lock);
+    mFile = NULL;
+}
+
+void MtpReadAhead::discard(std::unique_lock<std::mutex>& lock) {
+    for (int i = 0; i < 2; i++) {
+        Window& window = mWindows[i];
+        if (window.mState == Window::BUSY) {
+            mCancelled = true;
+            mDone.wait(lock, [&window] { return window.mState != Window::BUSY; });
+        }
+        window.mState = Window::EMPTY;
+    }
+}
+
+void MtpReadAhead::run() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (mRunning) {
+        // nearest first, a request may be waiting for it
+        Window* window = NULL;
+        for (int i = 0; i < 2; i++) {
+            if (mWindows[i].mState == Window::QUEUED
+                    && (!window || mWindows[i].mOffset < window->mOffset))
+                window = &mWindows[i];
+        }
+        if (!window) {
+            mQueued.wait(lock);
+            continue;
+        }
+
+        window->mState = Window::BUSY;
+        MtpSplitFile* file = mFile;
+        while (window->mFilled < window->mLength && !mCancelled) {
+            uint8_t* data = window->mData + window->mFilled;
+            uint64_t offset = window->mOffset + window->mFilled;
+            // the first read ends on a multiple of kReadSize, so that the
+            // rest start on one
+            size_t count = std::min<uint64_t>(kReadSize - offset % kReadSize,
+                                              window->mLength - window->mFilled);
+            lock.unlock();
+            ssize_t ret;
+            {
+                MtpAutolock fileLock(mFileMutex);
+                ret = file->pread(data, count, offset);
+            }
+            lock.lock();
+            if (ret <= 0)
+                break;
+            window->mFilled += ret;
+            if ((size_t)ret < count)
+                break;
+        }
+        window->mState = mCancelled ? Window::EMPTY : Window::READY;
+        mCancelled = false;
+        mDone.notify_all();
+    }
+}
+
+}  // namespace android
@@ -22,6 +22,7 @@
 #include <unistd.h>
 
 #include "MtpResponsePacket.h"
+#include "MtpTrace.h"
 
 namespace android {
 
@@ -34,6 +35,7 @@ MtpResponsePacket::~MtpResponsePacket() {
 }
 
 int MtpResponsePacket::write(USBMtpInterface* usb) {
+    MtpTrace::Span span("phase", "response");
     putUInt32(MTP_CONTAINER_LENGTH_OFFSET, mPacketSize);
     putUInt16(MTP_CONTAINER_TYPE_OFFSET, MTP_CONTAINER_TYPE_RESPONSE);
     int ret = usb->write((const char*)mBuffer, mPacketSize);
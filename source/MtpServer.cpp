@@ -19,6 +19,8 @@
 #include <cstdlib>
 #include <cstring>
 
+#include <algorithm>
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -29,18 +31,51 @@
 
 #define LOG_TAG "MtpServer"
 
+#include "MtpCompressor.h"
 #include "MtpDebug.h"
 #include "MtpDatabase.h"
+#include "MtpDigest.h"
+#include "MtpFileCache.h"
+#include "MtpFileCloser.h"
+#include "MtpIoScheduler.h"
+#include "MtpMetrics.h"
 #include "MtpObjectInfo.h"
 #include "MtpProperty.h"
+#include "MtpReadAhead.h"
 #include "MtpServer.h"
+#include "MtpSplitFile.h"
 #include "MtpStorage.h"
 #include "MtpStringBuffer.h"
+#include "MtpTrace.h"
+#include "MtpTrash.h"
 
 #include "log.h"
 
 namespace android {
 
+// limits of MTP_OPERATION_NX_GET_BLOCK_DIGESTS
+static const uint32_t kMinDigestBlockSize = 512;
+static const uint64_t kMaxDigestBlocks = 65536;
+
+// workers of MTP_OPERATION_NX_SET_COMPRESSION, the request thread needs a
+// core of its own
+static const int kCompressionThreads = 2;
+// USB transfers of compressed data phases, a multiple of wMaxPacketSize
+// at any speed
+static const size_t kStreamBufferSize = 64 * 1024;
+// file reads of send_file(), which start on a multiple of it after the
+// first. Clusters are powers of two, so no read spans two of them.
+static const size_t kFileReadSize = 16384;
+// seconds before the tracked free space is checked against the file system,
+// when there is nothing else to do
+static const std::time_t kFreeSpaceInterval = 30;
+// objects up to this size are received by receiveSmallObject(), it is what
+// receive_file() moves per transfer less the container header
+static const size_t kSmallObjectSize = 16384 - MTP_CONTAINER_HEADER_SIZE;
+// edits holding MtpWriteBuffer::kCapacity each at most, the least recently
+// written to is flushed to make room for another
+static const size_t kMaxWriteBuffers = 4;
+
 static const MtpOperationCode kSupportedOperationCodes[] = {
     MTP_OPERATION_GET_DEVICE_INFO,
     MTP_OPERATION_OPEN_SESSION,
@@ -87,6 +122,12 @@ static const MtpOperationCode kSupportedOperationCodes[] = {
     MTP_OPERATION_TRUNCATE_OBJECT,
     MTP_OPERATION_BEGIN_EDIT_OBJECT,
     MTP_OPERATION_END_EDIT_OBJECT,
+    // mtp-server-nx extensions
+    MTP_OPERATION_NX_GET_CHANGES,
+    MTP_OPERATION_NX_GET_OBJECT_DIGEST,
+    MTP_OPERATION_NX_GET_BLOCK_DIGESTS,
+    MTP_OPERATION_NX_SET_COMPRESSION,
+    MTP_OPERATION_NX_DUMP_TRACE,
 };
 
 static const MtpEventCode kSupportedEventCodes[] = {
@@ -102,15 +143,27 @@ MtpServer::MtpServer(USBMtpInterface* usb, MtpDatabase* database, bool ptp,
                     int fileGroup, int filePerm, int directoryPerm)
     :   mUSB(usb),
         mDatabase(database),
+        mRunning(true),
         mPtp(ptp),
         mFileGroup(fileGroup),
         mFilePermission(filePerm),
         mDirectoryPermission(directoryPerm),
         mSessionID(0),
         mSessionOpen(false),
+        mLastRevalidate(0),
+        mStorages(std::make_shared<const MtpStorageList>()),
         mSendObjectHandle(kInvalidObjectHandle),
         mSendObjectFormat(0),
-        mSendObjectFileSize(0)
+        mSendObjectFileSize(0),
+        mSendObjectFD(-1),
+        mSendObjectAllocated(0),
+        mUploadDigests(true),
+        mCompression(MTP_NX_COMPRESSION_NONE),
+        mScheduler(new MtpIoScheduler()),
+        mTrash(new MtpTrash(mScheduler.get())),
+        mCloser(new MtpFileCloser()),
+        mFileCache(new MtpFileCache()),
+        mWriteSequence(0)
 {
 }
 
@@ -118,18 +171,24 @@ MtpServer::~MtpServer() {
 }
 
 void MtpServer::addStorage(MtpStorage* storage) {
-    MtpAutolock autoLock(mMutex);
+    MtpAutolock autoLock(mStorageMutex);
 
-    mStorages.push_back(storage);
+    std::shared_ptr<MtpStorageList> storages = std::make_shared<MtpStorageList>(*getStorages());
+    storages->push_back(storage);
+    std::atomic_store(&mStorages, std::shared_ptr<const MtpStorageList>(storages));
+    mTrash->addRoot(storage->getPath());
     sendStoreAdded(storage->getStorageID());
 }
 
 void MtpServer::removeStorage(MtpStorage* storage) {
-    MtpAutolock autoLock(mMutex);
-
-    for (int i = 0; i < mStorages.size(); i++) {
-        if (mStorages[i] == storage) {
-            mStorages.erase(mStorages.begin()+i);
+    MtpAutolock autoLock(mStorageMutex);
+
+    std::shared_ptr<MtpStorageList> storages = std::make_shared<MtpStorageList>(*getStorages());
+    for (size_t i = 0; i < storages->size(); i++) {
+        if ((*storages)[i] == storage) {
+            storages->erase(storages->begin()+i);
+            std::atomic_store(&mStorages, std::shared_ptr<const MtpStorageList>(storages));
+            mTrash->removeRoot(storage->getPath());
             sendStoreRemoved(storage->getStorageID());
             break;
         }
@@ -137,19 +196,35 @@ void MtpServer::removeStorage(MtpStorage* storage) {
 }
 
 MtpStorage* MtpServer::getStorage(MtpStorageID id) {
+    std::shared_ptr<const MtpStorageList> storages = getStorages();
     if (id == 0)
-        return mStorages[0];
-    for (int i = 0; i < mStorages.size(); i++) {
-        MtpStorage* storage = mStorages[i];
+        return storages->empty() ? NULL : (*storages)[0];
+    for (size_t i = 0; i < storages->size(); i++) {
+        MtpStorage* storage = (*storages)[i];
         if (storage->getStorageID() == id)
             return storage;
     }
     return NULL;
 }
 
+MtpStorage* MtpServer::getStorageForPath(const MtpString& path) {
+    std::shared_ptr<const MtpStorageList> storages = getStorages();
+    MtpStorage* result = NULL;
+    size_t length = 0;
+    for (size_t i = 0; i < storages->size(); i++) {
+        MtpStorage* storage = (*storages)[i];
+        size_t rootLength = strlen(storage->getPath());
+        if (rootLength > length && path.compare(0, rootLength, storage->getPath()) == 0) {
+            result = storage;
+            length = rootLength;
+        }
+    }
+    return result;
+}
+
 bool MtpServer::hasStorage(MtpStorageID id) {
     if (id == 0 || id == 0xFFFFFFFF)
-        return mStorages.size() > 0;
+        return hasStorage();
     return (getStorage(id) != NULL);
 }
 
@@ -161,19 +236,53 @@ void MtpServer::run() {
     USBMtpInterface* usb = mUSB;
 
     VLOG(1) << "MtpServer::run";
+    usb->startControl();
 
-    mRunning = true;
     while (mRunning) {
         
         consoleUpdate(NULL);
+        if (usb->takeReset())
+            resetSession();
+        // right after the response of the last request, or the idle work
+        // that raised them; an event ahead of the response would name an
+        // object the host has not been told about yet
+        flushEvents();
                 
         int ret = mRequest.read(usb);
         if (ret < 0) {
             VLOG(2) << "request read returned " << ret;
+            // nothing to do until the host speaks up; the database
+            // serializes this against its other writers by itself. Only a
+            // host can see the objects it fixes up, and it does not need
+            // them every second.
+            std::time_t now = std::time(NULL);
+            if (mSessionOpen && now - mLastRevalidate >= kFreeSpaceInterval) {
+                mDatabase->revalidate();
+                mLastRevalidate = now;
+            }
+            // nor will it read on, and other homebrew may want the files
+            mFileCache->clear();
+            flushEdits();
+            std::shared_ptr<const MtpStorageList> storages = getStorages();
+            for (size_t i = 0; i < storages->size(); i++) {
+                MtpStorage* storage = (*storages)[i];
+                // the trash is purged when we are idle too
+                if (mTrash->takePurged(storage->getPath()))
+                    storage->invalidateFreeSpace();
+                storage->reconcileFreeSpace(kFreeSpaceInterval);
+            }
+            continue;
+        }
+        // the zero length packet ending a data phase of a known length that
+        // filled its last packet, nothing was waiting for it
+        if (ret < MTP_CONTAINER_HEADER_SIZE) {
+            VLOG(2) << "ignoring " << ret << " bytes between requests";
             continue;
         }
         MtpOperationCode operation = mRequest.getOperationCode();
         MtpTransactionID transaction = mRequest.getTransactionID();
+        // until the response is out
+        MtpIoScheduler::Foreground foreground(*mScheduler);
 
         VLOG(2) << "operation: " << MtpDebug::getOperationCodeName(operation);
         mRequest.dump();
@@ -222,6 +331,10 @@ void MtpServer::run() {
         }
     }
 
+    usb->stopControl();
+    mCloser->drain();
+    mFileCache->clear();
+
     // commit any open edits
     int count = mObjectEditList.size();
     for (int i = 0; i < count; i++) {
@@ -236,18 +349,147 @@ void MtpServer::run() {
     mUSB = NULL;
 }
 
+// Device Reset from the host: the session ends with whatever it left open
+void MtpServer::resetSession() {
+    MtpAutolock autoLock(mMutex);
+
+    VLOG(1) << "MtpServer::resetSession";
+    mCloser->drain();
+    int count = mObjectEditList.size();
+    for (int i = 0; i < count; i++) {
+        ObjectEdit* edit = mObjectEditList[i];
+        commitEdit(edit);
+        delete edit;
+    }
+    mObjectEditList.clear();
+
+    if (mSendObjectHandle != kInvalidObjectHandle)
+        cancelSendObject();
+
+    if (mSessionOpen) {
+        mSessionID = 0;
+        mSessionOpen = false;
+        mCompression = MTP_NX_COMPRESSION_NONE;
+        mCompressor.reset();
+        closeCachedFiles();
+        logIoStats();
+        mDatabase->sessionEnded();
+    }
+}
+
+// lets go of the files kept open for reading
+void MtpServer::closeCachedFiles() {
+    uint64_t hits = mFileCache->getHits();
+    uint64_t lookups = hits + mFileCache->getMisses();
+    if (lookups > 0)
+        VLOG(1) << "file cache hit rate " << hits * 100 / lookups << "% of " << lookups;
+    MtpReadAhead& ahead = mFileCache->getReadAhead();
+    uint64_t bytes = ahead.getHits() + ahead.getMisses();
+    if (bytes > 0)
+        VLOG(1) << "read ahead " << ahead.getHits() * 100 / bytes << "% of " << bytes << " bytes";
+    mFileCache->clear();
+}
+
+void MtpServer::logIoStats() {
+    static const char* const names[] = { "foreground", "background" };
+    for (int i = 0; i < MtpIoScheduler::CLASS_COUNT; i++) {
+        MtpIoScheduler::Stats stats = mScheduler->getStats((MtpIoScheduler::Class)i);
+        if (stats.mOperations == 0)
+            continue;
+        VLOG(1) << names[i] << " I/O: " << stats.mOperations << " operations, queue depth "
+                << stats.mQueued << " (max " << stats.mMaxQueued << "), wait "
+                << stats.mWaitMicros / stats.mOperations << "us average, "
+                << stats.mMaxWaitMicros << "us max";
+    }
+}
+
+// one JSON object padded with spaces, which parsers skip, to the size the
+// database announced for it
+void MtpServer::writeStats(MtpString& out) {
+    out.clear();
+    out.reserve(MtpMetrics::kReportSize);
+    out += "{";
+    MtpMetrics::appendJson(out);
+
+    u64 bounced, bouncedBytes, direct;
+    usbGetBounceStats(&bounced, &bouncedBytes, &direct);
+    MtpMetrics::append(out, ",\"usb_bounce\":{\"hits\":%llu,\"bytes\":%llu,\"direct\":%llu}",
+                       (unsigned long long)bounced, (unsigned long long)bouncedBytes,
+                       (unsigned long long)direct);
+
+    size_t pending;
+    {
+        MtpAutolock autoLock(mEventMutex);
+        pending = mEvents.size();
+    }
+    MtpMetrics::append(out, ",\"events_pending\":%zu", pending);
+
+    uint64_t hits = mFileCache->getHits();
+    uint64_t lookups = hits + mFileCache->getMisses();
+    MtpMetrics::append(out, ",\"file_cache\":{\"hits\":%llu,\"lookups\":%llu,\"hit_rate\":%.3f}",
+                       (unsigned long long)hits, (unsigned long long)lookups,
+                       lookups > 0 ? (double)hits / lookups : 0.0);
+    MtpReadAhead& ahead = mFileCache->getReadAhead();
+    uint64_t bytes = ahead.getHits() + ahead.getMisses();
+    MtpMetrics::append(out, ",\"read_ahead\":{\"hit_bytes\":%llu,\"bytes\":%llu,\"hit_rate\":%.3f}",
+                       (unsigned long long)ahead.getHits(), (unsigned long long)bytes,
+                       bytes > 0 ? (double)ahead.getHits() / bytes : 0.0);
+
+    static const char* const names[] = { "foreground", "background" };
+    out += ",\"io\":{";
+    for (int i = 0; i < MtpIoScheduler::CLASS_COUNT; i++) {
+        MtpIoScheduler::Stats stats = mScheduler->getStats((MtpIoScheduler::Class)i);
+        MtpMetrics::append(out, "%s\"%s\":{\"operations\":%llu,\"queued\":%d,\"max_queued\":%d,"
+                           "\"mean_wait_us\":%llu,\"max_wait_us\":%llu}",
+                           i > 0 ? "," : "", names[i], (unsigned long long)stats.mOperations,
+                           stats.mQueued, stats.mMaxQueued,
+                           (unsigned long long)(stats.mOperations > 0
+                                   ? stats.mWaitMicros / stats.mOperations : 0),
+                           (unsigned long long)stats.mMaxWaitMicros);
+    }
+    out += "}";
+
+    size_t objects, memory;
+    mDatabase->getStatistics(objects, memory);
+    MtpMetrics::append(out, ",\"database\":{\"objects\":%zu,\"memory_bytes\":%zu}}\n",
+                       objects, memory);
+
+    if (out.size() > MtpMetrics::kReportSize) {
+        LOG(WARNING) << "stats of " << out.size() << " bytes cut to " << MtpMetrics::kReportSize;
+        out.resize(MtpMetrics::kReportSize);
+    }
+    out.resize(MtpMetrics::kReportSize, ' ');
+}
+
+// the database found changes made behind our back, which free space does
+// not account for
+void MtpServer::invalidateFreeSpace() {
+    std::shared_ptr<const MtpStorageList> storages = getStorages();
+    for (size_t i = 0; i < storages->size(); i++)
+        (*storages)[i]->invalidateFreeSpace();
+}
+
+void MtpServer::fileResized(const MtpString& path, uint64_t oldSize, uint64_t newSize) {
+    MtpStorage* storage = getStorageForPath(path);
+    if (storage)
+        storage->fileResized(oldSize, newSize);
+}
+
 void MtpServer::sendObjectAdded(MtpObjectHandle handle) {
     VLOG(1) << "sendObjectAdded " << handle;
+    invalidateFreeSpace();
     sendEvent(MTP_EVENT_OBJECT_ADDED, handle, 0, 0);
 }
 
 void MtpServer::sendObjectRemoved(MtpObjectHandle handle) {
     VLOG(1) << "sendObjectRemoved " << handle;
+    invalidateFreeSpace();
     sendEvent(MTP_EVENT_OBJECT_REMOVED, handle, 0, 0);
 }
 
 void MtpServer::sendObjectInfoChanged(MtpObjectHandle handle) {
     VLOG(1) << "sendObjectInfoChanged " << handle;
+    invalidateFreeSpace();
     sendEvent(MTP_EVENT_OBJECT_INFO_CHANGED, handle, 0, 0);
 }
 
@@ -272,19 +514,51 @@ void MtpServer::sendEvent(MtpEventCode code,
                           uint32_t param2,
                           uint32_t param3) {
     if (mSessionOpen) {
-        mEvent.setEventCode(code);
+        Event event;
+        event.mCode = code;
+        event.mParameters[0] = param1;
+        event.mParameters[1] = param2;
+        event.mParameters[2] = param3;
+
+        MtpAutolock autoLock(mEventMutex);
+        mEvents.push_back(event);
+        MtpMetrics::addEventsQueued(1);
+    } else {
+        MtpMetrics::addEventsDropped(1);
+    }
+}
+
+void MtpServer::flushEvents() {
+    std::deque<Event> events;
+    {
+        MtpAutolock autoLock(mEventMutex);
+        events.swap(mEvents);
+    }
+
+    // events of a session that is gone are of no use to anybody
+    if (!mSessionOpen) {
+        MtpMetrics::addEventsDropped(events.size());
+        return;
+    }
+
+    for (std::deque<Event>::const_iterator it = events.begin(); it != events.end(); ++it) {
+        mEvent.setEventCode(it->mCode);
         mEvent.setTransactionID(mRequest.getTransactionID());
-        mEvent.setParameter(1, param1);
-        mEvent.setParameter(2, param2);
-        mEvent.setParameter(3, param3);
+        mEvent.setParameter(1, it->mParameters[0]);
+        mEvent.setParameter(2, it->mParameters[1]);
+        mEvent.setParameter(3, it->mParameters[2]);
         int ret = mEvent.write(mUSB);
         VLOG(2) << "mEvent.write returned " << ret;
+        if (ret < 0)
+            MtpMetrics::addEventsDropped(1);
+        else
+            MtpMetrics::addEventsSent(1);
     }
 }
 
 void MtpServer::addEditObject(MtpObjectHandle handle, MtpString& path,
         uint64_t size, MtpObjectFormat format, int fd) {
-    ObjectEdit*  edit = new ObjectEdit(handle, path, size, format, fd);
+    ObjectEdit*  edit = new ObjectEdit(handle, path, size, format, fd, getClusterSize(path));
     mObjectEditList.push_back(edit);
 }
 
@@ -310,25 +584,123 @@ void MtpServer::removeEditObject(MtpObjectHandle handle) {
     LOG(ERROR) << "ObjectEdit not found in removeEditObject";
 }
 
-void MtpServer::commitEdit(ObjectEdit* edit) {
+// removes what SendObjectInfo left for a SendObject that did not come
+void MtpServer::cancelSendObject() {
+    closeSendObjectFile();
+    mDatabase->endSendObject(mSendObjectFilePath, mSendObjectHandle, mSendObjectFormat, false);
+    mSendObjectHandle = kInvalidObjectHandle;
+    mSendObjectFormat = 0;
+}
+
+// the file SendObjectInfo created before any data was written to it
+void MtpServer::closeSendObjectFile() {
+    if (mSendObjectFD >= 0) {
+        close(mSendObjectFD);
+        mSendObjectFD = -1;
+        unlink(mSendObjectFilePath.c_str());
+        fileResized(mSendObjectFilePath, mSendObjectAllocated, 0);
+    }
+    mSendObjectAllocated = 0;
+}
+
+// false if writes to edit were lost, the object is then left to the
+// database as it was
+bool MtpServer::commitEdit(ObjectEdit* edit) {
+    if (!edit->mBuffer.release())
+        edit->mFailed = true;
+    if (edit->mFailed) {
+        LOG(ERROR) << "lost buffered writes to " << edit->mPath;
+        return false;
+    }
     mDatabase->endSendObject(edit->mPath.c_str(), edit->mHandle, edit->mFormat, true);
+    return true;
+}
+
+// the buffer for SendPartialObject data to edit, making room for it
+// if too many edits have one
+MtpWriteBuffer& MtpServer::getWriteBuffer(ObjectEdit* edit) {
+    edit->mLastWrite = ++mWriteSequence;
+    if (edit->mBuffer.hasMemory())
+        return edit->mBuffer;
+
+    ObjectEdit* oldest = NULL;
+    size_t buffers = 0;
+    int count = mObjectEditList.size();
+    for (int i = 0; i < count; i++) {
+        ObjectEdit* other = mObjectEditList[i];
+        if (!other->mBuffer.hasMemory())
+            continue;
+        buffers++;
+        if (!oldest || other->mLastWrite < oldest->mLastWrite)
+            oldest = other;
+    }
+    if (buffers >= kMaxWriteBuffers && !oldest->mBuffer.release()) {
+        LOG(ERROR) << "lost buffered writes to " << oldest->mPath;
+        oldest->mFailed = true;
+    }
+    return edit->mBuffer;
 }
 
+uint64_t MtpServer::getClusterSize(const MtpString& path) {
+    MtpStorage* storage = getStorageForPath(path);
+    return storage ? storage->getClusterSize() : 0;
+}
+
+// writes out what the edits buffered, for when the host may not be back
+// for a while
+void MtpServer::flushEdits() {
+    int count = mObjectEditList.size();
+    for (int i = 0; i < count; i++) {
+        ObjectEdit* edit = mObjectEditList[i];
+        if (edit->mBuffer.hasMemory() && !edit->mBuffer.release()) {
+            LOG(ERROR) << "lost buffered writes to " << edit->mPath;
+            edit->mFailed = true;
+        }
+    }
+}
+
+
+// operations that open, move or remove files, which must not race the
+// closes left to mCloser by small uploads
+static bool needsClosedFiles(MtpOperationCode operation) {
+    switch (operation) {
+        case MTP_OPERATION_GET_OBJECT:
+        case MTP_OPERATION_GET_THUMB:
+        case MTP_OPERATION_GET_PARTIAL_OBJECT:
+        case MTP_OPERATION_GET_PARTIAL_OBJECT_64:
+        case MTP_OPERATION_SET_OBJECT_PROP_VALUE:
+        case MTP_OPERATION_DELETE_OBJECT:
+        case MTP_OPERATION_MOVE_OBJECT:
+        case MTP_OPERATION_TRUNCATE_OBJECT:
+        case MTP_OPERATION_BEGIN_EDIT_OBJECT:
+        case MTP_OPERATION_CLOSE_SESSION:
+        case MTP_OPERATION_NX_GET_OBJECT_DIGEST:
+        case MTP_OPERATION_NX_GET_BLOCK_DIGESTS:
+            return true;
+        default:
+            return false;
+    }
+}
 
 bool MtpServer::handleRequest() {
     MtpAutolock autoLock(mMutex);
 
     MtpOperationCode operation = mRequest.getOperationCode();
     MtpResponseCode response;
+    MtpTrace::Span span("request", MtpDebug::getOperationCodeName(operation),
+                        mRequest.getTransactionID());
+    uint64_t start = MtpTrace::now();
 
     mResponse.reset();
 
     if (mSendObjectHandle != kInvalidObjectHandle && operation != MTP_OPERATION_SEND_OBJECT) {
-        // FIXME - need to delete mSendObjectHandle from the database
         LOG(ERROR) << "expected SendObject after SendObjectInfo";
-        mSendObjectHandle = kInvalidObjectHandle;
+        cancelSendObject();
     }
 
+    if (needsClosedFiles(operation))
+        mCloser->drain();
+
     switch (operation) {
         case MTP_OPERATION_GET_DEVICE_INFO:
             response = doGetDeviceInfo();
@@ -421,12 +793,28 @@ bool MtpServer::handleRequest() {
         case MTP_OPERATION_END_EDIT_OBJECT:
             response = doEndEditObject();
             break;
+        case MTP_OPERATION_NX_GET_CHANGES:
+            response = doGetChanges();
+            break;
+        case MTP_OPERATION_NX_GET_OBJECT_DIGEST:
+            response = doGetObjectDigest();
+            break;
+        case MTP_OPERATION_NX_GET_BLOCK_DIGESTS:
+            response = doGetBlockDigests();
+            break;
+        case MTP_OPERATION_NX_SET_COMPRESSION:
+            response = doSetCompression();
+            break;
+        case MTP_OPERATION_NX_DUMP_TRACE:
+            response = doDumpTrace();
+            break;
         default:
             LOG(ERROR) << "got unsupported command " << MtpDebug::getOperationCodeName(operation);
             response = MTP_RESPONSE_OPERATION_NOT_SUPPORTED;
             break;
     }
 
+    MtpMetrics::recordOperation(operation, MtpTrace::now() - start);
     if (response == MTP_RESPONSE_TRANSACTION_CANCELLED)
         return false;
     mResponse.setResponseCode(response);
@@ -456,7 +844,7 @@ MtpResponseCode MtpServer::doGetDeviceInfo() {
         string.set("");
     } else {
         // MTP extensions
-        string.set("microsoft.com: 1.0; android.com: 1.0;");
+        string.set("microsoft.com: 1.0; android.com: 1.0; mtp-server-nx: 1.0;");
     }
     mData.putString(string); // MTP Extensions
     mData.putUInt16(0); //Functional Mode
@@ -496,6 +884,8 @@ MtpResponseCode MtpServer::doOpenSession() {
     }
     mSessionID = mRequest.getParameter(1);
     mSessionOpen = true;
+    mCompression = MTP_NX_COMPRESSION_NONE;
+    mCompressor.reset();
 
     mDatabase->sessionStarted(this);
 
@@ -507,6 +897,11 @@ MtpResponseCode MtpServer::doCloseSession() {
         return MTP_RESPONSE_SESSION_NOT_OPEN;
     mSessionID = 0;
     mSessionOpen = false;
+    mCompression = MTP_NX_COMPRESSION_NONE;
+    mCompressor.reset();
+    closeCachedFiles();
+    flushEdits();
+    logIoStats();
     mDatabase->sessionEnded();
     return MTP_RESPONSE_OK;
 }
@@ -515,10 +910,11 @@ MtpResponseCode MtpServer::doGetStorageIDs() {
     if (!mSessionOpen)
         return MTP_RESPONSE_SESSION_NOT_OPEN;
 
-    int count = mStorages.size();
+    std::shared_ptr<const MtpStorageList> storages = getStorages();
+    int count = storages->size();
     mData.putUInt32(count);
     for (int i = 0; i < count; i++)
-        mData.putUInt32(mStorages[i]->getStorageID());
+        mData.putUInt32((*storages)[i]->getStorageID());
 
     return MTP_RESPONSE_OK;
 }
@@ -648,6 +1044,15 @@ MtpResponseCode MtpServer::doSetObjectPropValue() {
     VLOG(2) << "SetObjectPropValue " << handle
             << " " << MtpDebug::getObjectPropCodeName(property);
 
+    // the database renames the file
+    if (property == MTP_PROPERTY_OBJECT_FILE_NAME) {
+        MtpString path;
+        int64_t fileLength;
+        MtpObjectFormat format;
+        if (mDatabase->getObjectFilePath(handle, path, fileLength, format) == MTP_RESPONSE_OK)
+            mFileCache->invalidate(path);
+    }
+
     response = mDatabase->setObjectPropertyValue(handle, property, mData);
 
     //sendObjectPropChanged(handle, property);
@@ -737,82 +1142,429 @@ MtpResponseCode MtpServer::doGetObjectInfo() {
 
 struct mtp_file_range {
     int fd;
+    // in place of fd when set
+    MtpSplitFile* split;
+    // reads split through this when set
+    MtpReadAhead* ahead;
+    // writes go through this when set
+    MtpWriteBuffer* buffer;
+    // read in place of a file when set, for objects the server generates
+    const MtpString* data;
     off_t offset;
     int64_t length;
     uint16_t command;
     uint32_t transaction_id;
 };
 
-static int send_file(USBMtpInterface* usb, struct mtp_file_range * mfr)
+static ssize_t range_pread(struct mtp_file_range * mfr, void* buffer, size_t length, off_t offset)
 {
-    int actualsize;
-    int j, ofs;
-    int blocksize;
+    MtpTrace::Span span("file", "read", length);
+    if (mfr->data) {
+        if ((uint64_t)offset >= mfr->data->size())
+            return 0;
+        length = std::min(length, (size_t)(mfr->data->size() - offset));
+        memcpy(buffer, mfr->data->data() + offset, length);
+        return length;
+    }
+    if (mfr->ahead)
+        return mfr->ahead->pread(mfr->split, buffer, length, offset);
+    return mfr->split ? mfr->split->pread(buffer, length, offset)
+                      : pread(mfr->fd, buffer, length, offset);
+}
 
-    struct stat buf;
-    fstat(mfr->fd, &buf);
+static ssize_t range_pwrite(struct mtp_file_range * mfr, const void* buffer, size_t length, off_t offset)
+{
+    MtpTrace::Span span("file", "write", length);
+    if (mfr->buffer)
+        return mfr->buffer->pwrite(buffer, length, offset);
+    return mfr->split ? mfr->split->pwrite(buffer, length, offset)
+                      : pwrite(mfr->fd, buffer, length, offset);
+}
 
-    unsigned char * buffer = (unsigned char*)memalign(0x1000, 16384);
-    *(uint32_t*)&buffer[0] = mfr->length + MTP_CONTAINER_HEADER_SIZE;
-    *(uint16_t*)&buffer[4] = MTP_CONTAINER_TYPE_DATA;
-    *(uint16_t*)&buffer[6] = mfr->command;
-    *(uint32_t*)&buffer[8] = mfr->transaction_id;
+static int range_stat(struct mtp_file_range * mfr, struct stat* sstat)
+{
+    if (mfr->data) {
+        memset(sstat, 0, sizeof(*sstat));
+        sstat->st_mode = S_IFREG | S_IRUSR;
+        sstat->st_size = mfr->data->size();
+        return 0;
+    }
+    return mfr->split ? mfr->split->fstat(sstat) : fstat(mfr->fd, sstat);
+}
+
+static int range_fsync(struct mtp_file_range * mfr)
+{
+    return mfr->split ? mfr->split->fsync() : fsync(mfr->fd);
+}
+
+static void range_close(struct mtp_file_range * mfr)
+{
+    if (mfr->split)
+        mfr->split->close();
+    else
+        close(mfr->fd);
+}
+
+static int64_t range_size(struct mtp_file_range * mfr)
+{
+    struct stat sstat;
+    return range_stat(mfr, &sstat) == 0 ? sstat.st_size : -1;
+}
+
+// the file is read in kFileReadSize pieces that end on a multiple of it.
+// Each transfer is what fills whole packets of what is in the buffer, the
+// rest moves to the front for the next one, which the header starts out as.
+static int64_t send_file(USBMtpInterface* usb, struct mtp_file_range * mfr)
+{
+    int64_t actualsize;
+    int64_t j;
+    size_t ofs;
+    size_t blocksize;
+    size_t packetSize = usbGetMaxPacketSize();
 
-    if(mfr->offset >= buf.st_size)
+    int64_t fileSize = range_size(mfr);
+
+    if(mfr->offset >= fileSize)
     {
         actualsize = 0;
     }
     else
     {
-      if(mfr->offset + mfr->length > buf.st_size)
-          actualsize = buf.st_size - mfr->offset;
+      if(mfr->offset + mfr->length > fileSize)
+          actualsize = fileSize - mfr->offset;
       else
           actualsize = mfr->length;
     }
 
-    lseek(mfr->fd, mfr->offset, SEEK_SET);
+    // past 32 bits the container length is 0xFFFFFFFF and the host reads
+    // up to a short packet
+    uint64_t total = actualsize + MTP_CONTAINER_HEADER_SIZE;
+    bool unbounded = (total >= 0xFFFFFFFF);
+
+    unsigned char * buffer = (unsigned char*)memalign(0x1000, kFileReadSize + packetSize);
+    *(uint32_t*)&buffer[0] = unbounded ? 0xFFFFFFFF : (uint32_t)total;
+    *(uint16_t*)&buffer[4] = MTP_CONTAINER_TYPE_DATA;
+    *(uint16_t*)&buffer[6] = mfr->command;
+    *(uint32_t*)&buffer[8] = mfr->transaction_id;
+
     ofs = MTP_CONTAINER_HEADER_SIZE;
     j = 0;
     do
     {
-        if((j + (16384 - ofs)) < actualsize)
-            blocksize = (16384 - ofs);
-        else
+        blocksize = kFileReadSize - (mfr->offset + j) % kFileReadSize;
+        if (j + (int64_t)blocksize > actualsize)
             blocksize = actualsize - j;
-    
-        read(mfr->fd, &buffer[ofs], blocksize);
+
+        range_pread(mfr, &buffer[ofs], blocksize, mfr->offset + j);
         j += blocksize;
         ofs += blocksize;
-    
-        usb->write((const char*)buffer, ofs);
-        ofs = 0;
+
+        size_t count = (j < actualsize) ? ofs - ofs % packetSize : ofs;
+        // the host went away, or cancelled the transaction
+        if (count > 0 && usb->write((const char*)buffer, count) != (ssize_t)count) {
+            actualsize = -1;
+            break;
+        }
+        memmove(buffer, &buffer[count], ofs - count);
+        ofs -= count;
     } while(j < actualsize);
 
+    if (actualsize >= 0 && unbounded && total % usbGetMaxPacketSize() == 0
+            && usb->write((const char*)buffer, 0) != 0)
+        actualsize = -1;
+
+    int error = errno;
     free(buffer);
+    errno = error;
 
     return actualsize;
 }
 
-static int receive_file(USBMtpInterface* usb, struct mtp_file_range * mfr)
+// digests, if any, are updated with the data while it is still in cache.
+// received, if not NULL, is set to what made it to the file even when the
+// transfer fails. A length of 0xFFFFFFFF reads up to a short transfer, as
+// sent for objects of 4GB and more.
+static int64_t receive_file(USBMtpInterface* usb, struct mtp_file_range * mfr,
+                            MtpDigest* digests, int digestCount, int64_t* received)
 {
-    if(mfr->length == 0xFFFFFFFF)
-        return -1;
+    if (received)
+        *received = 0;
+    bool unbounded = (mfr->length == 0xFFFFFFFF);
 
     int size = 0;
-    int total = 0;
+    int64_t total = 0;
+    bool failed = false;
     unsigned char * buffer = (unsigned char*)memalign(0x1000, 16384);
-    lseek(mfr->fd, mfr->offset, SEEK_SET);
 
     do
     {
         size = usb->read((char*)buffer, 16384);
+        // the host went away, or ended the data phase early. One of unknown
+        // length that filled its last packet ends with a zero length packet.
+        if (size < 0 || (size == 0 && !unbounded)
+                || (size > 0 && range_pwrite(mfr, buffer, size, mfr->offset + total) != size)) {
+            failed = true;
+            break;
+        }
         total += size;
-        write(mfr->fd, buffer, size);
-    } while(total < mfr->length);
+        for (int i = 0; i < digestCount; i++)
+            digests[i].update(buffer, size);
+    } while(unbounded ? size == 16384 : total < mfr->length);
 
+    int error = errno;
     free(buffer);
+    errno = error;
+
+    if (received)
+        *received = total;
+    return failed ? -1 : total;
+}
+
+// a data phase of unknown length, moved in whole kStreamBufferSize
+// transfers until it ends with a short packet
+struct mtp_stream {
+    USBMtpInterface* usb;
+    unsigned char * buffer;
+    size_t offset;
+    size_t length;
+    bool ended;
+    bool failed;
+    // errno of the transfer that failed
+    int error;
+};
+
+static void stream_put(struct mtp_stream * stream, const void* data, size_t length)
+{
+    const unsigned char * ptr = (const unsigned char*)data;
+    while (length > 0) {
+        size_t count = std::min(length, kStreamBufferSize - stream->length);
+        memcpy(&stream->buffer[stream->length], ptr, count);
+        stream->length += count;
+        ptr += count;
+        length -= count;
+
+        if (stream->length == kStreamBufferSize) {
+            if (!stream->failed
+                    && stream->usb->write((const char*)stream->buffer, kStreamBufferSize) != (ssize_t)kStreamBufferSize) {
+                stream->failed = true;
+                stream->error = errno;
+            }
+            stream->length = 0;
+        }
+    }
+}
+
+static bool stream_get(struct mtp_stream * stream, void* data, size_t length)
+{
+    unsigned char * ptr = (unsigned char*)data;
+    while (length > 0) {
+        if (stream->offset == stream->length) {
+            if (stream->ended)
+                return false;
+            ssize_t ret = stream->usb->read((char*)stream->buffer, kStreamBufferSize);
+            if (ret < 0) {
+                stream->ended = true;
+                stream->failed = true;
+                stream->error = errno;
+                return false;
+            }
+            stream->ended = ((size_t)ret < kStreamBufferSize);
+            stream->offset = 0;
+            stream->length = ret;
+            continue;
+        }
+        size_t count = std::min(length, stream->length - stream->offset);
+        memcpy(ptr, &stream->buffer[stream->offset], count);
+        stream->offset += count;
+        ptr += count;
+        length -= count;
+    }
+    return true;
+}
+
+// sends the range as MtpCompressor frames, the chunks after the one being
+// written are compressed meanwhile
+static int64_t send_file_compressed(USBMtpInterface* usb, struct mtp_file_range * mfr,
+                                    MtpCompressor* compressor)
+{
+    int64_t fileSize = range_size(mfr);
+    if (fileSize < 0)
+        return -1;
+
+    int64_t actualsize = 0;
+    if (mfr->offset < fileSize)
+        actualsize = std::min<int64_t>(mfr->length, fileSize - mfr->offset);
+
+    struct mtp_stream stream;
+    stream.usb = usb;
+    stream.buffer = (unsigned char*)memalign(0x1000, kStreamBufferSize);
+    stream.offset = 0;
+    stream.length = MTP_CONTAINER_HEADER_SIZE;
+    stream.ended = false;
+    stream.failed = false;
+    stream.error = 0;
+    *(uint32_t*)&stream.buffer[0] = 0xFFFFFFFF;
+    *(uint16_t*)&stream.buffer[4] = MTP_CONTAINER_TYPE_DATA;
+    *(uint16_t*)&stream.buffer[6] = mfr->command;
+    *(uint32_t*)&stream.buffer[8] = mfr->transaction_id;
+
+    off_t offset = mfr->offset;
+    int64_t remaining = actualsize;
+    bool failed = false;
+    for (;;) {
+        MtpCompressor::Chunk* chunk;
+        while (remaining > 0 && !failed && !stream.failed && (chunk = compressor->acquire())) {
+            ssize_t ret = range_pread(mfr, chunk->mData,
+                                      std::min<int64_t>(remaining, MtpCompressor::kChunkSize), offset);
+            if (ret <= 0) {
+                // end the stream early, the response tells the host
+                failed = true;
+                break;
+            }
+            chunk->mLength = ret;
+            offset += ret;
+            remaining -= ret;
+            compressor->submit(chunk, false);
+        }
+
+        chunk = compressor->next();
+        if (!chunk)
+            break;
+        stream_put(&stream, chunk->mFrame, chunk->mFrameLength);
+    }
+
+    static const uint8_t end[MtpCompressor::kFrameHeaderSize + 4] = { 0 };
+    size_t endLength = MtpCompressor::kFrameHeaderSize;
+    // a shorter packet ends the data phase
+    if ((stream.length + endLength) % usbGetMaxPacketSize() == 0)
+        endLength += 4;
+    stream_put(&stream, end, endLength);
+    if (stream.length > 0 && !stream.failed
+            && usb->write((const char*)stream.buffer, stream.length) != (ssize_t)stream.length) {
+        stream.failed = true;
+        stream.error = errno;
+    }
 
-    return total;
+    free(stream.buffer);
+
+    if (stream.failed)
+        errno = stream.error;
+    return (failed || stream.failed) ? -1 : actualsize;
+}
+
+// receives MtpCompressor frames into the range. The data phase is already
+// read up to initialLength bytes of it, all of it if ended is true.
+static int64_t receive_file_compressed(USBMtpInterface* usb, struct mtp_file_range * mfr,
+                                       MtpCompressor* compressor,
+                                       const void* initial, size_t initialLength, bool ended,
+                                       MtpDigest* digests, int digestCount)
+{
+    struct mtp_stream stream;
+    stream.usb = usb;
+    stream.buffer = (unsigned char*)memalign(0x1000, kStreamBufferSize);
+    stream.offset = 0;
+    stream.length = initialLength;
+    stream.ended = ended;
+    stream.failed = false;
+    stream.error = 0;
+    memcpy(stream.buffer, initial, initialLength);
+
+    int64_t total = 0;
+    bool done = false;
+    bool failed = false;
+    for (;;) {
+        MtpCompressor::Chunk* chunk;
+        while (!done && (chunk = compressor->acquire())) {
+            size_t payloadLength, dataLength;
+            bool raw;
+            if (!stream_get(&stream, chunk->mFrame, MtpCompressor::kFrameHeaderSize)
+                    || !MtpCompressor::parseHeader(chunk->mFrame, payloadLength, dataLength, raw)
+                    || !stream_get(&stream, chunk->mFrame + MtpCompressor::kFrameHeaderSize,
+                                   payloadLength)) {
+                if (!stream.failed)
+                    LOG(ERROR) << "malformed compressed data";
+                failed = true;
+                done = true;
+            } else if (dataLength == 0) {
+                done = true;
+            } else {
+                compressor->submit(chunk, true);
+            }
+        }
+
+        chunk = compressor->next();
+        if (!chunk)
+            break;
+        if (!chunk->mValid) {
+            LOG(ERROR) << "malformed compressed frame";
+            failed = done = true;
+        }
+        if (failed)
+            continue;
+
+        if (range_pwrite(mfr, chunk->mData, chunk->mLength, mfr->offset + total)
+                != (ssize_t)chunk->mLength) {
+            failed = done = true;
+            continue;
+        }
+        for (int i = 0; i < digestCount; i++)
+            digests[i].update(chunk->mData, chunk->mLength);
+        total += chunk->mLength;
+    }
+
+    // skip the padding, or the rest after an error. Not after a failed
+    // transfer, a cancelled one has nothing more coming.
+    while (!stream.ended) {
+        stream.offset = stream.length;
+        uint8_t byte;
+        stream_get(&stream, &byte, 1);
+    }
+    free(stream.buffer);
+
+    if (stream.failed)
+        errno = stream.error;
+    return failed ? -1 : total;
+}
+
+// only the stats of the server can have this path, the state directory
+// of a storage is not looked into for anything else
+static bool isStatsPath(const MtpString& path) {
+    static const MtpString suffix = "/" MTP_STATE_DIRECTORY "/" MTP_STATS_FILE_NAME;
+    return path.size() >= suffix.size()
+            && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// an object being edited is read through the edit, which Horizon would
+// not let us open the file a second time for. The file stays open for
+// the next request either way, and is read ahead in if the host reads
+// on from where this range ends. The stats are generated anew for every
+// read that starts at the beginning.
+bool MtpServer::openForReading(MtpObjectHandle handle, const MtpString& path,
+                               uint64_t offset, uint64_t length, struct mtp_file_range* mfr) {
+    mfr->data = NULL;
+    if (isStatsPath(path)) {
+        if (offset == 0 || mStats.empty())
+            writeStats(mStats);
+        mfr->fd = -1;
+        mfr->split = NULL;
+        mfr->ahead = NULL;
+        mfr->buffer = NULL;
+        mfr->data = &mStats;
+        return true;
+    }
+
+    ObjectEdit* edit = getEditObject(handle);
+    if (edit && !edit->mBuffer.flush())
+        return false;
+    mfr->fd = edit ? edit->mFD : -1;
+    mfr->split = edit ? NULL : mFileCache->get(handle, path);
+    mfr->ahead = NULL;
+    mfr->buffer = NULL;
+    if (mfr->split) {
+        mfr->ahead = &mFileCache->getReadAhead();
+        mfr->ahead->access(mfr->split, offset, length);
+    }
+    return mfr->fd >= 0 || mfr->split;
 }
 
 MtpResponseCode MtpServer::doGetObject() {
@@ -827,21 +1579,20 @@ MtpResponseCode MtpServer::doGetObject() {
         return result;
 
     struct mtp_file_range mfr;
-    mfr.fd = open(pathBuf.c_str(), O_RDONLY);
-    if (mfr.fd < 0) {
+    if (!openForReading(handle, pathBuf, 0, fileLength, &mfr))
         return MTP_RESPONSE_GENERAL_ERROR;
-    }
     mfr.offset = 0;
     mfr.length = fileLength;
     mfr.command = mRequest.getOperationCode();
     mfr.transaction_id = mRequest.getTransactionID();
 
     // then transfer the file
-    int ret = send_file(mUSB, &mfr);
+    int64_t ret = mCompressor ? send_file_compressed(mUSB, &mfr, mCompressor.get())
+                              : send_file(mUSB, &mfr);
+    int error = errno;
     VLOG(2) << "MTP_SEND_FILE_WITH_HEADER returned " << ret;
-    close(mfr.fd);
     if (ret < 0) {
-        if (errno == ECANCELED)
+        if (error == ECANCELED)
             return MTP_RESPONSE_TRANSACTION_CANCELLED;
         else
             return MTP_RESPONSE_GENERAL_ERROR;
@@ -887,14 +1638,14 @@ MtpResponseCode MtpServer::doGetPartialObject(MtpOperationCode operation) {
     int result = mDatabase->getObjectFilePath(handle, pathBuf, fileLength, format);
     if (result != MTP_RESPONSE_OK)
         return result;
-    if (offset + length > fileLength)
+    if (offset >= (uint64_t)fileLength)
+        length = 0;
+    else if (offset + length > (uint64_t)fileLength)
         length = fileLength - offset;
 
     mtp_file_range  mfr;
-    mfr.fd = open(pathBuf.c_str(), O_RDONLY);
-    if (mfr.fd < 0) {
+    if (!openForReading(handle, pathBuf, offset, length, &mfr))
         return MTP_RESPONSE_GENERAL_ERROR;
-    }
     mfr.offset = offset;
     mfr.length = length;
     mfr.command = mRequest.getOperationCode();
@@ -902,11 +1653,12 @@ MtpResponseCode MtpServer::doGetPartialObject(MtpOperationCode operation) {
     mResponse.setParameter(1, length);
 
     // transfer the file
-    int ret = send_file(mUSB, &mfr);
+    int64_t ret = mCompressor ? send_file_compressed(mUSB, &mfr, mCompressor.get())
+                              : send_file(mUSB, &mfr);
+    int error = errno;
     VLOG(2) << "MTP_SEND_FILE_WITH_HEADER returned " << ret;
-    close(mfr.fd);
     if (ret < 0) {
-        if (errno == ECANCELED)
+        if (error == ECANCELED)
             return MTP_RESPONSE_TRANSACTION_CANCELLED;
         else
             return MTP_RESPONSE_GENERAL_ERROR;
@@ -934,6 +1686,8 @@ MtpResponseCode MtpServer::doSendObjectInfo() {
             return result;
         if (format != MTP_FORMAT_ASSOCIATION)
             return MTP_RESPONSE_INVALID_PARENT_OBJECT;
+        if (mDatabase->isReadOnly(parent))
+            return MTP_RESPONSE_ACCESS_DENIED;
     }
 
     // read only the fields we need
@@ -976,12 +1730,15 @@ MtpResponseCode MtpServer::doSendObjectInfo() {
     if (maxFileSize != 0) {
         // if mSendObjectFileSize is 0xFFFFFFFF, then all we know is the file size
         // is >= 0xFFFFFFFF
-        if (mSendObjectFileSize > maxFileSize || mSendObjectFileSize == 0xFFFFFFFF)
+        if (mSendObjectFileSize > maxFileSize
+                || (mSendObjectFileSize == 0xFFFFFFFF && maxFileSize <= 0xFFFFFFFF))
             return MTP_RESPONSE_OBJECT_TOO_LARGE;
     }
 
     VLOG(2) << "path: " << path.c_str() << " parent: " << parent
             << " storageID: " << std::hex << storageID << std::dec;
+    // an object of that name is about to be replaced
+    mFileCache->invalidate(path);
     MtpObjectHandle handle = mDatabase->beginSendObject(path.c_str(),
             format, parent, storageID, mSendObjectFileSize, modifiedTime);
     if (handle == kInvalidObjectHandle) {
@@ -992,6 +1749,8 @@ MtpResponseCode MtpServer::doSendObjectInfo() {
         int ret = mkdir(path.c_str(), mDirectoryPermission);
         if (ret && ret != -EEXIST)
             return MTP_RESPONSE_GENERAL_ERROR;
+        if (ret == 0)
+            storage->fileResized(0, storage->getClusterSize());
 
         // SendObject does not get sent for directories, so call endSendObject here instead
         mDatabase->endSendObject(path, handle, MTP_FORMAT_ASSOCIATION, MTP_RESPONSE_OK);
@@ -1000,6 +1759,20 @@ MtpResponseCode MtpServer::doSendObjectInfo() {
         // save the handle for the SendObject call, which should follow
         mSendObjectHandle = handle;
         mSendObjectFormat = format;
+
+        // create the file while the host sets up the data phase, with its
+        // clusters allocated in one go instead of as it grows. Compressed
+        // uploads are written to the length that arrives. ftruncate() of
+        // fsdev is fsFileSetSize(), and FAT has no sparse files, so
+        // growing the file takes its clusters.
+        if (!mCompressor && mSendObjectFileSize > kSmallObjectSize
+                && mSendObjectFileSize != 0xFFFFFFFF) {
+            mSendObjectFD = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+            if (mSendObjectFD >= 0 && ftruncate(mSendObjectFD, mSendObjectFileSize) == 0) {
+                storage->fileResized(0, mSendObjectFileSize);
+                mSendObjectAllocated = mSendObjectFileSize;
+            }
+        }
     }
 
     mResponse.setParameter(1, storageID);
@@ -1013,7 +1786,26 @@ MtpResponseCode MtpServer::doSendObject() {
     if (!hasStorage())
         return MTP_RESPONSE_GENERAL_ERROR;
     MtpResponseCode result = MTP_RESPONSE_OK;
-    int ret, initialData;
+    int64_t ret;
+    // of the first transfer, which a data phase of unknown length may
+    // already end with
+    int64_t firstRead;
+    int initialData;
+    int error = 0;
+    // bytes of a failed transfer worth keeping
+    uint64_t committed = 0;
+    // of the data phase, written to the file
+    int64_t written = 0;
+    // objects of 4GB and more
+    MtpSplitFile split;
+    // takes the data the container header leaves off by its size, so that
+    // the file is written in whole clusters
+    std::unique_ptr<MtpWriteBuffer> buffer;
+    MtpDigest digests[] = { MtpDigest(MTP_NX_DIGEST_CRC32C), MtpDigest(MTP_NX_DIGEST_SHA256) };
+    int digestCount = mUploadDigests ? sizeof(digests) / sizeof(digests[0]) : 0;
+    // finished digests, stored once the file is closed
+    uint8_t digestValues[sizeof(digests) / sizeof(digests[0])][MtpDigest::kMaxSize];
+    bool digested = false;
 
     if (mSendObjectHandle == kInvalidObjectHandle) {
         LOG(ERROR) << "Expected SendObjectInfo before SendObject";
@@ -1021,25 +1813,73 @@ MtpResponseCode MtpServer::doSendObject() {
         goto done;
     }
 
+    if (!mCompressor && mSendObjectFileSize <= kSmallObjectSize) {
+        result = receiveSmallObject();
+        goto done;
+    }
+
     // read the header, and possibly some data
-    ret = mData.read(mUSB, 512);
-    if (ret < MTP_CONTAINER_HEADER_SIZE) {
-        result = MTP_RESPONSE_GENERAL_ERROR;
+    ret = firstRead = mData.read(mUSB, 512);
+    if (firstRead < MTP_CONTAINER_HEADER_SIZE) {
+        result = errno == ECANCELED ? MTP_RESPONSE_TRANSACTION_CANCELLED
+                                    : MTP_RESPONSE_GENERAL_ERROR;
         goto done;
     }
-    initialData = ret - MTP_CONTAINER_HEADER_SIZE;
+    initialData = firstRead - MTP_CONTAINER_HEADER_SIZE;
 
     mtp_file_range  mfr;
-    mfr.fd = open(mSendObjectFilePath.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-    if (mfr.fd < 0) {
+    mfr.split = NULL;
+    mfr.ahead = NULL;
+    mfr.buffer = NULL;
+    mfr.data = NULL;
+    if (mSendObjectFD >= 0) {
+        mfr.fd = mSendObjectFD;
+        mSendObjectFD = -1;
+    } else if (mSendObjectFileSize == 0xFFFFFFFF) {
+        // more than FAT32 takes, so it is stored in parts
+        mfr.fd = -1;
+        if (MtpSplitFile::create(mSendObjectFilePath.c_str())
+                && split.open(mSendObjectFilePath.c_str(), O_RDWR | O_CREAT))
+            mfr.split = &split;
+        else
+            MtpSplitFile::remove(mSendObjectFilePath.c_str());
+    } else {
+        mfr.fd = open(mSendObjectFilePath.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    }
+    if (mfr.fd < 0 && !mfr.split) {
         result = MTP_RESPONSE_GENERAL_ERROR;
         goto done;
     }
+    if (mfr.split)
+        buffer.reset(new MtpWriteBuffer(mfr.split, getClusterSize(mSendObjectFilePath)));
+    else
+        buffer.reset(new MtpWriteBuffer(mfr.fd, getClusterSize(mSendObjectFilePath)));
+    mfr.buffer = buffer.get();
+
+    if (mCompressor) {
+        VLOG(2) << "receiving compressed " << mSendObjectFilePath.c_str();
+        mfr.offset = 0;
+        ret = receive_file_compressed(mUSB, &mfr, mCompressor.get(), mData.getData(), initialData,
+                                      firstRead < 512, digests, digestCount);
+        error = errno;
+        VLOG(2) << "receive_file_compressed returned " << ret;
+        // the database takes the size of SendObjectInfo as it is
+        if (ret >= 0 && mSendObjectFileSize != 0xFFFFFFFF && (size_t)ret != mSendObjectFileSize) {
+            LOG(ERROR) << "expected " << mSendObjectFileSize << " bytes, got " << ret;
+            ret = -1;
+            error = 0;
+        }
+    } else if (initialData > 0) {
+        ret = range_pwrite(&mfr, mData.getData(), initialData, 0);
+        if (ret == initialData)
+            written = initialData;
+        for (int i = 0; i < digestCount; i++)
+            digests[i].update(mData.getData(), initialData);
+    }
 
-    if (initialData > 0)
-        ret = write(mfr.fd, mData.getData(), initialData);
-
-    if (mSendObjectFileSize - initialData > 0) {
+    // a short first transfer already ended a data phase of unknown length
+    if (!mCompressor && mSendObjectFileSize > (uint64_t)initialData
+            && !(mSendObjectFileSize == 0xFFFFFFFF && firstRead < 512)) {
         mfr.offset = initialData;
         if (mSendObjectFileSize == 0xFFFFFFFF) {
             // tell driver to read until it receives a short packet
@@ -1050,88 +1890,140 @@ MtpResponseCode MtpServer::doSendObject() {
 
         VLOG(2) << "receiving " << mSendObjectFilePath.c_str();
         // transfer the file
-        int ret = receive_file(mUSB, &mfr);
+        int64_t received;
+        ret = receive_file(mUSB, &mfr, digests, digestCount, &received);
+        error = errno;
+        written += received;
         VLOG(2) << "MTP_RECEIVE_FILE returned " << ret;
     }
-    close(mfr.fd);
+
+    // nothing of what is still buffered can be counted on if it does not
+    // make it to the file
+    if (!buffer->release()) {
+        if (ret >= 0)
+            error = errno;
+        ret = -1;
+        written = 0;
+    }
 
     if (ret < 0) {
-        unlink(mSendObjectFilePath.c_str());
-        if (errno == ECANCELED)
-            result = MTP_RESPONSE_TRANSACTION_CANCELLED;
-        else
-            result = MTP_RESPONSE_GENERAL_ERROR;
+        // what arrived of an interrupted upload is kept for the host to
+        // resume, unless it called the upload off itself. A preallocated
+        // file is cut back to that first. SendPartialObject cannot resume
+        // a split file.
+        struct stat sstat;
+        bool keep = error != ECANCELED && !mfr.split;
+        if (mSendObjectAllocated > 0 && ftruncate(mfr.fd, written) != 0)
+            keep = false;
+        if (keep && range_fsync(&mfr) == 0 && range_stat(&mfr, &sstat) == 0)
+            committed = sstat.st_size;
+    } else if (digestCount > 0) {
+        // only keep digests that cover exactly what ended up on disk
+        struct stat sstat;
+        if (range_stat(&mfr, &sstat) == 0 && (uint64_t)sstat.st_size == digests[0].getLength()) {
+            for (int i = 0; i < digestCount; i++)
+                digests[i].finish(digestValues[i]);
+            digested = true;
+        } else {
+            LOG(WARNING) << "received data does not match " << mSendObjectFilePath;
+        }
+    }
+    if (ret >= 0) {
+        uint64_t size = mSendObjectFileSize;
+        struct stat sstat;
+        if (size == 0xFFFFFFFF)
+            size = range_stat(&mfr, &sstat) == 0 ? sstat.st_size : 0;
+        fileResized(mSendObjectFilePath, mSendObjectAllocated, size);
+    } else {
+        fileResized(mSendObjectFilePath, mSendObjectAllocated, committed);
+    }
+    mSendObjectAllocated = 0;
+    range_close(&mfr);
+
+    if (ret < 0) {
+        if (committed > 0) {
+            LOG(WARNING) << "keeping " << committed << " bytes of " << mSendObjectFilePath;
+            result = MTP_RESPONSE_INCOMPLETE_TRANSFER;
+        } else {
+            MtpSplitFile::remove(mSendObjectFilePath.c_str());
+            if (error == ECANCELED)
+                result = MTP_RESPONSE_TRANSACTION_CANCELLED;
+            else
+                result = MTP_RESPONSE_GENERAL_ERROR;
+        }
     }
 
 done:
     // reset so we don't attempt to send the data back
     mData.reset();
+    closeSendObjectFile();
 
-    mDatabase->endSendObject(mSendObjectFilePath, mSendObjectHandle, mSendObjectFormat,
-            result == MTP_RESPONSE_OK);
+    if (result == MTP_RESPONSE_INCOMPLETE_TRANSFER)
+        mDatabase->keepPartialObject(mSendObjectFilePath, mSendObjectHandle, committed);
+    else
+        mDatabase->endSendObject(mSendObjectFilePath, mSendObjectHandle, mSendObjectFormat,
+                result == MTP_RESPONSE_OK);
+
+    // digests are looked up by the modification time, which closing the
+    // file may still have changed
+    if (digested && result == MTP_RESPONSE_OK) {
+        struct stat sstat;
+        if (MtpSplitFile::stat(mSendObjectFilePath.c_str(), &sstat) == 0
+                && (uint64_t)sstat.st_size == digests[0].getLength()) {
+            for (int i = 0; i < digestCount; i++)
+                mDatabase->setObjectDigest(mSendObjectHandle, digests[i].getAlgorithm(),
+                                           sstat.st_size, sstat.st_mtime, digestValues[i]);
+        }
+    }
     mSendObjectHandle = kInvalidObjectHandle;
     mSendObjectFormat = 0;
     return result;
 }
 
-static void deleteRecursive(const char* path) {
-    char pathbuf[PATH_MAX];
-    int pathLength = strlen(path);
-    if (pathLength >= sizeof(pathbuf) - 1) {
-        LOG(ERROR) << "path too long: " << path;
-    }
-    strcpy(pathbuf, path);
-    if (pathbuf[pathLength - 1] != '/') {
-        pathbuf[pathLength++] = '/';
-    }
-    char* fileSpot = pathbuf + pathLength;
-    int pathRemaining = sizeof(pathbuf) - pathLength - 1;
-
-    DIR* dir = opendir(path);
-    if (!dir) {
-        LOG(ERROR) << "opendir " << path << " failed";
-        return;
-    }
-
-    struct dirent* entry;
-    while ((entry = readdir(dir))) {
-        const char* name = entry->d_name;
-
-        // ignore "." and ".."
-        if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0))) {
-            continue;
-        }
-
-        int nameLength = strlen(name);
-        if (nameLength > pathRemaining) {
-            LOG(ERROR) << "path " << path << "/" << name << " too long";
-            continue;
-        }
-        strcpy(fileSpot, name);
-
-        int type = entry->d_type;
-        if (entry->d_type == DT_DIR) {
-            deleteRecursive(pathbuf);
-            rmdir(pathbuf);
-        } else {
-            unlink(pathbuf);
+// A small object mostly arrives in a single transfer along with its
+// container header, what a host sends after a header of its own is read
+// as well, and goes to disk in a single write. Closing the file is left to
+// mCloser, and endSendObject() takes the announced size as it is. Nor is
+// it digested, the modification time its digests would be stored with is
+// only known once mCloser is done, and reading it back costs little.
+MtpResponseCode MtpServer::receiveSmallObject() {
+    int length = MTP_CONTAINER_HEADER_SIZE + mSendObjectFileSize;
+    int ret = mData.read(mUSB, length);
+    if (ret < MTP_CONTAINER_HEADER_SIZE)
+        return errno == ECANCELED ? MTP_RESPONSE_TRANSACTION_CANCELLED
+                                  : MTP_RESPONSE_GENERAL_ERROR;
+
+    const uint8_t* data = mData.getData();
+    std::unique_ptr<uint8_t[]> rest;
+    if (ret < length) {
+        size_t received = ret - MTP_CONTAINER_HEADER_SIZE;
+        rest.reset(new uint8_t[mSendObjectFileSize]);
+        memcpy(rest.get(), data, received);
+        while (received < mSendObjectFileSize) {
+            ssize_t count = mUSB->read((char*)rest.get() + received, mSendObjectFileSize - received);
+            if (count <= 0) {
+                LOG(ERROR) << "expected " << mSendObjectFileSize << " bytes for "
+                           << mSendObjectFilePath << ", got " << received;
+                return count < 0 && errno == ECANCELED ? MTP_RESPONSE_TRANSACTION_CANCELLED
+                                                       : MTP_RESPONSE_GENERAL_ERROR;
+            }
+            received += count;
         }
+        data = rest.get();
     }
-    closedir(dir);
-}
 
-static void deletePath(const char* path) {
-    struct stat statbuf;
-    if (stat(path, &statbuf) == 0) {
-        if (S_ISDIR(statbuf.st_mode)) {
-            deleteRecursive(path);
-            rmdir(path);
-        } else {
-            unlink(path);
-        }
-    } else {
-        LOG(ERROR) << "deletePath stat failed for " << path;
+    int fd = open(mSendObjectFilePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0)
+        return MTP_RESPONSE_GENERAL_ERROR;
+    if (mSendObjectFileSize > 0 && write(fd, data, mSendObjectFileSize) != (ssize_t)mSendObjectFileSize) {
+        close(fd);
+        unlink(mSendObjectFilePath.c_str());
+        return MTP_RESPONSE_GENERAL_ERROR;
     }
+
+    mCloser->close(fd);
+    fileResized(mSendObjectFilePath, 0, mSendObjectFileSize);
+    return MTP_RESPONSE_OK;
 }
 
 MtpResponseCode MtpServer::doDeleteObject() {
@@ -1139,18 +2031,74 @@ MtpResponseCode MtpServer::doDeleteObject() {
         return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
     MtpObjectHandle handle = mRequest.getParameter(1);
     MtpObjectFormat format = mRequest.getParameter(2);
-    // FIXME - support deleting all objects if handle is 0xFFFFFFFF
-    // FIXME - implement deleting objects by format
 
+    if (handle != 0xFFFFFFFF)
+        return deleteObject(handle);
+
+    // every object, or every object of a format, on all storages. Folders
+    // go as a whole, so only what does not match is looked into.
+    std::vector<MtpObjectHandle> targets;
+    std::shared_ptr<const MtpStorageList> storages = getStorages();
+    for (size_t i = 0; i < storages->size(); i++) {
+        std::deque<MtpObjectHandle> folders;
+        folders.push_back(0);
+        while (!folders.empty()) {
+            MtpObjectHandleList* list = mDatabase->getObjectList((*storages)[i]->getStorageID(),
+                                                                 0, folders.front());
+            folders.pop_front();
+            if (!list)
+                continue;
+            for (size_t j = 0; j < list->size(); j++) {
+                // what the server makes up is not the host's to delete, and
+                // would only turn the response into a partial deletion
+                if (mDatabase->isReadOnly((*list)[j]))
+                    continue;
+                MtpString filePath;
+                int64_t fileLength;
+                MtpObjectFormat objectFormat;
+                if (mDatabase->getObjectFilePath((*list)[j], filePath, fileLength,
+                                                 objectFormat) != MTP_RESPONSE_OK)
+                    continue;
+                if (format == 0 || objectFormat == format)
+                    targets.push_back((*list)[j]);
+                else if (objectFormat == MTP_FORMAT_ASSOCIATION)
+                    folders.push_back((*list)[j]);
+            }
+            delete list;
+        }
+    }
+
+    VLOG(2) << "deleting " << targets.size() << " objects";
+    int deleted = 0;
+    for (size_t i = 0; i < targets.size(); i++) {
+        if (deleteObject(targets[i]) == MTP_RESPONSE_OK)
+            deleted++;
+    }
+    if (deleted < (int)targets.size())
+        return deleted > 0 ? MTP_RESPONSE_PARTIAL_DELETION : MTP_RESPONSE_OBJECT_WRITE_PROTECTED;
+    return MTP_RESPONSE_OK;
+}
+
+MtpResponseCode MtpServer::deleteObject(MtpObjectHandle handle) {
     MtpString filePath;
     int64_t fileLength;
+    MtpObjectFormat format;
     int result = mDatabase->getObjectFilePath(handle, filePath, fileLength, format);
     if (result == MTP_RESPONSE_OK) {
         VLOG(2) << "deleting " << filePath.c_str();
         result = mDatabase->deleteFile(handle);
         // Don't delete the actual files unless the database deletion is allowed
         if (result == MTP_RESPONSE_OK) {
-            deletePath(filePath.c_str());
+            mFileCache->invalidate(filePath);
+            // what goes to the trash frees its space once purged, see run()
+            if (!mTrash->remove(filePath)) {
+                // what a folder held is only known to the file system
+                MtpStorage* storage = getStorageForPath(filePath);
+                if (storage && format == MTP_FORMAT_ASSOCIATION)
+                    storage->invalidateFreeSpace();
+                else if (storage)
+                    storage->fileResized(fileLength, 0);
+            }
         }
     }
 
@@ -1165,17 +2113,13 @@ MtpResponseCode MtpServer::doMoveObject() {
     MtpObjectHandle newparent = mRequest.getParameter(3);
 
     MtpString filePath;
-    MtpString newPath;
     int64_t fileLength;
     int result = mDatabase->getObjectFilePath(handle, filePath, fileLength, format);
-    result = mDatabase->getObjectFilePath(handle, newPath, fileLength, format);
     if (result == MTP_RESPONSE_OK) {
-        VLOG(2) << "moving " << filePath.c_str() << " to " << newPath.c_str();
+        VLOG(2) << "moving " << filePath.c_str();
+        mFileCache->invalidate(filePath);
+        // renames the file itself and only then updates the database
         result = mDatabase->moveFile(handle, newparent);
-        // Don't move the actual files unless the database deletion is allowed
-        if (result == MTP_RESPONSE_OK) {
-            rename(filePath.c_str(), newPath.c_str());
-        }
     }
 
     return result;
@@ -1219,6 +2163,8 @@ MtpResponseCode MtpServer::doSendPartialObject() {
         LOG(ERROR) << "object not open for edit in doSendPartialObject";
         return MTP_RESPONSE_GENERAL_ERROR;
     }
+    if (edit->mFailed)
+        return MTP_RESPONSE_GENERAL_ERROR;
 
     // can't start writing past the end of the file
     if (offset > edit->mSize) {
@@ -1232,13 +2178,18 @@ MtpResponseCode MtpServer::doSendPartialObject() {
             << " " << offset << " " << length;
 
     // read the header, and possibly some data
-    int ret = mData.read(mUSB, 512);
+    int64_t ret = mData.read(mUSB, 512);
     if (ret < MTP_CONTAINER_HEADER_SIZE)
-        return MTP_RESPONSE_GENERAL_ERROR;
+        return errno == ECANCELED ? MTP_RESPONSE_TRANSACTION_CANCELLED
+                                  : MTP_RESPONSE_GENERAL_ERROR;
     int initialData = ret - MTP_CONTAINER_HEADER_SIZE;
+    int error = 0;
+    // hosts edit in small pieces, which the buffer merges into large writes
+    MtpWriteBuffer& buffer = getWriteBuffer(edit);
 
     if (initialData > 0) {
-        ret = write(edit->mFD, mData.getData(), initialData);
+        ret = buffer.pwrite(mData.getData(), initialData, offset);
+        error = errno;
         offset += initialData;
         length -= initialData;
     }
@@ -1246,16 +2197,35 @@ MtpResponseCode MtpServer::doSendPartialObject() {
     if (length > 0) {
         mtp_file_range  mfr;
         mfr.fd = edit->mFD;
+        mfr.split = NULL;
+        mfr.ahead = NULL;
+        mfr.buffer = &buffer;
+        mfr.data = NULL;
         mfr.offset = offset;
         mfr.length = length;
 
-        // transfer the file
-        ret = receive_file(mUSB, &mfr);
-        VLOG(2) << "MTP_RECEIVE_FILE returned " << ret;
+        // transfer the file, the data phase is read to its end even if
+        // the initial data could not be written
+        int64_t received = receive_file(mUSB, &mfr, NULL, 0, NULL);
+        if (ret >= 0) {
+            ret = received;
+            error = errno;
+        }
+        VLOG(2) << "MTP_RECEIVE_FILE returned " << received;
     }
     if (ret < 0) {
+        // whatever arrived counts, a resumed upload continues after it
+        struct stat sstat;
+        // writes acknowledged before may be among what is lost
+        if (!buffer.flush())
+            edit->mFailed = true;
+        if (fstat(edit->mFD, &sstat) == 0 && (uint64_t)sstat.st_size > edit->mSize) {
+            fileResized(edit->mPath, edit->mSize, sstat.st_size);
+            edit->mSize = sstat.st_size;
+        }
+
         mResponse.setParameter(1, 0);
-        if (errno == ECANCELED)
+        if (error == ECANCELED)
             return MTP_RESPONSE_TRANSACTION_CANCELLED;
         else
             return MTP_RESPONSE_GENERAL_ERROR;
@@ -1266,6 +2236,7 @@ MtpResponseCode MtpServer::doSendPartialObject() {
     mResponse.setParameter(1, length);
     uint64_t end = offset + length;
     if (end > edit->mSize) {
+        fileResized(edit->mPath, edit->mSize, end);
         edit->mSize = end;
     }
     return MTP_RESPONSE_OK;
@@ -1278,13 +2249,21 @@ MtpResponseCode MtpServer::doTruncateObject() {
         LOG(ERROR) << "object not open for edit in doTruncateObject";
         return MTP_RESPONSE_GENERAL_ERROR;
     }
+    if (edit->mFailed)
+        return MTP_RESPONSE_GENERAL_ERROR;
 
     uint64_t offset = mRequest.getParameter(2);
     uint64_t offset2 = mRequest.getParameter(3);
     offset |= (offset2 << 32);
+    // buffered writes come before the truncation
+    if (!edit->mBuffer.flush()) {
+        edit->mFailed = true;
+        return MTP_RESPONSE_GENERAL_ERROR;
+    }
     if (ftruncate(edit->mFD, offset) != 0) {
         return MTP_RESPONSE_GENERAL_ERROR;
     } else {
+        fileResized(edit->mPath, edit->mSize, offset);
         edit->mSize = offset;
         return MTP_RESPONSE_OK;
     }
@@ -1296,6 +2275,8 @@ MtpResponseCode MtpServer::doBeginEditObject() {
         LOG(ERROR) << "object already open for edit in doBeginEditObject";
         return MTP_RESPONSE_GENERAL_ERROR;
     }
+    if (mDatabase->isReadOnly(handle))
+        return MTP_RESPONSE_OBJECT_WRITE_PROTECTED;
 
     MtpString path;
     int64_t fileLength;
@@ -1304,6 +2285,7 @@ MtpResponseCode MtpServer::doBeginEditObject() {
     if (result != MTP_RESPONSE_OK)
         return result;
 
+    mFileCache->invalidate(path);
     int fd = open(path.c_str(), O_RDWR | O_EXCL);
     if (fd < 0) {
         LOG(ERROR) << "open failed for " << path.c_str() << " in doBeginEditObject";
@@ -1322,8 +2304,166 @@ MtpResponseCode MtpServer::doEndEditObject() {
         return MTP_RESPONSE_GENERAL_ERROR;
     }
 
-    commitEdit(edit);
+    // the edit is over either way
+    bool committed = commitEdit(edit);
     removeEditObject(handle);
+    return committed ? MTP_RESPONSE_OK : MTP_RESPONSE_GENERAL_ERROR;
+}
+
+MtpResponseCode MtpServer::doGetChanges() {
+    if (!mSessionOpen)
+        return MTP_RESPONSE_SESSION_NOT_OPEN;
+    MtpStorageID storageID = mRequest.getParameter(1);
+    uint64_t token = mRequest.getParameter(2);
+    uint64_t token2 = mRequest.getParameter(3);
+    token |= (token2 << 32);
+    if (!getStorage(storageID))
+        return MTP_RESPONSE_INVALID_STORAGE_ID;
+
+    return mDatabase->getChanges(storageID, token, mData);
+}
+
+MtpResponseCode MtpServer::doGetObjectDigest() {
+    if (!mSessionOpen)
+        return MTP_RESPONSE_SESSION_NOT_OPEN;
+    MtpObjectHandle handle = mRequest.getParameter(1);
+    uint16_t algorithm = mRequest.getParameter(2);
+    uint64_t offset = mRequest.getParameter(3);
+    uint64_t offset2 = mRequest.getParameter(4);
+    offset |= (offset2 << 32);
+    // 0 means up to the end of the object
+    uint64_t length = mRequest.getParameter(5);
+
+    if (!MtpDigest::isSupported(algorithm))
+        return MTP_RESPONSE_INVALID_PARAMETER;
+
+    MtpString pathBuf;
+    int64_t fileLength;
+    MtpObjectFormat format;
+    int result = mDatabase->getObjectFilePath(handle, pathBuf, fileLength, format);
+    if (result != MTP_RESPONSE_OK)
+        return result;
+    if (format == MTP_FORMAT_ASSOCIATION)
+        return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
+
+    const char* filePath = (const char *)pathBuf.c_str();
+    struct stat sstat;
+    if (MtpSplitFile::stat(filePath, &sstat) != 0)
+        return MTP_RESPONSE_GENERAL_ERROR;
+    if (offset > (uint64_t)sstat.st_size)
+        return MTP_RESPONSE_INVALID_PARAMETER;
+
+    // only digests of whole objects are worth remembering
+    bool whole = (offset == 0 && (length == 0 || length >= (uint64_t)sstat.st_size));
+    uint8_t digest[MtpDigest::kMaxSize];
+    uint64_t digestLength = sstat.st_size;
+
+    if (!whole || !mDatabase->getObjectDigest(handle, algorithm, sstat.st_size, sstat.st_mtime, digest)) {
+        result = MtpDigest::digestFile(filePath, algorithm, offset, length, digest, digestLength);
+        if (result != MTP_RESPONSE_OK)
+            return result;
+
+        // not if the file changed while we were reading it
+        struct stat after;
+        if (whole && MtpSplitFile::stat(filePath, &after) == 0
+                && after.st_size == sstat.st_size && after.st_mtime == sstat.st_mtime)
+            mDatabase->setObjectDigest(handle, algorithm, sstat.st_size, sstat.st_mtime, digest);
+    } else {
+        VLOG(2) << "cached digest for handle " << handle;
+    }
+
+    mData.putUInt16(algorithm);
+    mData.putUInt64(offset);
+    mData.putUInt64(digestLength);
+    mData.putAUInt8(digest, MtpDigest::getSize(algorithm));
+    return MTP_RESPONSE_OK;
+}
+
+MtpResponseCode MtpServer::doGetBlockDigests() {
+    if (!mSessionOpen)
+        return MTP_RESPONSE_SESSION_NOT_OPEN;
+    MtpObjectHandle handle = mRequest.getParameter(1);
+    uint32_t blockSize = mRequest.getParameter(2);
+    uint16_t algorithm = mRequest.getParameter(3);
+
+    if (!MtpDigest::isSupported(algorithm) || blockSize < kMinDigestBlockSize)
+        return MTP_RESPONSE_INVALID_PARAMETER;
+
+    MtpString pathBuf;
+    int64_t fileLength;
+    MtpObjectFormat format;
+    int result = mDatabase->getObjectFilePath(handle, pathBuf, fileLength, format);
+    if (result != MTP_RESPONSE_OK)
+        return result;
+    if (format == MTP_FORMAT_ASSOCIATION)
+        return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
+
+    const char* filePath = (const char *)pathBuf.c_str();
+    struct stat sstat;
+    if (MtpSplitFile::stat(filePath, &sstat) != 0)
+        return MTP_RESPONSE_GENERAL_ERROR;
+    // keeps the reply to a sane size
+    if (((uint64_t)sstat.st_size + blockSize - 1) / blockSize > kMaxDigestBlocks)
+        return MTP_RESPONSE_INVALID_PARAMETER;
+
+    std::shared_ptr<const UInt8List> digests =
+            mDatabase->getBlockDigests(handle, algorithm, blockSize, sstat.st_size, sstat.st_mtime);
+    if (!digests) {
+        std::shared_ptr<UInt8List> computed = std::make_shared<UInt8List>();
+        uint64_t length;
+        result = MtpDigest::digestBlocks(filePath, algorithm, blockSize, *computed, length);
+        if (result != MTP_RESPONSE_OK)
+            return result;
+
+        struct stat after;
+        if (length == (uint64_t)sstat.st_size && MtpSplitFile::stat(filePath, &after) == 0
+                && after.st_size == sstat.st_size && after.st_mtime == sstat.st_mtime)
+            mDatabase->setBlockDigests(handle, algorithm, blockSize, sstat.st_size, sstat.st_mtime,
+                                       computed);
+        digests = computed;
+    } else {
+        VLOG(2) << "cached block digests for handle " << handle;
+    }
+
+    mData.putUInt32(blockSize);
+    mData.putUInt16(algorithm);
+    mData.putUInt64(sstat.st_size);
+    // each block is a rolling checksum followed by the strong digest
+    mData.putUInt32(digests->size() / (4 + MtpDigest::getSize(algorithm)));
+    mData.putAUInt8(digests->data(), digests->size());
+    return MTP_RESPONSE_OK;
+}
+
+MtpResponseCode MtpServer::doSetCompression() {
+    if (!mSessionOpen)
+        return MTP_RESPONSE_SESSION_NOT_OPEN;
+    uint16_t compression = mRequest.getParameter(1);
+
+    switch (compression) {
+        case MTP_NX_COMPRESSION_NONE:
+            mCompressor.reset();
+            break;
+        case MTP_NX_COMPRESSION_LZ4:
+            if (!mCompressor)
+                mCompressor.reset(new MtpCompressor(kCompressionThreads));
+            break;
+        default:
+            return MTP_RESPONSE_PARAMETER_NOT_SUPPORTED;
+    }
+    VLOG(2) << "compression " << mCompression << " -> " << compression;
+    mCompression = compression;
+
+    mResponse.setParameter(1, MtpCompressor::kChunkSize);
+    return MTP_RESPONSE_OK;
+}
+
+MtpResponseCode MtpServer::doDumpTrace() {
+    if (!mSessionOpen)
+        return MTP_RESPONSE_SESSION_NOT_OPEN;
+    if (!MtpTrace::dump(MtpTrace::kDefaultPath))
+        return MTP_RESPONSE_GENERAL_ERROR;
+    // written behind the tracked free space
+    invalidateFreeSpace();
     return MTP_RESPONSE_OK;
 }
 
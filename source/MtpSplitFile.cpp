@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "MtpSplitFile"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <switch.h>
+
+#include "MtpSplitFile.h"
+
+#include "log.h"
+
+namespace android {
+
+MtpSplitFile::MtpSplitFile()
+    :   mFlags(0),
+        mSplit(false),
+        mPart(-1),
+        mFD(-1),
+        mOffset(0)
+{
+}
+
+MtpSplitFile::~MtpSplitFile() {
+    close();
+}
+
+bool MtpSplitFile::open(const char* path, int flags) {
+    close();
+    mPath = path;
+    mFlags = flags;
+    mOffset = 0;
+
+    struct stat st;
+    mSplit = (::stat(path, &st) == 0 && S_ISDIR(st.st_mode));
+    if (mSplit)
+        return openPart(0);
+
+    mFD = ::open(path, flags, S_IRUSR | S_IWUSR);
+    mPart = 0;
+    return mFD >= 0;
+}
+
+void MtpSplitFile::close() {
+    if (mFD >= 0)
+        ::close(mFD);
+    mFD = -1;
+    mPart = -1;
+}
+
+ssize_t MtpSplitFile::read(void* buffer, size_t length) {
+    ssize_t ret = mSplit ? pread(buffer, length, mOffset) : ::read(mFD, buffer, length);
+    if (ret > 0)
+        mOffset += ret;
+    return ret;
+}
+
+ssize_t MtpSplitFile::write(const void* buffer, size_t length) {
+    ssize_t ret = mSplit ? pwrite(buffer, length, mOffset) : ::write(mFD, buffer, length);
+    if (ret > 0)
+        mOffset += ret;
+    return ret;
+}
+
+ssize_t MtpSplitFile::pread(void* buffer, size_t length, uint64_t offset) {
+    if (!mSplit)
+        return ::pread(mFD, buffer, length, offset);
+
+    size_t total = 0;
+    while (total < length) {
+        int part = offset / kPartSize;
+        // no such part, the file ends with the one before
+        if (!openPart(part))
+            return (total > 0 || errno == ENOENT) ? (ssize_t)total : -1;
+        size_t count = std::min<uint64_t>(length - total, (part + 1) * kPartSize - offset);
+        ssize_t ret = ::pread(mFD, (uint8_t*)buffer + total, count, offset - part * kPartSize);
+        if (ret < 0)
+            return total > 0 ? (ssize_t)total : -1;
+        total += ret;
+        offset += ret;
+        // and so does a short one
+        if ((size_t)ret < count)
+            break;
+    }
+    return total;
+}
+
+ssize_t MtpSplitFile::pwrite(const void* buffer, size_t length, uint64_t offset) {
+    if (!mSplit)
+        return ::pwrite(mFD, buffer, length, offset);
+
+    size_t total = 0;
+    while (total < length) {
+        int part = offset / kPartSize;
+        if (!openPart(part))
+            return total > 0 ? (ssize_t)total : -1;
+        size_t count = std::min<uint64_t>(length - total, (part + 1) * kPartSize - offset);
+        ssize_t ret = ::pwrite(mFD, (const uint8_t*)buffer + total, count, offset - part * kPartSize);
+        if (ret <= 0)
+            return total > 0 ? (ssize_t)total : -1;
+        total += ret;
+        offset += ret;
+    }
+    return total;
+}
+
+bool MtpSplitFile::seek(uint64_t offset) {
+    mOffset = offset;
+    // parts are read and written at an offset of their own
+    return mSplit || lseek(mFD, offset, SEEK_SET) == (off_t)offset;
+}
+
+int MtpSplitFile::fsync() {
+    return mFD >= 0 ? ::fsync(mFD) : 0;
+}
+
+int MtpSplitFile::fstat(struct stat* st) {
+    return mSplit ? stat(mPath.c_str(), st) : ::fstat(mFD, st);
+}
+
+bool MtpSplitFile::openPart(int part) {
+    if (mPart == part)
+        return true;
+    close();
+
+    // what is already there of a part is never thrown away
+    mFD = ::open(getPartPath(mPath, part).c_str(), mFlags & ~(O_TRUNC | O_EXCL), S_IRUSR | S_IWUSR);
+    if (mFD < 0)
+        return false;
+    mPart = part;
+    return true;
+}
+
+std::string MtpSplitFile::getPartPath(const std::string& path, int part) {
+    char name[16];
+    snprintf(name, sizeof(name), "/%02d", part);
+    return path + name;
+}
+
+int MtpSplitFile::countParts(const char* path) {
+    // a cheap test first, most directories are just that
+    struct stat st;
+    if (::stat(getPartPath(path, 0).c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+        return 0;
+
+    DIR* dir = opendir(path);
+    if (!dir)
+        return 0;
+
+    // the names are unique, so n entries numbered below n are 00 to n-1
+    int count = 0;
+    int highest = -1;
+    bool parts = true;
+    struct dirent* entry;
+    while (parts && (entry = readdir(dir))) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+        char* end;
+        long part = strtol(entry->d_name, &end, 10);
+        char name[16];
+        snprintf(name, sizeof(name), "%02ld", part);
+        parts = (*end == 0 && part >= 0 && !strcmp(name, entry->d_name));
+        highest = std::max<int>(highest, part);
+        count++;
+    }
+    closedir(dir);
+
+    return (parts && highest == count - 1) ? count : 0;
+}
+
+int MtpSplitFile::stat(const char* path, struct stat* st) {
+    int ret = ::stat(path, st);
+    if (ret != 0 || !S_ISDIR(st->st_mode))
+        return ret;
+    int parts = countParts(path);
+    if (parts == 0)
+        return ret;
+
+    st->st_mode = (st->st_mode & ~S_IFMT) | S_IFREG;
+    st->st_size = 0;
+    for (int i = 0; i < parts; i++) {
+        struct stat part;
+        if (::stat(getPartPath(path, i).c_str(), &part) != 0)
+            return -1;
+        st->st_size += part.st_size;
+        st->st_mtime = std::max(st->st_mtime, part.st_mtime);
+    }
+    return 0;
+}
+
+bool MtpSplitFile::create(const char* path) {
+    if (remove(path) != 0 && errno != ENOENT)
+        return false;
+    if (mkdir(path, 0777) != 0)
+        return false;
+    // only Horizon itself cares, reading and writing goes through the parts
+    if (R_FAILED(fsdevSetConcatenationFileAttribute(path)))
+        LOG(WARNING) << "could not set the archive bit of " << path;
+    return true;
+}
+
+int MtpSplitFile::remove(const char* path) {
+    struct stat st;
+    if (::stat(path, &st) != 0)
+        return -1;
+    if (!S_ISDIR(st.st_mode))
+        return unlink(path);
+
+    int parts = countParts(path);
+    for (int i = 0; i < parts; i++) {
+        if (unlink(getPartPath(path, i).c_str()) != 0)
+            return -1;
+    }
+    return rmdir(path);
+}
+
+}  // namespace android
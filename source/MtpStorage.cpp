@@ -30,6 +30,10 @@
 #include "MtpStorage.h"
 #include "log.h"
 
+// the cluster size of a 32GB SD card formatted by the console, for when the
+// file system does not tell
+#define DEFAULT_CLUSTER_SIZE    (32 * 1024)
+
 namespace android {
 
 MtpStorage::MtpStorage(MtpStorageID id, const char* filePath,
@@ -41,9 +45,17 @@ MtpStorage::MtpStorage(MtpStorageID id, const char* filePath,
         mMaxCapacity(0),
         mMaxFileSize(maxFileSize),
         mReserveSpace(reserveSpace),
-        mRemovable(removable)
+        mRemovable(removable),
+        mFreeSpace(-1),
+        mClusterSize(DEFAULT_CLUSTER_SIZE),
+        mReconciled(0)
 {
-    VLOG(2) << "MtpStorage id: " << id << " path: " << filePath;
+    // I/O is sized to clusters from the start
+    struct statvfs   stat;
+    if (statvfs(filePath, &stat) == 0 && stat.f_bsize > 1)
+        mClusterSize = stat.f_bsize;
+    VLOG(2) << "MtpStorage id: " << id << " path: " << filePath
+            << " cluster size: " << mClusterSize;
 }
 
 MtpStorage::~MtpStorage() {
@@ -72,11 +84,39 @@ uint64_t MtpStorage::getMaxCapacity() {
 }
 
 uint64_t MtpStorage::getFreeSpace() {
+    if (mReconciled == 0 || mFreeSpace < 0)
+        reconcileFreeSpace(0);
+    int64_t freeSpace = mFreeSpace;
+    if (freeSpace < 0)
+        return -1;
+    return ((uint64_t)freeSpace > mReserveSpace ? freeSpace - mReserveSpace : 0);
+}
+
+void MtpStorage::reconcileFreeSpace(std::time_t interval) {
+    std::time_t now = std::time(nullptr);
+    if (mReconciled != 0 && now - mReconciled < interval)
+        return;
+
     struct statvfs   stat;
     if (statvfs(getPath(), &stat))
-        return -1;
-    uint64_t freeSpace = (uint64_t)stat.f_bavail * (uint64_t)stat.f_bsize;
-    return (freeSpace > mReserveSpace ? freeSpace - mReserveSpace : 0);
+        return;
+    int64_t freeSpace = (uint64_t)stat.f_bavail * (uint64_t)stat.f_bsize;
+    if (stat.f_bsize > 1)
+        mClusterSize = stat.f_bsize;
+    VLOG(2) << "free space of " << getPath() << ": " << freeSpace
+            << ", tracked " << mFreeSpace;
+    mFreeSpace = freeSpace;
+    mReconciled = now;
+}
+
+void MtpStorage::fileResized(uint64_t oldSize, uint64_t newSize) {
+    // files take whole clusters
+    int64_t oldClusters = (oldSize + mClusterSize - 1) / mClusterSize;
+    int64_t newClusters = (newSize + mClusterSize - 1) / mClusterSize;
+    if (oldClusters == newClusters || mFreeSpace < 0)
+        return;
+    int64_t freeSpace = mFreeSpace - (newClusters - oldClusters) * (int64_t)mClusterSize;
+    mFreeSpace = freeSpace > 0 ? freeSpace : 0;
 }
 
 const char* MtpStorage::getDescription() const {
@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "MtpTrace"
+
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+
+#include "MtpTrace.h"
+
+#include "log.h"
+
+namespace android {
+
+// A slot is rewritten in place, so its sequence is cleared while that
+// happens and set to the position of the event once it is complete. The
+// fields are atomic only so that dump() can read them while they change.
+struct TraceEvent {
+    std::atomic<uint64_t>       mSequence;
+    std::atomic<const char*>    mCategory;
+    std::atomic<const char*>    mName;
+    std::atomic<uint64_t>       mStart;
+    std::atomic<uint64_t>       mDuration;
+    std::atomic<uint64_t>       mArg;
+    std::atomic<uint32_t>       mThread;
+};
+
+static TraceEvent               sEvents[MtpTrace::kMaxEvents];
+// position of the next event, the first is 1 so that 0 is never complete
+static std::atomic<uint64_t>    sNext(1);
+static std::atomic<uint32_t>    sThreads(0);
+static thread_local uint32_t    sThread = 0;
+
+uint64_t MtpTrace::now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void MtpTrace::record(const char* category, const char* name,
+                      uint64_t start, uint64_t end, uint64_t arg) {
+    if (sThread == 0)
+        sThread = ++sThreads;
+
+    uint64_t pos = sNext.fetch_add(1, std::memory_order_relaxed);
+    TraceEvent& event = sEvents[pos % kMaxEvents];
+    event.mSequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    event.mCategory.store(category, std::memory_order_relaxed);
+    event.mName.store(name, std::memory_order_relaxed);
+    event.mStart.store(start, std::memory_order_relaxed);
+    event.mDuration.store(end - start, std::memory_order_relaxed);
+    event.mArg.store(arg, std::memory_order_relaxed);
+    event.mThread.store(sThread, std::memory_order_relaxed);
+    event.mSequence.store(pos, std::memory_order_release);
+}
+
+bool MtpTrace::dump(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        LOG(ERROR) << "could not open " << path;
+        return false;
+    }
+
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", file);
+    uint64_t end = sNext.load(std::memory_order_acquire);
+    uint64_t pos = end > kMaxEvents ? end - kMaxEvents : 1;
+    int count = 0;
+    for (; pos < end; pos++) {
+        TraceEvent& event = sEvents[pos % kMaxEvents];
+        if (event.mSequence.load(std::memory_order_acquire) != pos)
+            continue;
+        const char* category = event.mCategory.load(std::memory_order_relaxed);
+        const char* name = event.mName.load(std::memory_order_relaxed);
+        uint64_t start = event.mStart.load(std::memory_order_relaxed);
+        uint64_t duration = event.mDuration.load(std::memory_order_relaxed);
+        uint64_t arg = event.mArg.load(std::memory_order_relaxed);
+        uint32_t thread = event.mThread.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        // rewritten while it was read
+        if (event.mSequence.load(std::memory_order_relaxed) != pos)
+            continue;
+
+        fprintf(file, "%s\n{\"cat\":\"%s\",\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%" PRIu32
+                ",\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 ",\"args\":{\"arg\":%" PRIu64 "}}",
+                count > 0 ? "," : "", category, name, thread, start, duration, arg);
+        count++;
+    }
+    fputs("\n]}\n", file);
+
+    bool result = (ferror(file) == 0);
+    if (fclose(file) != 0)
+        result = false;
+    if (result)
+        VLOG(1) << "wrote " << count << " trace events to " << path;
+    else
+        LOG(ERROR) << "could not write " << path;
+    return result;
+}
+
+}  // namespace android
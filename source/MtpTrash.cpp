@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "MtpTrash"
+
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <switch.h>
+
+#include "MtpIoScheduler.h"
+#include "MtpTrash.h"
+#include "MtpUtils.h"
+
+#include "log.h"
+
+#define TRASH_DIRECTORY_NAME    "trash"
+// lowest priority of a user thread, the purge only runs when nothing else does
+#define PURGE_THREAD_PRIORITY   0x3F
+
+namespace android {
+
+MtpTrash::MtpTrash(MtpIoScheduler* scheduler)
+    :   mScheduler(scheduler),
+        mSequence(0),
+        mRunning(true)
+{
+    mThread = std::thread(&MtpTrash::run, this);
+}
+
+MtpTrash::~MtpTrash() {
+    {
+        MtpAutolock autoLock(mMutex);
+        mRunning = false;
+    }
+    mChanged.notify_all();
+    mThread.join();
+}
+
+void MtpTrash::addRoot(const MtpString& root) {
+    MtpString path = root;
+    if (path.empty() || path[path.size() - 1] != '/')
+        path += "/";
+    {
+        MtpAutolock autoLock(mMutex);
+        mRoots.push_back(path);
+        // left over from before a restart
+        mDirty.push_back(path);
+    }
+    mChanged.notify_all();
+}
+
+void MtpTrash::removeRoot(const MtpString& root) {
+    MtpString path = root;
+    if (path.empty() || path[path.size() - 1] != '/')
+        path += "/";
+
+    MtpAutolock autoLock(mMutex);
+    for (size_t i = 0; i < mRoots.size(); i++) {
+        if (mRoots[i] == path) {
+            mRoots.erase(mRoots.begin() + i);
+            break;
+        }
+    }
+    for (size_t i = 0; i < mDirty.size(); i++) {
+        if (mDirty[i] == path) {
+            mDirty.erase(mDirty.begin() + i);
+            break;
+        }
+    }
+    for (size_t i = 0; i < mPurged.size(); i++) {
+        if (mPurged[i] == path) {
+            mPurged.erase(mPurged.begin() + i);
+            break;
+        }
+    }
+}
+
+bool MtpTrash::remove(const MtpString& path) {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    MtpString root;
+    for (size_t i = 0; i < mRoots.size(); i++) {
+        if (path.compare(0, mRoots[i].size(), mRoots[i]) == 0 && mRoots[i].size() > root.size())
+            root = mRoots[i];
+    }
+
+    if (!root.empty()) {
+        MtpString trash = getTrashPath(root);
+        mkdir((root + MTP_STATE_DIRECTORY).c_str(), 0777);
+        mkdir(trash.c_str(), 0777);
+
+        // unique across restarts, the trash may not be empty yet
+        char name[32];
+        snprintf(name, sizeof(name), "/%08lx-%08x", (unsigned long)time(NULL), mSequence++);
+        if (::rename(path.c_str(), (trash + name).c_str()) == 0) {
+            mDirty.push_back(root);
+            lock.unlock();
+            mChanged.notify_all();
+            return true;
+        }
+        LOG(WARNING) << "could not move " << path << " to the trash";
+    }
+
+    lock.unlock();
+    purge(path, false);
+    return false;
+}
+
+bool MtpTrash::takePurged(const MtpString& root) {
+    MtpString path = root;
+    if (path.empty() || path[path.size() - 1] != '/')
+        path += "/";
+
+    MtpAutolock autoLock(mMutex);
+    for (size_t i = 0; i < mPurged.size(); i++) {
+        if (mPurged[i] == path) {
+            mPurged.erase(mPurged.begin() + i);
+            return true;
+        }
+    }
+    return false;
+}
+
+void MtpTrash::run() {
+    svcSetThreadPriority(CUR_THREAD_HANDLE, PURGE_THREAD_PRIORITY);
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (mRunning) {
+        if (mDirty.empty()) {
+            mChanged.wait(lock);
+            continue;
+        }
+        MtpString root = mDirty.back();
+        MtpString trash = getTrashPath(root);
+        mDirty.pop_back();
+        lock.unlock();
+
+        bool purged = false;
+        DIR* dir = schedule(true) ? opendir(trash.c_str()) : NULL;
+        if (dir) {
+            struct dirent* entry;
+            while (mRunning && (entry = readdir(dir))) {
+                const char* name = entry->d_name;
+                if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+                    continue;
+                VLOG(2) << "purging " << trash << "/" << name;
+                // some of it may be gone even if the purge stops early
+                purged = true;
+                if (!purge(trash + "/" + name, true))
+                    break;
+            }
+            closedir(dir);
+        }
+
+        lock.lock();
+        if (purged && std::find(mPurged.begin(), mPurged.end(), root) == mPurged.end())
+            mPurged.push_back(root);
+    }
+}
+
+bool MtpTrash::purge(const MtpString& path, bool background) {
+    if (!schedule(background))
+        return false;
+    struct stat statbuf;
+    if (stat(path.c_str(), &statbuf) != 0) {
+        LOG(ERROR) << "purge stat failed for " << path;
+        return true;
+    }
+    if (!S_ISDIR(statbuf.st_mode)) {
+        unlink(path.c_str());
+        return true;
+    }
+
+    DIR* dir = opendir(path.c_str());
+    if (!dir) {
+        LOG(ERROR) << "opendir " << path << " failed";
+        return true;
+    }
+
+    bool done = true;
+    struct dirent* entry;
+    while ((entry = readdir(dir))) {
+        const char* name = entry->d_name;
+
+        // ignore "." and ".."
+        if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+            continue;
+        if (!mRunning) {
+            done = false;
+            break;
+        }
+
+        MtpString child = path + "/" + name;
+        if (entry->d_type == DT_DIR) {
+            if (!purge(child, background)) {
+                done = false;
+                break;
+            }
+        } else if (schedule(background)) {
+            unlink(child.c_str());
+        } else {
+            done = false;
+            break;
+        }
+    }
+    closedir(dir);
+
+    if (done)
+        rmdir(path.c_str());
+    return done;
+}
+
+bool MtpTrash::schedule(bool background) {
+    return !background || mScheduler->acquireBackground(mRunning);
+}
+
+MtpString MtpTrash::getTrashPath(const MtpString& root) {
+    return root + MTP_STATE_DIRECTORY "/" TRASH_DIRECTORY_NAME;
+}
+
+}  // namespace android
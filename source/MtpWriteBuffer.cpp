@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "MtpWriteBuffer"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <malloc.h>
+#include <unistd.h>
+
+#include "MtpSplitFile.h"
+#include "MtpWriteBuffer.h"
+
+#include "log.h"
+
+namespace android {
+
+MtpWriteBuffer::MtpWriteBuffer(int fd, uint64_t clusterSize)
+    :   mFD(fd),
+        mFile(NULL),
+        mClusterSize(clusterSize > 0 ? clusterSize : 1),
+        mData(NULL),
+        mOffset(0),
+        mLength(0)
+{
+}
+
+MtpWriteBuffer::MtpWriteBuffer(MtpSplitFile* file, uint64_t clusterSize)
+    :   mFD(-1),
+        mFile(file),
+        mClusterSize(clusterSize > 0 ? clusterSize : 1),
+        mData(NULL),
+        mOffset(0),
+        mLength(0)
+{
+}
+
+MtpWriteBuffer::~MtpWriteBuffer() {
+    free(mData);
+}
+
+ssize_t MtpWriteBuffer::pwrite(const void* data, size_t length, uint64_t offset) {
+    if (!mData) {
+        mData = (uint8_t*)memalign(0x1000, kCapacity);
+        // write through rather than fail
+        if (!mData)
+            return writeOut((const uint8_t*)data, length, offset) ? (ssize_t)length : -1;
+    }
+
+    const uint8_t* src = (const uint8_t*)data;
+    size_t remaining = length;
+    while (remaining > 0) {
+        if (mLength > 0 && (offset < mOffset || offset > mOffset + mLength)) {
+            if (!flush())
+                return -1;
+        }
+        if (mLength == 0)
+            mOffset = offset;
+
+        size_t start = offset - mOffset;
+        if (start == kCapacity) {
+            if (!flushClusters())
+                return -1;
+            continue;
+        }
+        size_t count = remaining < kCapacity - start ? remaining : kCapacity - start;
+        memcpy(mData + start, src, count);
+        if (start + count > mLength)
+            mLength = start + count;
+        src += count;
+        offset += count;
+        remaining -= count;
+    }
+    return length;
+}
+
+bool MtpWriteBuffer::flush() {
+    size_t length = mLength;
+    mLength = 0;
+    return length == 0 || writeOut(mData, length, mOffset);
+}
+
+bool MtpWriteBuffer::release() {
+    bool result = flush();
+    free(mData);
+    mData = NULL;
+    return result;
+}
+
+bool MtpWriteBuffer::flushClusters() {
+    uint64_t end = mOffset + mLength;
+    uint64_t boundary = end - end % mClusterSize;
+    if (boundary <= mOffset)
+        return flush();
+
+    size_t length = boundary - mOffset;
+    bool result = writeOut(mData, length, mOffset);
+    memmove(mData, mData + length, mLength - length);
+    mOffset = boundary;
+    mLength -= length;
+    if (!result)
+        mLength = 0;
+    return result;
+}
+
+bool MtpWriteBuffer::writeOut(const uint8_t* data, size_t length, uint64_t offset) {
+    while (length > 0) {
+        ssize_t ret = mFile ? mFile->pwrite(data, length, offset)
+                            : ::pwrite(mFD, data, length, offset);
+        if (ret <= 0) {
+            if (ret == 0)
+                errno = EIO;
+            int error = errno;
+            LOG(ERROR) << "write-back of " << length << " bytes at " << offset
+                       << " failed: " << strerror(error);
+            errno = error;
+            return false;
+        }
+        data += ret;
+        offset += ret;
+        length -= ret;
+    }
+    return true;
+}
+
+}  // namespace android
@@ -14,13 +14,33 @@
  * limitations under the License.
  */
 
+#define LOG_TAG "USBMtpInterface"
+
+#include <errno.h>
+
+#include "MtpMetrics.h"
+#include "MtpTrace.h"
 #include "USBMtpInterface.h"
+#include "mtp.h"
+
+#include "log.h"
 
 #define EP_IN 0
 #define EP_OUT 1
 #define EP_INT 2
 
+// class requests of the Still Image Capture Device class
+#define MTP_REQ_CANCEL              0x64
+#define MTP_REQ_DEVICE_RESET        0x66
+#define MTP_REQ_GET_DEVICE_STATUS   0x67
+
+#define MTP_CANCELLATION_CODE       0x4001
+
+// how long stopControl() may wait for the control thread
+#define CONTROL_POLL_TIMEOUT        100000000LL
+
 USBMtpInterface::USBMtpInterface(int index, UsbInterfaceDesc *info)
+    : control_running(false), reset_pending(false)
 {
     interface_index = index;
     info->interface_desc = &mtp_interface_descriptor;
@@ -31,17 +51,124 @@ USBMtpInterface::USBMtpInterface(int index, UsbInterfaceDesc *info)
 }
 
 USBMtpInterface::~USBMtpInterface() {
+    stopControl();
 }
 
 ssize_t USBMtpInterface::read(char *ptr, size_t len)
 {
-    return usbTransfer(interface_index, EP_OUT, UsbDirection_Read, (void*)ptr, len, 1000000000LL);
+    android::MtpTrace::Span span("usb", "read", len);
+    ssize_t ret = checkCancelled(usbTransfer(interface_index, EP_OUT, UsbDirection_Read, (void*)ptr, len, 1000000000LL));
+    if (ret > 0)
+        android::MtpMetrics::addBytesIn(ret);
+    return ret;
 }
 ssize_t USBMtpInterface::write(const char *ptr, size_t len)
 {
-    return usbTransfer(interface_index, EP_IN, UsbDirection_Write, (void*)ptr, len, UINT64_MAX);
+    android::MtpTrace::Span span("usb", "write", len);
+    ssize_t ret = checkCancelled(usbTransfer(interface_index, EP_IN, UsbDirection_Write, (void*)ptr, len, UINT64_MAX));
+    if (ret > 0)
+        android::MtpMetrics::addBytesOut(ret);
+    return ret;
 }
 ssize_t USBMtpInterface::sendEvent(const char *ptr, size_t len)
 {
     return usbTransfer(interface_index, EP_INT, UsbDirection_Write, (void*)ptr, len, UINT64_MAX);
-}
\ No newline at end of file
+}
+
+void USBMtpInterface::startControl()
+{
+    if (control_running)
+        return;
+    control_running = true;
+    control_thread = std::thread(&USBMtpInterface::controlLoop, this);
+}
+
+void USBMtpInterface::stopControl()
+{
+    if (!control_running)
+        return;
+    control_running = false;
+    control_thread.join();
+}
+
+bool USBMtpInterface::takeReset()
+{
+    return reset_pending.exchange(false);
+}
+
+void USBMtpInterface::controlLoop()
+{
+    UsbControlRequest request;
+    while (control_running) {
+        if (R_SUCCEEDED(usbWaitControlRequest(interface_index, &request, CONTROL_POLL_TIMEOUT)))
+            handleControl(request);
+    }
+}
+
+void USBMtpInterface::handleControl(const UsbControlRequest& request)
+{
+    // class requests to the interface, anything else is not ours
+    if ((request.bmRequestType & 0x7F) != 0x21) {
+        usbStallControl(interface_index);
+        return;
+    }
+
+    switch (request.bRequest) {
+        case MTP_REQ_CANCEL: {
+            // cancellation code and the id of the transaction
+            uint8_t data[6];
+            if (request.wLength != sizeof(data)
+                    || R_FAILED(usbControlTransfer(interface_index, UsbDirection_Read, data, sizeof(data)))) {
+                usbStallControl(interface_index);
+                break;
+            }
+            uint16_t code = data[0] | (data[1] << 8);
+            uint32_t transaction = data[2] | (data[3] << 8) | (data[4] << 16) | ((uint32_t)data[5] << 24);
+            if (code != MTP_CANCELLATION_CODE) {
+                usbStallControl(interface_index);
+                break;
+            }
+            cancelTransfers();
+            usbControlTransfer(interface_index, UsbDirection_Write, NULL, 0);
+            VLOG(2) << "host cancelled transaction " << transaction;
+            break;
+        }
+        case MTP_REQ_DEVICE_RESET:
+            reset_pending = true;
+            cancelTransfers();
+            usbControlTransfer(interface_index, UsbDirection_Write, NULL, 0);
+            VLOG(2) << "host reset the device";
+            break;
+        case MTP_REQ_GET_DEVICE_STATUS: {
+            // busy until the request thread has given up the cancelled transfer
+            uint16_t code = usbIsCancelled(interface_index, EP_IN) || usbIsCancelled(interface_index, EP_OUT)
+                    ? MTP_RESPONSE_DEVICE_BUSY : MTP_RESPONSE_OK;
+            uint8_t status[4] = { 4, 0, (uint8_t)(code & 0xFF), (uint8_t)(code >> 8) };
+            size_t length = request.wLength < sizeof(status) ? request.wLength : sizeof(status);
+            if (R_SUCCEEDED(usbControlTransfer(interface_index, UsbDirection_Write, status, length)))
+                usbControlTransfer(interface_index, UsbDirection_Read, NULL, 0);
+            break;
+        }
+        default:
+            usbStallControl(interface_index);
+            break;
+    }
+}
+
+void USBMtpInterface::cancelTransfers()
+{
+    usbCancel(interface_index, EP_IN);
+    usbCancel(interface_index, EP_OUT);
+}
+
+// A transfer cut short by a cancellation fails with ECANCELED, and the
+// cancellation ends with it, like STATE_CANCELED in the Android driver.
+ssize_t USBMtpInterface::checkCancelled(ssize_t ret)
+{
+    if (!usbIsCancelled(interface_index, EP_IN) && !usbIsCancelled(interface_index, EP_OUT))
+        return ret;
+    usbClearCancel(interface_index, EP_IN);
+    usbClearCancel(interface_index, EP_OUT);
+    errno = ECANCELED;
+    return -1;
+}
@@ -14,6 +14,13 @@
  * limitations under the License.
  */
 
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
 #include "log.h"
 
 int verbose_level = 0;
@@ -25,4 +32,266 @@ char log_level_color[5][16] =
   "\033[93m", // Yellow
   "\033[31m", // Red
   "\033[35m"  // Purple
-};
\ No newline at end of file
+};
+
+// messages waiting to be written out, a power of two
+#define QUEUE_SLOTS             512
+// formatted messages go out in writes of up to this much
+#define WRITE_BUFFER_SIZE       4096
+// how long the writer sleeps once the queue is empty
+#define IDLE_SLEEP_MS           10
+
+// A bounded queue that any thread can add to without a lock, and the
+// writer thread takes from. A slot is free for the producer of position
+// p once its sequence is p, and ready for the writer once it is p + 1.
+struct LogSlot {
+    std::atomic<size_t>     mSequence;
+    size_t                  mLength;
+    uint8_t                 mData[LogMessage::kMaxSize];
+};
+
+static LogSlot              sSlots[QUEUE_SLOTS];
+static std::atomic<size_t>  sEnqueue(0);
+static size_t               sDequeue = 0;
+static std::atomic<bool>    sQueueReady(false);
+// messages dropped since the writer last said so
+static std::atomic<uint64_t> sDropped(0);
+
+static std::atomic<bool>    sRunning(false);
+static std::thread          sThread;
+static FILE*                sFile = NULL;
+
+static bool enqueue(const uint8_t* data, size_t length) {
+    size_t pos = sEnqueue.load(std::memory_order_relaxed);
+    LogSlot* slot;
+    for (;;) {
+        slot = &sSlots[pos % QUEUE_SLOTS];
+        size_t sequence = slot->mSequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) {
+            if (sEnqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = sEnqueue.load(std::memory_order_relaxed);
+        }
+    }
+    memcpy(slot->mData, data, length);
+    slot->mLength = length;
+    slot->mSequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+// appends a message to buffer as the stream used to print it
+static size_t format(const uint8_t* data, size_t length, char* buffer, size_t size) {
+    size_t used = 0;
+    bool hex = false;
+    int level = data[0];
+    int ret = snprintf(buffer, size, "\n%s", nxlink ? log_level_color[level] : "");
+    used += ret;
+
+    size_t i = 1;
+    while (i < length && used < size) {
+        uint8_t tag = data[i++];
+        char* out = buffer + used;
+        size_t room = size - used;
+        uint64_t value = 0;
+        double number;
+        switch (tag) {
+            case LogMessage::TAG_SIGNED:
+                memcpy(&value, data + i, sizeof(value));
+                i += sizeof(value);
+                ret = snprintf(out, room, hex ? "%" PRIx64 : "%" PRId64, value);
+                break;
+            case LogMessage::TAG_UNSIGNED:
+                memcpy(&value, data + i, sizeof(value));
+                i += sizeof(value);
+                ret = snprintf(out, room, hex ? "%" PRIx64 : "%" PRIu64, value);
+                break;
+            case LogMessage::TAG_DOUBLE:
+                memcpy(&number, data + i, sizeof(number));
+                i += sizeof(number);
+                ret = snprintf(out, room, "%g", number);
+                break;
+            case LogMessage::TAG_POINTER:
+                memcpy(&value, data + i, sizeof(value));
+                i += sizeof(value);
+                ret = snprintf(out, room, "0x%" PRIx64, value);
+                break;
+            case LogMessage::TAG_CHAR:
+                out[0] = data[i++];
+                ret = 1;
+                break;
+            case LogMessage::TAG_STRING: {
+                size_t count = data[i] | (data[i + 1] << 8);
+                i += 2;
+                ret = count < room ? count : room;
+                memcpy(out, data + i, ret);
+                i += count;
+                break;
+            }
+            case LogMessage::TAG_HEX:
+                hex = true;
+                ret = 0;
+                break;
+            case LogMessage::TAG_DEC:
+                hex = false;
+                ret = 0;
+                break;
+            default:
+                ret = 0;
+                i = length;
+                break;
+        }
+        used += (size_t)ret < room ? ret : room;
+    }
+    return used < size ? used : size;
+}
+
+static void output(const char* data, size_t length) {
+    if (length == 0)
+        return;
+    FILE* file = sFile ? sFile : stdout;
+    fwrite(data, 1, length, file);
+    fflush(file);
+}
+
+// writes out what is queued, false if there was nothing
+static bool drain() {
+    char buffer[WRITE_BUFFER_SIZE];
+    size_t used = 0;
+    bool drained = false;
+
+    uint64_t dropped = sDropped.exchange(0);
+    if (dropped > 0)
+        used += snprintf(buffer, sizeof(buffer), "\n%" PRIu64 " log messages dropped", dropped);
+
+    for (;;) {
+        LogSlot* slot = &sSlots[sDequeue % QUEUE_SLOTS];
+        if (slot->mSequence.load(std::memory_order_acquire) != sDequeue + 1)
+            break;
+        // a formatted message is well under WRITE_BUFFER_SIZE
+        if (sizeof(buffer) - used < LogMessage::kMaxSize * 3) {
+            output(buffer, used);
+            used = 0;
+        }
+        used += format(slot->mData, slot->mLength, buffer + used, sizeof(buffer) - used);
+        slot->mSequence.store(sDequeue + QUEUE_SLOTS, std::memory_order_release);
+        sDequeue++;
+        drained = true;
+    }
+    output(buffer, used);
+    return drained;
+}
+
+static void run() {
+    while (sRunning) {
+        if (!drain())
+            std::this_thread::sleep_for(std::chrono::milliseconds(IDLE_SLEEP_MS));
+    }
+    drain();
+}
+
+void logStart(const char* path) {
+    if (path) {
+        sFile = fopen(path, "a");
+        if (!sFile)
+            LOG(ERROR) << "could not open log file " << path;
+    }
+    for (size_t i = 0; i < QUEUE_SLOTS; i++)
+        sSlots[i].mSequence.store(i, std::memory_order_relaxed);
+    sEnqueue = 0;
+    sDequeue = 0;
+    sQueueReady = true;
+    sRunning = true;
+    sThread = std::thread(run);
+}
+
+void logStop() {
+    if (!sRunning)
+        return;
+    sRunning = false;
+    sThread.join();
+    sQueueReady = false;
+    if (sFile) {
+        fclose(sFile);
+        sFile = NULL;
+    }
+}
+
+LogMessage::LogMessage(int level)
+    :   mLength(1)
+{
+    mData[0] = level;
+}
+
+LogMessage::~LogMessage() {
+    // not started or already stopped, the caller writes it out itself
+    if (!sQueueReady) {
+        char buffer[LogMessage::kMaxSize * 3];
+        output(buffer, format(mData, mLength, buffer, sizeof(buffer)));
+    } else if (!enqueue(mData, mLength)) {
+        sDropped++;
+    }
+}
+
+LogMessage& LogMessage::operator<<(const char* value) {
+    if (!value)
+        value = "(null)";
+    size_t length = strlen(value);
+    // whatever fits
+    if (mLength + 3 + length > kMaxSize)
+        length = mLength + 3 < kMaxSize ? kMaxSize - mLength - 3 : 0;
+    if (mLength + 3 > kMaxSize)
+        return *this;
+    mData[mLength] = TAG_STRING;
+    mData[mLength + 1] = length & 0xFF;
+    mData[mLength + 2] = length >> 8;
+    memcpy(mData + mLength + 3, value, length);
+    mLength += 3 + length;
+    return *this;
+}
+
+LogMessage& LogMessage::operator<<(const std::string& value) {
+    return *this << value.c_str();
+}
+
+LogMessage& LogMessage::operator<<(char value) {
+    return put(TAG_CHAR, &value, 1);
+}
+
+LogMessage& LogMessage::operator<<(double value) {
+    return put(TAG_DOUBLE, &value, sizeof(value));
+}
+
+LogMessage& LogMessage::operator<<(const void* value) {
+    uint64_t address = (uintptr_t)value;
+    return put(TAG_POINTER, &address, sizeof(address));
+}
+
+LogMessage& LogMessage::operator<<(std::ios_base& (*manipulator)(std::ios_base&)) {
+    if (manipulator == static_cast<std::ios_base& (*)(std::ios_base&)>(std::hex))
+        return put(TAG_HEX, NULL, 0);
+    if (manipulator == static_cast<std::ios_base& (*)(std::ios_base&)>(std::dec))
+        return put(TAG_DEC, NULL, 0);
+    return *this;
+}
+
+LogMessage& LogMessage::putSigned(int64_t value) {
+    return put(TAG_SIGNED, &value, sizeof(value));
+}
+
+LogMessage& LogMessage::putUnsigned(uint64_t value) {
+    return put(TAG_UNSIGNED, &value, sizeof(value));
+}
+
+LogMessage& LogMessage::put(Tag tag, const void* value, size_t length) {
+    if (mLength + 1 + length > kMaxSize)
+        return *this;
+    mData[mLength] = tag;
+    if (length > 0)
+        memcpy(mData + mLength + 1, value, length);
+    mLength += 1 + length;
+    return *this;
+}
@@ -24,6 +24,7 @@
 #include "SwitchMtpDatabase.h"
 #include "MtpServer.h"
 #include "MtpStorage.h"
+#include "MtpTrace.h"
 
 #include "log.h"
 
@@ -103,6 +104,8 @@ static void stop_thread(MtpServer* server)
             server->stop();
             break;
         }
+        if (kDown & HidNpadButton_Y)
+            MtpTrace::dump(MtpTrace::kDefaultPath);
     }
 #endif // WANT_APPLET
 
@@ -114,17 +117,23 @@ static void stop_thread(MtpServer* server)
 int main(int argc, char* argv[])
 {
     int c;
+    // log file, instead of the console or nxlink
+    const char* log_path = NULL;
+    // uploads are digested while they are received, unless turned off
+    int no_upload_digests = 0;
     struct option long_options[] =
     {
       {"nxlink",  no_argument,       &nxlink, 1},
       {"verbose", required_argument, 0, 'v'},
+      {"log",     required_argument, 0, 'l'},
+      {"no-upload-digests", no_argument, &no_upload_digests, 1},
       {0, 0, 0, 0}
     };
 
     while(1)
     {
         int option_index = 0;
-        c = getopt_long (argc, argv, "v:", long_options, &option_index);
+        c = getopt_long (argc, argv, "v:l:", long_options, &option_index);
         if (c == -1)
             break;
 
@@ -133,6 +142,9 @@ int main(int argc, char* argv[])
             case 'v':
               verbose_level = atoi(optarg);
               break;
+            case 'l':
+              log_path = optarg;
+              break;
             default:
               break;
         }
@@ -141,7 +153,8 @@ int main(int argc, char* argv[])
 #ifdef WANT_APPLET
     consoleInit(NULL);
     std::cout << "MTP Server is running." << std::endl;
-    std::cout << "> Press B to exit.";
+    std::cout << "> Press B to exit." << std::endl;
+    std::cout << "> Press Y to save a trace to " << MtpTrace::kDefaultPath;
 #endif // WANT_APPLET
 
     struct usb_device_descriptor device_descriptor = {
@@ -174,6 +187,7 @@ int main(int argc, char* argv[])
 
     usbInitialize(&device_descriptor, num_interface, infos);
     nxlinkStdioInitialise(serial_interface);
+    logStart(log_path);
 
     MtpStorage* storage = new MtpStorage(
       MTP_STORAGE_REMOVABLE_RAM,
@@ -181,7 +195,7 @@ int main(int argc, char* argv[])
       "sdcard",
       1024U * 1024U * 100U,  /* 100 MB reserved space, to avoid filling the disk */
       false,
-      1024U * 1024U * 1024U * 4U - 1  /* ~4GB arbitrary max file size */);
+      0  /* no max file size, objects past 4GB are stored split */);
 
     MtpDatabase* mtp_database = new SwitchMtpDatabase();
 
@@ -196,12 +210,14 @@ int main(int argc, char* argv[])
       0,
       0,
       0);
+    server->setUploadDigests(!no_upload_digests);
   
     std::thread th(stop_thread, server); 
     server->addStorage(storage);
     server->run();
     th.join();
 
+    logStop();
     nxlinkStdioClose(serial_interface);
     consoleExit(NULL);
     usbExit();
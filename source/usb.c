@@ -16,6 +16,7 @@
 
 #include <string.h>
 #include <malloc.h>
+#include <stdatomic.h>
 
 #include "usb.h"
 
@@ -26,6 +27,8 @@ typedef struct {
     UsbDsEndpoint *endpoint;
     u8 *buffer;
     RwLock lock;
+    UEvent cancel;      // wakes up a transfer waiting on this endpoint
+    atomic_bool cancelled;
 } usbCommsEndpoint;
 
 typedef struct {
@@ -34,6 +37,7 @@ typedef struct {
     UsbDsInterface* interface;
     u32 endpoint_number;
     usbCommsEndpoint endpoint[TOTAL_ENDPOINTS];
+    u8 *ctrl_buffer;    // data stage of the control requests
 } usbCommsInterface;
 
 static bool g_usbCommsInitialized = false;
@@ -42,6 +46,10 @@ static bool g_usbCommsErrorHandling = 0;
 static RwLock g_usbCommsLock;
 static int ep_in = 1;
 static int ep_out = 1;
+//Pieces of bulk transfers that went through an endpoint buffer, because the caller's buffer was not page-aligned, and those that did not.
+static atomic_ullong g_usbCommsBounced;
+static atomic_ullong g_usbCommsBouncedBytes;
+static atomic_ullong g_usbCommsDirect;
 
 static Result _usbCommsInterfaceInit5x(u32 intf_ind, const UsbInterfaceDesc *info);
 static Result _usbCommsInterfaceInit(u32 intf_ind, const UsbInterfaceDesc *info);
@@ -171,6 +179,8 @@ static void _usbCommsInterfaceFree(usbCommsInterface *interface)
         interface->endpoint[i].buffer = NULL;
         rwlockWriteUnlock(&interface->endpoint[i].lock);
     }
+    free(interface->ctrl_buffer);
+    interface->ctrl_buffer = NULL;
 
     rwlockWriteUnlock(&interface->lock);
 }
@@ -234,8 +244,13 @@ static Result _usbCommsInterfaceInit5x(u32 intf_ind, const UsbInterfaceDesc *inf
             break;
         }
         memset(interface->endpoint[i].buffer, 0, 0x1000);
+        ueventCreate(&interface->endpoint[i].cancel, false);
+        atomic_store(&interface->endpoint[i].cancelled, false);
     }
     if (R_FAILED(rc)) return rc;
+
+    interface->ctrl_buffer = (u8*)memalign(0x1000, 0x1000);
+    if (interface->ctrl_buffer == NULL) return MAKERESULT(Module_Libnx, LibnxError_OutOfMemory);
     
     rc = usbDsRegisterInterface(&interface->interface);
     if (R_FAILED(rc)) return rc;
@@ -322,9 +337,13 @@ static Result _usbCommsTransfer(usbCommsEndpoint *ep, UsbDirection dir, const vo
     rc = usbDsWaitReady(UINT64_MAX);
     if (R_FAILED(rc)) return rc;
 
-    while(size)
+    //A zero-length transfer is posted too, it ends a data phase of unknown length.
+    do
     {
-        if(((u64)bufptr) & 0xfff)//When bufptr isn't page-aligned copy the data into g_usbComms_endpoint_in_buffer and transfer that, otherwise use the bufptr directly.
+        //Don't post anything once cancelled, an OUT transfer would consume data of the next transaction.
+        if (atomic_load(&ep->cancelled)) return MAKERESULT(Module_Libnx, LibnxError_IoError);
+
+        if((((u64)bufptr) & 0xfff) || size == 0)//When bufptr isn't page-aligned copy the data into g_usbComms_endpoint_in_buffer and transfer that, otherwise use the bufptr directly.
         {
             transfer_buffer = ep->buffer;
             memset(ep->buffer, 0, 0x1000);
@@ -337,20 +356,26 @@ static Result _usbCommsTransfer(usbCommsEndpoint *ep, UsbDirection dir, const vo
                 memcpy(ep->buffer, bufptr, chunksize);
 
             transfer_type = 0;
+            atomic_fetch_add_explicit(&g_usbCommsBounced, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&g_usbCommsBouncedBytes, chunksize, memory_order_relaxed);
         }
         else
         {
             transfer_buffer = bufptr;
             chunksize = size;
             transfer_type = 1;
+            atomic_fetch_add_explicit(&g_usbCommsDirect, 1, memory_order_relaxed);
         }
 
         //Start transfer.
         rc = usbDsEndpoint_PostBufferAsync(ep->endpoint, transfer_buffer, chunksize, &urbId);
         if(R_FAILED(rc))return rc;
 
-        //Wait for the transfer to finish.
-        rc = eventWait(&ep->endpoint->CompletionEvent, timeout);
+        //Wait for the transfer to finish, or for usbCancel().
+        s32 idx = 0;
+        rc = waitMulti(&idx, timeout, waiterForEvent(&ep->endpoint->CompletionEvent), waiterForUEvent(&ep->cancel));
+        if (R_SUCCEEDED(rc) && idx == 1)
+            rc = MAKERESULT(Module_Libnx, LibnxError_IoError);
 
         if (R_FAILED(rc))
         {
@@ -378,7 +403,7 @@ static Result _usbCommsTransfer(usbCommsEndpoint *ep, UsbDirection dir, const vo
         size-= tmp_transferredSize;
 
         if (tmp_transferredSize < chunksize) break;
-    }
+    } while(size);
 
     if (transferredSize) *transferredSize = total_transferredSize;
 
@@ -405,7 +430,7 @@ size_t usbTransfer(u32 interface, u32 endpoint, UsbDirection dir, void* buffer,
     if (R_FAILED(rc)) {
         rc2 = usbDsGetState(&state);
         if (R_SUCCEEDED(rc2)) {
-            if (state!=5) {
+            if (state!=5 && !atomic_load(&ep->cancelled)) {
                 rwlockWriteLock(&ep->lock);
                 rc = _usbCommsTransfer(ep, dir, buffer, size, timeout, &transferredSize); //If state changed during transfer, try again. usbDsWaitReady() will be called from this.
                 rwlockWriteUnlock(&ep->lock);
@@ -421,3 +446,113 @@ size_t usbTransfer(u32 interface, u32 endpoint, UsbDirection dir, void* buffer,
     }
     return transferredSize;
 }
+
+void usbCancel(u32 interface, u32 endpoint)
+{
+    usbCommsEndpoint *ep = &g_usbCommsInterfaces[interface].endpoint[endpoint];
+    atomic_store(&ep->cancelled, true);
+    ueventSignal(&ep->cancel);
+}
+
+void usbClearCancel(u32 interface, u32 endpoint)
+{
+    usbCommsEndpoint *ep = &g_usbCommsInterfaces[interface].endpoint[endpoint];
+    ueventClear(&ep->cancel);
+    atomic_store(&ep->cancelled, false);
+}
+
+bool usbIsCancelled(u32 interface, u32 endpoint)
+{
+    return atomic_load(&g_usbCommsInterfaces[interface].endpoint[endpoint].cancelled);
+}
+
+Result usbWaitControlRequest(u32 interface, UsbControlRequest *request, u64 timeout)
+{
+    Result rc;
+    usbCommsInterface *inter = &g_usbCommsInterfaces[interface];
+
+    rwlockReadLock(&inter->lock);
+    if (!inter->initialized) {
+        rwlockReadUnlock(&inter->lock);
+        //Nothing will come, but callers poll with this.
+        svcSleepThread(timeout);
+        return MAKERESULT(Module_Libnx, LibnxError_NotInitialized);
+    }
+    rwlockReadUnlock(&inter->lock);
+
+    rc = eventWait(&inter->interface->SetupEvent, timeout);
+    if (R_FAILED(rc)) return rc;
+    eventClear(&inter->interface->SetupEvent);
+
+    u8 setup[8];
+    rc = usbDsInterface_GetSetupPacket(inter->interface, setup, sizeof(setup));
+    if (R_FAILED(rc)) return rc;
+
+    request->bmRequestType = setup[0];
+    request->bRequest = setup[1];
+    request->wValue = setup[2] | (setup[3] << 8);
+    request->wIndex = setup[4] | (setup[5] << 8);
+    request->wLength = setup[6] | (setup[7] << 8);
+    return rc;
+}
+
+Result usbControlTransfer(u32 interface, UsbDirection dir, void* buffer, size_t size)
+{
+    Result rc;
+    u32 urbId = 0;
+    u32 transferredSize = 0;
+    UsbDsReportData reportdata;
+    usbCommsInterface *inter = &g_usbCommsInterfaces[interface];
+
+    if (size > 0x1000) return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+    if (dir == UsbDirection_Write && size)
+        memcpy(inter->ctrl_buffer, buffer, size);
+
+    if (dir == UsbDirection_Write) {
+        rc = usbDsInterface_CtrlInPostBufferAsync(inter->interface, inter->ctrl_buffer, size, &urbId);
+        if (R_FAILED(rc)) return rc;
+        rc = eventWait(&inter->interface->CtrlInCompletionEvent, UINT64_MAX);
+        if (R_FAILED(rc)) return rc;
+        eventClear(&inter->interface->CtrlInCompletionEvent);
+        rc = usbDsInterface_GetCtrlInReportData(inter->interface, &reportdata);
+    } else {
+        rc = usbDsInterface_CtrlOutPostBufferAsync(inter->interface, inter->ctrl_buffer, size, &urbId);
+        if (R_FAILED(rc)) return rc;
+        rc = eventWait(&inter->interface->CtrlOutCompletionEvent, UINT64_MAX);
+        if (R_FAILED(rc)) return rc;
+        eventClear(&inter->interface->CtrlOutCompletionEvent);
+        rc = usbDsInterface_GetCtrlOutReportData(inter->interface, &reportdata);
+    }
+    if (R_FAILED(rc)) return rc;
+
+    rc = usbDsParseReportData(&reportdata, urbId, NULL, &transferredSize);
+    if (R_FAILED(rc)) return rc;
+    if (transferredSize != size) return MAKERESULT(Module_Libnx, LibnxError_IoError);
+
+    if (dir == UsbDirection_Read && size)
+        memcpy(buffer, inter->ctrl_buffer, size);
+    return rc;
+}
+
+Result usbStallControl(u32 interface)
+{
+    return usbDsInterface_StallCtrl(g_usbCommsInterfaces[interface].interface);
+}
+
+u32 usbGetMaxPacketSize(void)
+{
+    UsbDeviceSpeed speed;
+    //Matches the bulk endpoint descriptors of _usbCommsInterfaceInit5x.
+    if (hosversionAtLeast(8,0,0) && R_SUCCEEDED(usbDsGetSpeed(&speed))) {
+        if (speed == UsbDeviceSpeed_Full) return 0x40;
+        if (speed == UsbDeviceSpeed_Super) return 0x400;
+    }
+    return 0x200;
+}
+
+void usbGetBounceStats(u64 *bounced, u64 *bouncedBytes, u64 *direct)
+{
+    *bounced = atomic_load_explicit(&g_usbCommsBounced, memory_order_relaxed);
+    *bouncedBytes = atomic_load_explicit(&g_usbCommsBouncedBytes, memory_order_relaxed);
+    *direct = atomic_load_explicit(&g_usbCommsDirect, memory_order_relaxed);
+}
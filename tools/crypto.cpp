@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// Portable SHA-256, CRC32 and CRC32C with the interface of libnx, which
+// uses the CPU's instructions for them on the console.
+
+#include <string.h>
+
+#include <switch.h>
+
+#define CRC32_POLYNOMIAL        0xEDB88320
+#define CRC32C_POLYNOMIAL       0x82F63B78
+
+static const u32 kSha256Init[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const u32 kSha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline u32 rotr(u32 value, int count) {
+    return (value >> count) | (value << (32 - count));
+}
+
+static void sha256Transform(u32* state, const u8* block) {
+    u32 w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = ((u32)block[4 * i] << 24) | ((u32)block[4 * i + 1] << 16)
+             | ((u32)block[4 * i + 2] << 8) | block[4 * i + 3];
+    for (int i = 16; i < 64; i++) {
+        u32 s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        u32 s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    u32 a = state[0], b = state[1], c = state[2], d = state[3];
+    u32 e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        u32 s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+        u32 ch = (e & f) ^ (~e & g);
+        u32 t1 = h + s1 + ch + kSha256K[i] + w[i];
+        u32 s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+        u32 maj = (a & b) ^ (a & c) ^ (b & c);
+        u32 t2 = s0 + maj;
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+void sha256ContextCreate(Sha256Context* out) {
+    memset(out, 0, sizeof(*out));
+    memcpy(out->intermediate_hash, kSha256Init, sizeof(kSha256Init));
+}
+
+void sha256ContextUpdate(Sha256Context* ctx, const void* src, size_t size) {
+    const u8* bytes = (const u8*)src;
+    ctx->bits_consumed += (u64)size * 8;
+    while (size > 0) {
+        size_t count = SHA256_BLOCK_SIZE - ctx->num_buffered;
+        if (count > size)
+            count = size;
+        memcpy(ctx->buffer + ctx->num_buffered, bytes, count);
+        ctx->num_buffered += count;
+        bytes += count;
+        size -= count;
+        if (ctx->num_buffered == SHA256_BLOCK_SIZE) {
+            sha256Transform(ctx->intermediate_hash, ctx->buffer);
+            ctx->num_buffered = 0;
+        }
+    }
+}
+
+void sha256ContextGetHash(Sha256Context* ctx, void* dst) {
+    if (!ctx->finalized) {
+        u64 bits = ctx->bits_consumed;
+        ctx->buffer[ctx->num_buffered++] = 0x80;
+        if (ctx->num_buffered > SHA256_BLOCK_SIZE - 8) {
+            memset(ctx->buffer + ctx->num_buffered, 0, SHA256_BLOCK_SIZE - ctx->num_buffered);
+            sha256Transform(ctx->intermediate_hash, ctx->buffer);
+            ctx->num_buffered = 0;
+        }
+        memset(ctx->buffer + ctx->num_buffered, 0, SHA256_BLOCK_SIZE - 8 - ctx->num_buffered);
+        for (int i = 0; i < 8; i++)
+            ctx->buffer[SHA256_BLOCK_SIZE - 8 + i] = bits >> (56 - 8 * i);
+        sha256Transform(ctx->intermediate_hash, ctx->buffer);
+        ctx->finalized = true;
+    }
+
+    u8* out = (u8*)dst;
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = ctx->intermediate_hash[i] >> 24;
+        out[4 * i + 1] = ctx->intermediate_hash[i] >> 16;
+        out[4 * i + 2] = ctx->intermediate_hash[i] >> 8;
+        out[4 * i + 3] = ctx->intermediate_hash[i];
+    }
+}
+
+static u32 crcCalculate(u32 polynomial, u32 seed, const void* src, size_t size) {
+    const u8* bytes = (const u8*)src;
+    u32 crc = ~seed;
+    while (size-- > 0) {
+        crc ^= *bytes++;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ ((crc & 1) ? polynomial : 0);
+    }
+    return ~crc;
+}
+
+u32 crc32CalculateWithSeed(u32 seed, const void* src, size_t size) {
+    return crcCalculate(CRC32_POLYNOMIAL, seed, src, size);
+}
+
+u32 crc32cCalculateWithSeed(u32 seed, const void* src, size_t size) {
+    return crcCalculate(CRC32C_POLYNOMIAL, seed, src, size);
+}
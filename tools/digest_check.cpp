@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// Checks MtpDigest, fed in pieces, against known values: the digests of
+// libnx on the console, the stand-ins of crypto.cpp here.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "MtpDigest.h"
+#include "mtp.h"
+
+using namespace android;
+
+int nxlink = 0;
+
+extern "C" Result fsdevSetConcatenationFileAttribute(const char* path) { return 0; }
+
+struct TestVector {
+    uint16_t        algorithm;
+    std::string     data;
+    const char*     digest;
+};
+
+static std::string toHex(const uint8_t* digest, int size) {
+    std::string hex;
+    char byte[3];
+    for (int i = 0; i < size; i++) {
+        snprintf(byte, sizeof(byte), "%02x", digest[i]);
+        hex += byte;
+    }
+    return hex;
+}
+
+int main(int argc, char* argv[]) {
+    TestVector vectors[] = {
+        { MTP_NX_DIGEST_CRC32,      "123456789",    "cbf43926" },
+        { MTP_NX_DIGEST_CRC32C,     "123456789",    "e3069283" },
+        { MTP_NX_DIGEST_ROLLING,    "123456789",    "091501dd" },
+        { MTP_NX_DIGEST_CRC32,      "",             "00000000" },
+        { MTP_NX_DIGEST_SHA256,     "",
+          "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+        { MTP_NX_DIGEST_SHA256,     "abc",
+          "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+        { MTP_NX_DIGEST_SHA256,     "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+          "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+        { MTP_NX_DIGEST_SHA256,     std::string(1000000, 'a'),
+          "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" },
+    };
+
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+        const TestVector& test = vectors[i];
+        MtpDigest digest(test.algorithm);
+        uint8_t value[MtpDigest::kMaxSize];
+
+        // twice, the second time after a reset and in pieces of growing size
+        for (int pass = 0; pass < 2; pass++) {
+            if (pass == 0) {
+                digest.update(test.data.data(), test.data.size());
+            } else {
+                digest.reset();
+                for (size_t offset = 0, size = 1; offset < test.data.size(); offset += size, size++)
+                    digest.update(test.data.data() + offset, std::min(size, test.data.size() - offset));
+            }
+            digest.finish(value);
+
+            std::string hex = toHex(value, MtpDigest::getSize(test.algorithm));
+            bool match = hex == test.digest && digest.getLength() == test.data.size();
+            printf("%04x %7zu bytes %s %s\n", test.algorithm, test.data.size(), hex.c_str(),
+                   match ? "ok" : "FAILED");
+            ok = match && ok;
+        }
+    }
+
+    printf("%s\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// Opens a storage again and again while files come and go between the
+// sessions, as the database does at every start, and checks that the
+// handles it hands out stay dense and that files that stayed keep theirs.
+
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+#include <errno.h>
+
+#include "SwitchMtpDatabase.h"
+#include "usb.h"
+
+using namespace android;
+
+int nxlink = 0;
+
+// the server is linked in but never runs, so there is no USB to speak of
+extern "C" size_t usbTransfer(u32 interface, u32 endpoint, UsbDirection dir,
+                              void* buffer, size_t size, u64 timeout) {
+    errno = EIO;
+    return -1;
+}
+extern "C" u32 usbGetMaxPacketSize(void) { return 512; }
+extern "C" void usbCancel(u32 interface, u32 endpoint) {}
+extern "C" void usbClearCancel(u32 interface, u32 endpoint) {}
+extern "C" bool usbIsCancelled(u32 interface, u32 endpoint) { return false; }
+extern "C" void usbGetBounceStats(u64* bounced, u64* bouncedBytes, u64* direct) {
+    *bounced = *bouncedBytes = *direct = 0;
+}
+extern "C" Result usbWaitControlRequest(u32 interface, UsbControlRequest* request, u64 timeout) {
+    return 1;
+}
+extern "C" Result usbControlTransfer(u32 interface, UsbDirection dir, void* buffer, size_t size) {
+    return 0;
+}
+extern "C" Result usbStallControl(u32 interface) { return 0; }
+extern "C" void randomGet(void* buf, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        ((uint8_t*)buf)[i] = rand();
+}
+extern "C" void consoleUpdate(void* console) {}
+extern "C" Result svcSetThreadPriority(Handle handle, u32 priority) { return 0; }
+extern "C" Result fsdevSetConcatenationFileAttribute(const char* path) { return 0; }
+
+static const int kFiles = 100;
+// files replaced between two sessions
+static const int kChurn = 20;
+static const int kSessions = 30;
+// the root, the state directory and what the server puts in it
+static const int kGenerated = 8;
+
+static void createFile(const std::string& path) {
+    std::ofstream file(path.c_str());
+    file << path;
+}
+
+int main(int argc, char* argv[]) {
+    char root[] = "/tmp/handles_check.XXXXXX";
+    if (!mkdtemp(root)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    logStart(NULL);
+    std::string keep = std::string(root) + "/keep";
+    createFile(keep);
+    for (int i = 0; i < kFiles; i++)
+        createFile(std::string(root) + "/file" + std::to_string(i));
+
+    bool ok = true;
+    MtpObjectHandle keepHandle = 0;
+    int next = 0;
+    for (int session = 0; session < kSessions && ok; session++) {
+        // load, which prunes the ids of what went away, a session, save
+        SwitchMtpDatabase* database = new SwitchMtpDatabase();
+        database->addStoragePath(root, "root", MTP_STORAGE_REMOVABLE_RAM, true);
+        database->sessionStarted(NULL);
+
+        MtpObjectHandleList* list = database->getObjectList(MTP_STORAGE_REMOVABLE_RAM, 0, 0);
+        MtpObjectHandle highest = 0;
+        for (size_t i = 0; list && i < list->size(); i++) {
+            MtpObjectHandle handle = (*list)[i];
+            MtpString path;
+            int64_t length;
+            MtpObjectFormat format;
+            if (database->getObjectFilePath(handle, path, length, format) == MTP_RESPONSE_OK && path == keep) {
+                if (keepHandle != 0 && keepHandle != handle) {
+                    printf("session %d: handle of keep went from %u to %u\n", session, keepHandle, handle);
+                    ok = false;
+                }
+                keepHandle = handle;
+            }
+            highest = std::max(highest, handle);
+        }
+
+        // what the previous session removed is free again by now, what
+        // this one removes is not yet
+        size_t listed = list ? list->size() : 0;
+        if (highest > listed + kChurn + kGenerated) {
+            printf("session %d: highest handle %u for %zu objects\n", session, highest, listed);
+            ok = false;
+        }
+        delete list;
+
+        database->sessionEnded();
+        delete database;
+
+        for (int i = 0; i < kChurn; i++, next++) {
+            std::filesystem::remove(std::string(root) + "/file" + std::to_string(next));
+            createFile(std::string(root) + "/file" + std::to_string(next + kFiles));
+        }
+    }
+    if (keepHandle == 0) {
+        printf("keep was not listed\n");
+        ok = false;
+    }
+
+    logStop();
+    std::filesystem::remove_all(root);
+
+    printf("%s\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
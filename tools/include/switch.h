@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// The parts of libnx the server sources use outside of usb.c and main.cpp,
+// for building them on the host. The hashes are in crypto.cpp, the other
+// functions are defined by the program that is linked with them.
+
+#ifndef _TOOLS_SWITCH_H
+#define _TOOLS_SWITCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t s32;
+typedef int64_t s64;
+typedef u32 Result;
+typedef u32 Handle;
+
+#define R_SUCCEEDED(res)    ((res) == 0)
+#define R_FAILED(res)       ((res) != 0)
+
+#define CUR_THREAD_HANDLE   0xFFFF8000
+
+#define USB_CLASS_VENDOR_SPEC           0xff
+#define USB_DT_INTERFACE                0x04
+#define USB_DT_ENDPOINT                 0x05
+#define USB_DT_INTERFACE_SIZE           9
+#define USB_DT_ENDPOINT_SIZE            7
+#define USB_ENDPOINT_IN                 0x80
+#define USB_ENDPOINT_OUT                0x00
+#define USB_TRANSFER_TYPE_BULK          0x02
+#define USB_TRANSFER_TYPE_INTERRUPT     0x03
+
+struct usb_interface_descriptor {
+    u8 bLength;
+    u8 bDescriptorType;
+    u8 bInterfaceNumber;
+    u8 bAlternateSetting;
+    u8 bNumEndpoints;
+    u8 bInterfaceClass;
+    u8 bInterfaceSubClass;
+    u8 bInterfaceProtocol;
+    u8 iInterface;
+};
+
+struct usb_endpoint_descriptor {
+    u8 bLength;
+    u8 bDescriptorType;
+    u8 bEndpointAddress;
+    u8 bmAttributes;
+    u16 wMaxPacketSize;
+    u8 bInterval;
+};
+
+#define SHA256_HASH_SIZE                0x20
+#define SHA256_BLOCK_SIZE               0x40
+
+typedef struct {
+    u32 intermediate_hash[SHA256_HASH_SIZE / sizeof(u32)];
+    u8 buffer[SHA256_BLOCK_SIZE];
+    size_t num_buffered;
+    u64 bits_consumed;
+    bool finalized;
+} Sha256Context;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void sha256ContextCreate(Sha256Context* out);
+void sha256ContextUpdate(Sha256Context* ctx, const void* src, size_t size);
+void sha256ContextGetHash(Sha256Context* ctx, void* dst);
+// seed is the result over the data before, 0 to start
+u32 crc32CalculateWithSeed(u32 seed, const void* src, size_t size);
+u32 crc32cCalculateWithSeed(u32 seed, const void* src, size_t size);
+
+void randomGet(void* buf, size_t len);
+void consoleUpdate(void* console);
+Result svcSetThreadPriority(Handle handle, u32 priority);
+Result fsdevSetConcatenationFileAttribute(const char* path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _TOOLS_SWITCH_H
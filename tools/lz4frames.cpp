@@ -0,0 +1,275 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// Host side of compressed data phases. Decodes the frames of an object
+// received with MTP_NX_COMPRESSION_LZ4, encodes a file the way the server
+// sends it, and checks that what MtpLz4 writes is read back the same by a
+// decoder written from the LZ4 block format description alone.
+//
+//   lz4frames -d < frames > data
+//   lz4frames -c < data > frames
+//   lz4frames -t [file ...]
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "MtpCompressor.h"
+#include "MtpLz4.h"
+#include "mtp.h"
+
+using namespace android;
+
+// constraints of the block format that every encoder has to keep
+#define MIN_MATCH               4
+#define LAST_LITERALS           5
+#define MATCH_LIMIT             12
+
+static inline void putUInt32(uint8_t* p, uint32_t value) {
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = value >> 24;
+}
+
+static inline uint32_t getUInt32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool readLength(const uint8_t*& ip, const uint8_t* end, size_t& length) {
+    uint8_t next;
+    do {
+        if (ip >= end)
+            return false;
+        next = *ip++;
+        length += next;
+    } while (next == 255);
+    return true;
+}
+
+// decodes a block of exactly dataLength bytes, false if src is malformed
+// or breaks the end of block rules
+static bool referenceDecompress(const uint8_t* src, size_t length,
+                                uint8_t* dst, size_t dataLength) {
+    const uint8_t* ip = src;
+    const uint8_t* const end = src + length;
+    size_t op = 0;
+
+    for (;;) {
+        if (ip >= end)
+            return false;
+        unsigned token = *ip++;
+
+        size_t literals = token >> 4;
+        if (literals == 15 && !readLength(ip, end, literals))
+            return false;
+        if ((size_t)(end - ip) < literals || dataLength - op < literals)
+            return false;
+        memcpy(dst + op, ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == end)
+            return op == dataLength;
+
+        if (end - ip < 2)
+            return false;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t matched = token & 15;
+        if (matched == 15 && !readLength(ip, end, matched))
+            return false;
+        matched += MIN_MATCH;
+
+        if (offset == 0 || offset > op)
+            return false;
+        if (op + MATCH_LIMIT > dataLength || matched > dataLength - LAST_LITERALS - op)
+            return false;
+        // byte by byte, the match may overlap what it copies
+        for (size_t i = 0; i < matched; i++, op++)
+            dst[op] = dst[op - offset];
+    }
+}
+
+// the frames of data as MtpCompressor::compress() makes them, end frame
+// included
+static void encode(const uint8_t* data, size_t length, std::vector<uint8_t>& frames) {
+    uint8_t frame[MtpCompressor::kMaxFrameSize];
+    for (size_t offset = 0; offset < length; ) {
+        size_t chunk = length - offset;
+        if (chunk > MtpCompressor::kChunkSize)
+            chunk = MtpCompressor::kChunkSize;
+        uint8_t* payload = frame + MtpCompressor::kFrameHeaderSize;
+        size_t payloadLength = MtpLz4::compress(data + offset, chunk, payload, chunk - chunk / 16);
+        if (payloadLength > 0) {
+            putUInt32(frame, payloadLength);
+        } else {
+            memcpy(payload, data + offset, chunk);
+            payloadLength = chunk;
+            putUInt32(frame, payloadLength | MtpCompressor::kFrameRaw);
+        }
+        putUInt32(frame + 4, chunk);
+        frames.insert(frames.end(), frame, payload + payloadLength);
+        offset += chunk;
+    }
+
+    putUInt32(frame, 0);
+    putUInt32(frame + 4, 0);
+    frames.insert(frames.end(), frame, frame + MtpCompressor::kFrameHeaderSize);
+}
+
+// appends what frames hold to data, false unless they end properly. A
+// data phase as captured from USB starts with its container header, which
+// is skipped, and may go on past the end frame.
+static bool decode(const uint8_t* frames, size_t length, std::vector<uint8_t>& data,
+                   bool reference) {
+    uint8_t chunk[MtpCompressor::kChunkSize];
+    size_t offset = 0;
+    // 0xFFFFFFFF does not start a valid frame
+    if (length >= MTP_CONTAINER_HEADER_SIZE && getUInt32(frames) == 0xFFFFFFFF
+            && frames[4] == MTP_CONTAINER_TYPE_DATA && frames[5] == 0)
+        offset = MTP_CONTAINER_HEADER_SIZE;
+    for (;;) {
+        if (length - offset < MtpCompressor::kFrameHeaderSize) {
+            fprintf(stderr, "stream ends without an end frame at %zu\n", offset);
+            return false;
+        }
+        uint32_t header = getUInt32(frames + offset);
+        bool raw = (header & MtpCompressor::kFrameRaw) != 0;
+        size_t payloadLength = header & ~MtpCompressor::kFrameRaw;
+        size_t dataLength = getUInt32(frames + offset + 4);
+        if (dataLength > MtpCompressor::kChunkSize || payloadLength > MtpCompressor::kChunkSize
+                || (raw && payloadLength != dataLength)) {
+            fprintf(stderr, "bad frame header at %zu\n", offset);
+            return false;
+        }
+        if (length - offset - MtpCompressor::kFrameHeaderSize < payloadLength) {
+            fprintf(stderr, "stream ends in the frame at %zu\n", offset);
+            return false;
+        }
+        offset += MtpCompressor::kFrameHeaderSize;
+        if (dataLength == 0)
+            return true;
+
+        const uint8_t* payload = frames + offset;
+        bool ok;
+        if (raw) {
+            memcpy(chunk, payload, dataLength);
+            ok = true;
+        } else if (reference) {
+            ok = referenceDecompress(payload, payloadLength, chunk, dataLength);
+        } else {
+            ok = MtpLz4::decompress(payload, payloadLength, chunk, sizeof(chunk))
+                    == (ssize_t)dataLength;
+        }
+        if (!ok) {
+            fprintf(stderr, "bad LZ4 block in the frame at %zu\n",
+                    offset - MtpCompressor::kFrameHeaderSize);
+            return false;
+        }
+        data.insert(data.end(), chunk, chunk + dataLength);
+        offset += payloadLength;
+    }
+}
+
+static bool readAll(FILE* file, std::vector<uint8_t>& data) {
+    uint8_t buffer[65536];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        data.insert(data.end(), buffer, buffer + length);
+    return !ferror(file);
+}
+
+static bool writeAll(FILE* file, const std::vector<uint8_t>& data) {
+    return fwrite(data.data(), 1, data.size(), file) == data.size() && fflush(file) == 0;
+}
+
+static bool roundTrip(const char* name, const std::vector<uint8_t>& data) {
+    std::vector<uint8_t> frames, reference, own;
+    encode(data.data(), data.size(), frames);
+    bool ok = decode(frames.data(), frames.size(), reference, true) && reference == data
+            && decode(frames.data(), frames.size(), own, false) && own == data;
+    printf("%-40s %10zu -> %10zu %s\n", name, data.size(), frames.size(), ok ? "ok" : "FAILED");
+    return ok;
+}
+
+// what compresses well, what does not, and the lengths the end of block
+// rules and the chunking are about
+static bool roundTripSamples() {
+    static const size_t lengths[] = { 0, 1, 12, 13, 17, 4096, 65535, 65536, 65537, 300000 };
+    bool ok = true;
+    uint32_t seed = 1;
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        std::vector<uint8_t> zeros(lengths[i], 0), random(lengths[i]), text(lengths[i]);
+        for (size_t j = 0; j < lengths[i]; j++) {
+            seed = seed * 1103515245 + 12345;
+            random[j] = seed >> 24;
+            // runs of words with mistakes in them
+            text[j] = "the quick brown fox "[j % 20] ^ ((seed >> 16) % 61 == 0);
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "zeros %zu", lengths[i]);
+        ok = roundTrip(name, zeros) && ok;
+        snprintf(name, sizeof(name), "random %zu", lengths[i]);
+        ok = roundTrip(name, random) && ok;
+        snprintf(name, sizeof(name), "text %zu", lengths[i]);
+        ok = roundTrip(name, text) && ok;
+    }
+    return ok;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc >= 2 && strcmp(argv[1], "-t") == 0) {
+        bool ok = true;
+        if (argc == 2)
+            ok = roundTripSamples();
+        for (int i = 2; i < argc; i++) {
+            std::vector<uint8_t> data;
+            FILE* file = fopen(argv[i], "rb");
+            if (!file || !readAll(file, data)) {
+                fprintf(stderr, "could not read %s\n", argv[i]);
+                ok = false;
+            } else {
+                ok = roundTrip(argv[i], data) && ok;
+            }
+            if (file)
+                fclose(file);
+        }
+        return ok ? 0 : 1;
+    }
+
+    if (argc != 2 || (strcmp(argv[1], "-c") != 0 && strcmp(argv[1], "-d") != 0)) {
+        fprintf(stderr, "usage: %s -c|-d < input > output\n"
+                        "       %s -t [file ...]\n", argv[0], argv[0]);
+        return 2;
+    }
+
+    std::vector<uint8_t> input, output;
+    if (!readAll(stdin, input)) {
+        perror("read");
+        return 1;
+    }
+    if (argv[1][1] == 'c')
+        encode(input.data(), input.size(), output);
+    else if (!decode(input.data(), input.size(), output, true))
+        return 1;
+    if (!writeAll(stdout, output)) {
+        perror("write");
+        return 1;
+    }
+    return 0;
+}
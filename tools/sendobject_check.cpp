@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// Uploads objects to the server through its request loop, as a host would,
+// with the USB transfers scripted, and checks the responses and what ends
+// up on disk. Objects announced with a size of 0xFFFFFFFF are what the
+// data phase brings, down to the first transfer.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+
+#include "MtpServer.h"
+#include "MtpSplitFile.h"
+#include "MtpStorage.h"
+#include "SwitchMtpDatabase.h"
+#include "usb.h"
+
+using namespace android;
+
+int nxlink = 0;
+
+static MtpServer* sServer;
+// host to device transfers still to come, each ends with a short packet
+static std::deque<std::vector<uint8_t> > sTransfers;
+static size_t sTransferOffset;
+static std::vector<uint16_t> sResponses;
+
+extern "C" size_t usbTransfer(u32 interface, u32 endpoint, UsbDirection dir,
+                              void* buffer, size_t size, u64 timeout) {
+    if (dir == UsbDirection_Write) {
+        const uint8_t* container = (const uint8_t*)buffer;
+        if (size >= MTP_CONTAINER_HEADER_SIZE && container[4] == MTP_CONTAINER_TYPE_RESPONSE)
+            sResponses.push_back(container[6] | (container[7] << 8));
+        return size;
+    }
+
+    if (sTransfers.empty()) {
+        // nothing left to say, the server stops at its idle timeout
+        sServer->stop();
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    std::vector<uint8_t>& transfer = sTransfers.front();
+    size_t count = std::min(size, transfer.size() - sTransferOffset);
+    memcpy(buffer, transfer.data() + sTransferOffset, count);
+    sTransferOffset += count;
+    if (sTransferOffset == transfer.size()) {
+        sTransfers.pop_front();
+        sTransferOffset = 0;
+    }
+    return count;
+}
+
+extern "C" u32 usbGetMaxPacketSize(void) { return 512; }
+extern "C" void usbCancel(u32 interface, u32 endpoint) {}
+extern "C" void usbClearCancel(u32 interface, u32 endpoint) {}
+extern "C" bool usbIsCancelled(u32 interface, u32 endpoint) { return false; }
+extern "C" void usbGetBounceStats(u64* bounced, u64* bouncedBytes, u64* direct) {
+    *bounced = *bouncedBytes = *direct = 0;
+}
+extern "C" Result usbWaitControlRequest(u32 interface, UsbControlRequest* request, u64 timeout) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    return 1;
+}
+extern "C" Result usbControlTransfer(u32 interface, UsbDirection dir, void* buffer, size_t size) {
+    return 0;
+}
+extern "C" Result usbStallControl(u32 interface) { return 0; }
+
+extern "C" void randomGet(void* buf, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        ((uint8_t*)buf)[i] = rand();
+}
+extern "C" void consoleUpdate(void* console) {}
+extern "C" Result svcSetThreadPriority(Handle handle, u32 priority) { return 0; }
+extern "C" Result fsdevSetConcatenationFileAttribute(const char* path) { return 0; }
+
+static void put16(std::vector<uint8_t>& v, uint16_t value) {
+    v.push_back(value & 0xFF);
+    v.push_back(value >> 8);
+}
+
+static void put32(std::vector<uint8_t>& v, uint32_t value) {
+    put16(v, value & 0xFFFF);
+    put16(v, value >> 16);
+}
+
+static void putString(std::vector<uint8_t>& v, const char* s) {
+    size_t length = strlen(s);
+    v.push_back(length ? length + 1 : 0);
+    for (size_t i = 0; length && i <= length; i++)
+        put16(v, (uint8_t)s[i]);
+}
+
+static std::vector<uint8_t> container(uint16_t type, uint16_t code, uint32_t transaction,
+                                      uint32_t length) {
+    std::vector<uint8_t> v;
+    put32(v, length);
+    put16(v, type);
+    put16(v, code);
+    put32(v, transaction);
+    return v;
+}
+
+static void sendRequest(uint16_t code, uint32_t transaction, std::vector<uint32_t> parameters) {
+    std::vector<uint8_t> v = container(MTP_CONTAINER_TYPE_COMMAND, code, transaction,
+                                       MTP_CONTAINER_HEADER_SIZE + 4 * parameters.size());
+    for (size_t i = 0; i < parameters.size(); i++)
+        put32(v, parameters[i]);
+    sTransfers.push_back(v);
+}
+
+static void sendData(uint16_t code, uint32_t transaction, const std::vector<uint8_t>& data,
+                     bool unknownLength, bool headerApart = false) {
+    std::vector<uint8_t> v = container(MTP_CONTAINER_TYPE_DATA, code, transaction,
+            unknownLength ? 0xFFFFFFFF : MTP_CONTAINER_HEADER_SIZE + data.size());
+    if (headerApart) {
+        sTransfers.push_back(v);
+        v.clear();
+    }
+    v.insert(v.end(), data.begin(), data.end());
+    sTransfers.push_back(v);
+    // a zero length packet ends a transfer of whole packets
+    if (v.size() % usbGetMaxPacketSize() == 0)
+        sTransfers.push_back(std::vector<uint8_t>());
+}
+
+struct Upload {
+    const char*             name;
+    size_t                  length;
+    bool                    unknownLength;
+    // the container header goes in a transfer of its own
+    bool                    headerApart;
+    std::vector<uint8_t>    data;
+};
+
+static void sendObject(uint32_t& transaction, Upload& upload) {
+    std::vector<uint8_t> info;
+    put32(info, MTP_STORAGE_REMOVABLE_RAM);
+    put16(info, MTP_FORMAT_UNDEFINED);
+    put16(info, 0);
+    put32(info, upload.unknownLength ? 0xFFFFFFFF : upload.length);
+    put16(info, 0);
+    for (int i = 0; i < 7; i++)
+        put32(info, 0);
+    put16(info, 0);
+    put32(info, 0);
+    put32(info, 0);
+    putString(info, upload.name);
+    putString(info, "");
+    putString(info, "");
+    putString(info, "");
+
+    sendRequest(MTP_OPERATION_SEND_OBJECT_INFO, ++transaction, { MTP_STORAGE_REMOVABLE_RAM, MTP_PARENT_ROOT });
+    sendData(MTP_OPERATION_SEND_OBJECT_INFO, transaction, info, false);
+
+    upload.data.resize(upload.length);
+    for (size_t i = 0; i < upload.length; i++)
+        upload.data[i] = rand();
+    sendRequest(MTP_OPERATION_SEND_OBJECT, ++transaction, {});
+    sendData(MTP_OPERATION_SEND_OBJECT, transaction, upload.data, upload.unknownLength,
+             upload.headerApart);
+}
+
+static bool checkFile(const std::string& path, const Upload& upload) {
+    MtpSplitFile file;
+    struct stat st;
+    if (!file.open(path.c_str(), O_RDONLY) || file.fstat(&st) != 0) {
+        printf("%-24s missing\n", upload.name);
+        return false;
+    }
+    std::vector<uint8_t> data(upload.length + 1);
+    ssize_t length = file.pread(data.data(), data.size(), 0);
+    bool ok = (uint64_t)st.st_size == upload.length && length == (ssize_t)upload.length
+            && memcmp(data.data(), upload.data.data(), upload.length) == 0;
+    printf("%-24s %8zu bytes, %8lld on disk %s\n", upload.name, upload.length,
+           (long long)st.st_size, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main(int argc, char* argv[]) {
+    char root[] = "/tmp/sendobject_check.XXXXXX";
+    if (!mkdtemp(root)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    // whole data phase in the first transfer, more after it, ending with
+    // a zero length packet after the first transfer or a later one, and
+    // the same with the size known up front, the small ones also with the
+    // container header in a transfer of its own
+    Upload uploads[] = {
+        { "unknown-short.bin",  200,    true,   false },
+        { "unknown-long.bin",   100000, true,   false },
+        { "unknown-500.bin",    500,    true,   false },
+        { "unknown-16884.bin",  16884,  true,   false },
+        { "known-short.bin",    200,    false,  false },
+        { "known-500.bin",      500,    false,  false },
+        { "known-long.bin",     100000, false,  false },
+        { "apart-short.bin",    200,    false,  true },
+        { "apart-500.bin",      500,    false,  true },
+    };
+    const size_t count = sizeof(uploads) / sizeof(uploads[0]);
+
+    uint32_t transaction = 0;
+    sendRequest(MTP_OPERATION_OPEN_SESSION, transaction, { 1 });
+    for (size_t i = 0; i < count; i++)
+        sendObject(transaction, uploads[i]);
+    sendRequest(MTP_OPERATION_CLOSE_SESSION, ++transaction, {});
+
+    logStart(NULL);
+    UsbInterfaceDesc desc;
+    USBMtpInterface* usb = new USBMtpInterface(0, &desc);
+    MtpStorage* storage = new MtpStorage(MTP_STORAGE_REMOVABLE_RAM, root, "root", 0, false, 0);
+    MtpDatabase* database = new SwitchMtpDatabase();
+    database->addStoragePath(root, "root", MTP_STORAGE_REMOVABLE_RAM, true);
+    sServer = new MtpServer(usb, database, false, 0, 0664, 0775);
+    sServer->addStorage(storage);
+    sServer->run();
+
+    bool ok = sTransfers.empty();
+    if (!ok)
+        printf("%zu transfers were not read\n", sTransfers.size());
+    // OpenSession, SendObjectInfo and SendObject for each, CloseSession
+    ok = sResponses.size() == 2 + 2 * count && ok;
+    for (size_t i = 0; i < sResponses.size(); i++) {
+        if (sResponses[i] != MTP_RESPONSE_OK) {
+            printf("response %zu is %04x\n", i, sResponses[i]);
+            ok = false;
+        }
+    }
+    for (size_t i = 0; i < count; i++)
+        ok = checkFile(std::string(root) + "/" + uploads[i].name, uploads[i]) && ok;
+
+    delete sServer;
+    delete database;
+    delete storage;
+    delete usb;
+    logStop();
+    std::filesystem::remove_all(root);
+
+    printf("%s\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}